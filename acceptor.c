@@ -0,0 +1,365 @@
+/* An acceptor that lexes request heads and hands the connections to worker
+ * processes by Host, without a proxy hop or lexing the head twice.
+ *
+ *   ./acceptor 8080 4
+ *
+ * The acceptor reads up to HL_HEADER_END. It then sends the socket with
+ * SCM_RIGHTS to the worker that the Host hashes to, along with a struct head
+ * that says where the method, URL and Host are, a snapshot of the lexer and
+ * the bytes read so far. The worker restores the lexer and lexes the body
+ * from where the acceptor stopped.
+ *
+ * The acceptor reads heads from many connections at once with poll(). A
+ * timer wheel (timer.h) closes those whose head isn't in within
+ * HEAD_SECONDS, so slow clients can't tie it up.
+ *
+ * One request per connection, to keep it short.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "hl.h"
+#include "timer.h"
+
+#define HEAD_MAX 16384
+#define WORKERS_MAX 64
+#define CONNS_MAX 256
+#define HEAD_SECONDS 10
+
+/* A worker's reply: status, length, text. */
+#define REPLY \
+  "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: %d\r\n\r\n%s"
+
+/* What the acceptor found in the head. Offsets are into the bytes sent with
+ * it; a length of 0 means absent.
+ */
+struct head {
+  unsigned char method; /* HL_METHOD_* */
+  unsigned short url, url_len;
+  unsigned short host, host_len;
+  unsigned short head_len; /* Bytes up to HL_HEADER_END. */
+  unsigned short len; /* Bytes sent: the head and any body after it. */
+  unsigned short snapshot_len;
+};
+
+/* A struct head, then the lexer snapshot, then the bytes. */
+struct handoff {
+  struct head head;
+  unsigned char snapshot[HL_LEXER_SNAPSHOT_MAX];
+  char buf[HEAD_MAX];
+};
+
+static void die(const char* what) {
+  perror(what);
+  exit(1);
+}
+
+/* Sends msg and fd over the unix socket sock. */
+static int send_fd(int sock, int fd, const void* msg, size_t len) {
+  struct msghdr mh;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr* cmsg;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = (void*)msg;
+  iov.iov_len = len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(sock, &mh, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/* Receives a message of at most len bytes into msg, and the fd sent with
+ * it. Returns the length, or -1.
+ */
+static ssize_t recv_fd(int sock, int* fd, void* msg, size_t len) {
+  struct msghdr mh;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr* cmsg;
+  ssize_t n;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = msg;
+  iov.iov_len = len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  n = recvmsg(sock, &mh, 0);
+  if (n <= 0) return -1;
+  cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+  memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  return n;
+}
+
+/* A connection whose head is being read. */
+struct conn {
+  int fd; /* -1 if the slot is free. */
+  hl_lexer lexer;
+  hl_timer timer;
+  size_t pos;
+  long start; /* of a token split between reads */
+  struct handoff h;
+};
+
+static const char* const names[] = { "Host" };
+static hl_header_set set;
+static hl_limits limits;
+
+static void conn_init(struct conn* c, int fd) {
+  c->fd = fd;
+  hl_req_init(&c->lexer);
+  hl_set_headers(&c->lexer, &set);
+  hl_set_limits(&c->lexer, &limits);
+  hl_set_tokens(&c->lexer, HL_TOKEN_BIT(HL_URL) | HL_TOKEN_BIT(HL_VALUE) |
+                           HL_TOKEN_BIT(HL_HEADER_END));
+  c->pos = 0;
+  c->start = -1;
+  memset(&c->h.head, 0, sizeof(c->h.head));
+}
+
+/* Reads what there is from c and fills in c->h. Returns 1 at HL_HEADER_END,
+ * 0 if more is needed, or -1 if the connection closed or isn't HTTP.
+ */
+static int read_head(struct conn* c) {
+  struct handoff* h = &c->h;
+  hl_token token;
+  ssize_t n;
+
+  n = read(c->fd, h->buf + h->head.len, HEAD_MAX - h->head.len);
+  if (n <= 0) return -1;
+  h->head.len += n;
+
+  /* pos may stop short of len; see hl_set_headers(). */
+  for (;;) {
+    token = hl_execute(&c->lexer, h->buf + c->pos, h->head.len - c->pos);
+    if (token.kind == HL_ERROR) return -1;
+    c->pos = token.end - h->buf;
+    if (token.kind == HL_EAGAIN) return 0;
+
+    /* The whole head stays in buf, so a split token is one span. */
+    if (c->start < 0) c->start = token.start - h->buf;
+    if (token.partial) return 0;
+
+    if (token.kind == HL_URL) {
+      h->head.url = c->start;
+      h->head.url_len = c->pos - c->start;
+    } else if (token.kind == HL_VALUE) {
+      h->head.host = c->start; /* The only field in the set. */
+      h->head.host_len = c->pos - c->start;
+    } else if (token.kind == HL_HEADER_END) {
+      h->head.method = c->lexer.method;
+      h->head.head_len = c->pos;
+      /* The mask is in the snapshot, and the worker wants the rest. */
+      hl_set_tokens(&c->lexer, ~0u);
+      n = hl_lexer_serialize(&c->lexer, h->snapshot, sizeof(h->snapshot));
+      assert(n > 0);
+      h->head.snapshot_len = n;
+      return 1;
+    }
+    c->start = -1;
+  }
+}
+
+static unsigned int hash(const char* s, size_t len) {
+  unsigned int h = 2166136261u;
+
+  while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+  return h;
+}
+
+/* Serves the connections sent over sock. */
+static void worker(int id, int sock) {
+  struct handoff h;
+  hl_lexer lexer;
+  hl_token token;
+  char text[HEAD_MAX + 64];
+  char reply[sizeof(REPLY) + sizeof("400 Bad Request") + 10 + sizeof(text)];
+  const char* data;
+  size_t body;
+  ssize_t n;
+  int fd;
+
+  while ((n = recv_fd(sock, &fd, &h, sizeof(h))) > 0) {
+    if (hl_lexer_restore(&lexer, h.snapshot, h.head.snapshot_len) < 0) {
+      close(fd);
+      continue;
+    }
+
+    /* What the worker would route on. The head stays in h.buf. */
+    sprintf(text, "worker %d: %s %.*s%.*s", id,
+            h.head.method == HL_METHOD_POST ? "POST" : "not POST",
+            (int)h.head.host_len, h.buf + h.head.host,
+            (int)h.head.url_len, h.buf + h.head.url);
+
+    /* The body, from the bytes the acceptor read on. */
+    data = h.buf + h.head.head_len;
+    n = h.head.len - h.head.head_len;
+    body = 0;
+    for (;;) {
+      token = hl_execute(&lexer, data, n);
+      if (token.kind == HL_BODY) body += token.end - token.start;
+      if (token.kind == HL_MSG_END || token.kind == HL_ERROR) break;
+      n -= token.end - data;
+      data = token.end;
+      if (n == 0 && (token.kind == HL_EAGAIN || token.partial)) {
+        data = h.buf;
+        n = read(fd, h.buf, sizeof(h.buf));
+        if (n <= 0) break;
+      }
+    }
+    sprintf(text + strlen(text), ", %lu body bytes\n", (unsigned long)body);
+
+    n = sprintf(reply, REPLY,
+                token.kind == HL_MSG_END ? "200 OK" : "400 Bad Request",
+                (int)strlen(text), text);
+    if (write(fd, reply, n) != n) perror("write");
+    close(fd);
+  }
+  exit(0);
+}
+
+static void conn_close(hl_wheel* wheel, struct conn* c) {
+  hl_wheel_set(wheel, &c->timer, HL_TIMER_OFF);
+  close(c->fd);
+  c->fd = -1;
+}
+
+int main(int argc, char** argv) {
+  static const char timeout[] =
+      "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\n\r\n";
+  static struct conn conns[CONNS_MAX];
+  struct pollfd fds[CONNS_MAX + 1];
+  struct conn* polled[CONNS_MAX + 1];
+  int socks[WORKERS_MAX];
+  struct sockaddr_in addr;
+  hl_timeouts timeouts;
+  hl_wheel wheel;
+  hl_timer* timer;
+  struct conn* c;
+  int workers, listener, fd, pair[2], k, n, one = 1;
+  pid_t pid;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s port workers\n", argv[0]);
+    return 1;
+  }
+  workers = atoi(argv[2]);
+  if (workers < 1 || workers > WORKERS_MAX) workers = 1;
+  signal(SIGPIPE, SIG_IGN);
+
+  for (k = 0; k < workers; k++) {
+    /* SOCK_SEQPACKET keeps each handoff in one message. */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0) die("socketpair");
+    pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+      close(pair[0]);
+      worker(k, pair[1]);
+    }
+    close(pair[1]);
+    socks[k] = pair[0];
+  }
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) die("socket");
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((unsigned short)atoi(argv[1]));
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) die("bind");
+  if (listen(listener, 128) < 0) die("listen");
+
+  hl_header_set_init(&set, names, 1);
+  hl_limits_init(&limits);
+  limits.header = HEAD_MAX;
+  /* Ticks are seconds. The head is timed from accept(), not HL_MSG_START,
+   * so a client that sends nothing is cut off too.
+   */
+  memset(&timeouts, 0, sizeof(timeouts));
+  timeouts.header = HEAD_SECONDS;
+  hl_wheel_init(&wheel, &timeouts, (unsigned long)time(NULL));
+  for (k = 0; k < CONNS_MAX; k++) {
+    conns[k].fd = -1;
+    hl_timer_init(&conns[k].timer);
+  }
+
+  for (;;) {
+    /* A server with more connections would use epoll or kqueue. */
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (k = 0, n = 1; k < CONNS_MAX; k++) {
+      if (conns[k].fd < 0) continue;
+      fds[n].fd = conns[k].fd;
+      fds[n].events = POLLIN;
+      polled[n++] = &conns[k];
+    }
+    if (poll(fds, n, 1000) < 0) continue;
+
+    while ((timer = hl_wheel_expired(&wheel, (unsigned long)time(NULL)))) {
+      c = (struct conn*)((char*)timer - offsetof(struct conn, timer));
+      if (write(c->fd, timeout, sizeof(timeout) - 1) < 0) perror("write");
+      conn_close(&wheel, c);
+    }
+
+    for (k = 1; k < n; k++) {
+      c = polled[k];
+      if (c->fd < 0 || !(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      switch (read_head(c)) {
+        case 0: break;
+        case 1:
+          fd = hash(c->h.buf + c->h.head.host, c->h.head.host_len) % workers;
+          if (send_fd(socks[fd], c->fd, &c->h,
+                      offsetof(struct handoff, buf) + c->h.head.len) < 0) {
+            perror("sendmsg");
+          }
+          conn_close(&wheel, c);
+          break;
+        default: conn_close(&wheel, c); break;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      fd = accept(listener, NULL, NULL);
+      if (fd < 0) continue;
+      for (k = 0; k < CONNS_MAX && conns[k].fd >= 0; k++);
+      if (k == CONNS_MAX) {
+        close(fd);
+        continue;
+      }
+      conn_init(&conns[k], fd);
+      hl_wheel_set(&wheel, &conns[k].timer, HL_TIMER_HEADER);
+    }
+  }
+}
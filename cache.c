@@ -0,0 +1,282 @@
+#include <stddef.h>
+#include <string.h>
+#include "cache.h"
+
+/* Readers and the writer share only pointers, epochs and the CLOCK bit.
+ * Without GCC's atomics the cache is for one thread.
+ */
+#if defined(__GNUC__)
+# define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+# define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+# define LOAD_RELAXED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+# define STORE_RELAXED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+# define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+# define LOAD(x) (x)
+# define STORE(x, v) ((x) = (v))
+# define LOAD_RELAXED(x) (x)
+# define STORE_RELAXED(x, v) ((x) = (v))
+# define FENCE()
+#endif
+
+/* The host, the url, then the response, follow the header in mem. */
+struct hl_cache_entry {
+  hl_cache_entry* next; /* In the bucket. */
+  unsigned long hash;
+  unsigned long retired; /* The epoch it was unlinked in. 0 while linked. */
+  size_t size; /* In mem, padding included. */
+  size_t host_len;
+  size_t url_len;
+  size_t len;
+  unsigned char method; /* 0 for the padding at the end of mem. */
+  unsigned char referenced; /* The CLOCK bit. Set by hl_cache_get(). */
+};
+
+union align {
+  void* p;
+  size_t s;
+  unsigned long l;
+};
+
+#define ALIGN sizeof(union align)
+#define ROUND(n) (((n) + ALIGN - 1) / ALIGN * ALIGN)
+#define HOST(e) ((const char*)((e) + 1))
+#define URL(e) (HOST(e) + (e)->host_len)
+
+int hl_cache_init(hl_cache* cache,
+                  void* mem,
+                  size_t size,
+                  hl_cache_entry** buckets,
+                  size_t bucket_count,
+                  hl_cache_reader* readers,
+                  size_t reader_count) {
+  size_t pad = (ALIGN - (size_t)mem % ALIGN) % ALIGN;
+
+  if (bucket_count == 0 || (bucket_count & (bucket_count - 1))) return -1;
+  memset(cache, 0, sizeof(*cache));
+  cache->mem = (char*)mem + pad;
+  cache->size = size < pad ? 0 : (size - pad) / ALIGN * ALIGN;
+  cache->buckets = buckets;
+  cache->mask = bucket_count - 1;
+  cache->readers = readers;
+  cache->reader_count = reader_count;
+  cache->epoch = 1;
+  memset(buckets, 0, bucket_count * sizeof(*buckets));
+  memset(readers, 0, reader_count * sizeof(*readers));
+  return 0;
+}
+
+void hl_cache_enter(hl_cache* cache, hl_cache_reader* reader) {
+  STORE(reader->epoch, LOAD(cache->epoch));
+  /* The writer must see the epoch before this reader sees the buckets. */
+  FENCE();
+}
+
+void hl_cache_leave(hl_cache_reader* reader) {
+  STORE(reader->epoch, 0);
+}
+
+/* FNV-1a of method, host and url. */
+static unsigned long hash(unsigned char method,
+                          const char* host,
+                          size_t host_len,
+                          const char* url,
+                          size_t url_len) {
+  unsigned long h = (2166136261UL ^ method) * 16777619UL;
+
+  while (host_len--) h = (h ^ (unsigned char)*host++) * 16777619UL;
+  h = (h ^ '/') * 16777619UL;
+  while (url_len--) h = (h ^ (unsigned char)*url++) * 16777619UL;
+  return h;
+}
+
+/* Returns the entry for method, host and url, or NULL. */
+static hl_cache_entry* find(hl_cache* cache,
+                            unsigned long h,
+                            unsigned char method,
+                            const char* host,
+                            size_t host_len,
+                            const char* url,
+                            size_t url_len) {
+  hl_cache_entry* e;
+
+  for (e = LOAD(cache->buckets[h & cache->mask]); e; e = LOAD(e->next)) {
+    if (e->hash == h && e->method == method && e->host_len == host_len &&
+        e->url_len == url_len &&
+        (host_len == 0 || memcmp(HOST(e), host, host_len) == 0) &&
+        memcmp(URL(e), url, url_len) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+int hl_cache_get(hl_cache* cache,
+                 unsigned char method,
+                 const char* host,
+                 size_t host_len,
+                 const char* url,
+                 size_t url_len,
+                 hl_span* response) {
+  hl_cache_entry* e;
+
+  if (method == HL_METHOD_OTHER) return -1;
+  e = find(cache, hash(method, host, host_len, url, url_len), method, host,
+           host_len, url, url_len);
+  if (e == NULL) return -1;
+  /* Only written when it changes, to keep the line shared. */
+  if (!LOAD_RELAXED(e->referenced)) STORE_RELAXED(e->referenced, 1);
+  response->start = URL(e) + e->url_len;
+  response->end = response->start + e->len;
+  return 0;
+}
+
+/* Links e, which is at head, into its bucket. */
+static void bucket_add(hl_cache* cache, hl_cache_entry* e) {
+  hl_cache_entry** bucket = &cache->buckets[e->hash & cache->mask];
+
+  e->next = *bucket;
+  e->retired = 0;
+  STORE(*bucket, e);
+  cache->head += e->size;
+  cache->used += e->size;
+  cache->count++;
+}
+
+/* Takes e out of its bucket. Readers that are in may still have it. */
+static void bucket_remove(hl_cache* cache, hl_cache_entry* e) {
+  hl_cache_entry** p = &cache->buckets[e->hash & cache->mask];
+
+  while (*p != e) p = &(*p)->next;
+  STORE(*p, e->next);
+  e->retired = cache->epoch;
+  STORE(cache->epoch, cache->epoch + 1);
+  cache->count--;
+}
+
+/* Returns whether no reader can still have an entry retired in epoch. */
+static int reclaimable(const hl_cache* cache, unsigned long epoch) {
+  unsigned long in;
+  size_t k;
+
+  FENCE();
+  for (k = 0; k < cache->reader_count; k++) {
+    in = LOAD(cache->readers[k].epoch);
+    if (in && in <= epoch) return 0;
+  }
+  return 1;
+}
+
+/* The free bytes at head, up to the tail or the end of mem. */
+static size_t room(const hl_cache* cache) {
+  if (cache->head < cache->tail) return cache->tail - cache->head;
+  if (cache->head == cache->tail && cache->used) return 0;
+  return cache->size - cache->head;
+}
+
+/* Frees the oldest entries until need bytes at head are free, and about as
+ * much again after them, for entries that go round. Returns 0, or -1 if a
+ * reader may still have the oldest.
+ */
+static int make_room(hl_cache* cache, size_t need) {
+  size_t want = need <= cache->size / 2 ? 2 * need : need;
+  size_t turns = cache->count; /* Bounds the second chances. */
+  hl_cache_entry* e;
+
+  for (;;) {
+    if (cache->used == 0) cache->head = cache->tail = 0;
+    if (room(cache) >= want) return 0;
+
+    if (cache->head > cache->tail && cache->tail >= want) {
+      /* Not enough at the end of mem; go on from the start, where there
+       * is.
+       */
+      if (cache->size - cache->head >= sizeof(hl_cache_entry)) {
+        e = (hl_cache_entry*)(cache->mem + cache->head);
+        e->method = 0;
+        e->size = cache->size - cache->head;
+      }
+      cache->used += cache->size - cache->head;
+      cache->head = 0;
+      continue;
+    }
+
+    if (cache->size - cache->tail < sizeof(hl_cache_entry)) {
+      cache->used -= cache->size - cache->tail;
+      cache->tail = 0;
+      continue;
+    }
+    e = (hl_cache_entry*)(cache->mem + cache->tail);
+    if (e->method && !e->retired) {
+      if (LOAD_RELAXED(e->referenced) && turns && room(cache) >= e->size) {
+        /* Got since it was last passed over: it goes round again. */
+        hl_cache_entry* copy = (hl_cache_entry*)(cache->mem + cache->head);
+
+        turns--;
+        memcpy(copy, e, e->size);
+        copy->referenced = 0;
+        bucket_add(cache, copy);
+      }
+      bucket_remove(cache, e);
+    }
+    if (e->method && !reclaimable(cache, e->retired)) {
+      return room(cache) >= need ? 0 : -1;
+    }
+    cache->used -= e->size;
+    cache->tail += e->size;
+    if (cache->tail == cache->size) cache->tail = 0;
+  }
+}
+
+int hl_cache_put(hl_cache* cache,
+                 unsigned char method,
+                 const char* host,
+                 size_t host_len,
+                 const char* url,
+                 size_t url_len,
+                 const char* response,
+                 size_t len) {
+  size_t key_len = host_len + url_len;
+  size_t size = ROUND(sizeof(hl_cache_entry) + key_len + len);
+  unsigned long h = hash(method, host, host_len, url, url_len);
+  hl_cache_entry* e;
+  hl_cache_entry* old;
+
+  if (method == HL_METHOD_OTHER || size > cache->size ||
+      key_len < url_len || size < key_len + len) {
+    return -1;
+  }
+  if (make_room(cache, size) < 0) return -1;
+
+  e = (hl_cache_entry*)(cache->mem + cache->head);
+  e->hash = h;
+  e->size = size;
+  e->host_len = host_len;
+  e->url_len = url_len;
+  e->len = len;
+  e->method = method;
+  e->referenced = 0;
+  if (host_len) memcpy((char*)HOST(e), host, host_len);
+  memcpy((char*)URL(e), url, url_len);
+  memcpy((char*)URL(e) + url_len, response, len);
+
+  /* Readers find the new one first, then never the old. */
+  old = find(cache, h, method, host, host_len, url, url_len);
+  bucket_add(cache, e);
+  if (old) bucket_remove(cache, old);
+  return 0;
+}
+
+int hl_cache_remove(hl_cache* cache,
+                    unsigned char method,
+                    const char* host,
+                    size_t host_len,
+                    const char* url,
+                    size_t url_len) {
+  hl_cache_entry* e = find(cache, hash(method, host, host_len, url, url_len),
+                           method, host, host_len, url, url_len);
+
+  if (e == NULL) return -1;
+  bucket_remove(cache, e);
+  return 0;
+}
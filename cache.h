@@ -0,0 +1,128 @@
+/* Response cache for hl-based servers:
+ * - Whole responses, status line to body, kept as the bytes to send.
+ * - Looked up by lexer->method, the Host header and the HL_URL token,
+ *   before any application code runs.
+ * - Readers take no locks. Memory is reused only once every reader that
+ *   could be looking at it has left (epoch based reclamation).
+ * - CLOCK eviction within a byte budget.
+ * - No syscalls, no allocations, no callbacks.
+ *
+ * Meant for small, hot responses: health checks, robots.txt, config JSON.
+ * Any number of threads read; one at a time writes.
+ *
+ * With virtual hosts, pass the Host every time: one host's robots.txt must
+ * not be served for another. A server for a single origin can pass NULL
+ * and 0.
+ *
+ *   hl_cache_enter(&cache, &readers[thread]);
+ *   if (hl_cache_get(&cache, lexer.method, host, host_len, url, url_len,
+ *                    &response) == 0) {
+ *     send(fd, response.start, response.end - response.start, 0);
+ *   }
+ *   hl_cache_leave(&readers[thread]);
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+#include "hl.h"
+
+typedef struct hl_cache_entry hl_cache_entry;
+
+/* One for each thread that calls hl_cache_get(). */
+typedef struct {
+  /* private */
+  unsigned long epoch; /* 0 outside hl_cache_enter() and hl_cache_leave(). */
+} hl_cache_reader;
+
+typedef struct {
+  /* private */
+  char* mem; /* The entries, oldest at tail, in a ring. */
+  size_t size;
+  size_t head;
+  size_t tail;
+  size_t used;
+  hl_cache_entry** buckets;
+  size_t mask;
+  hl_cache_reader* readers;
+  size_t reader_count;
+  unsigned long epoch;
+
+  /* read-only */
+  size_t count; /* Entries that hl_cache_get() can find. */
+} hl_cache;
+
+/* Initializes a cache that keeps its entries in the size bytes at mem: that
+ * is the byte budget, with 64 bytes of header an entry on 64-bit. buckets
+ * is an array of bucket_count pointers, a power of 2, and readers has one
+ * hl_cache_reader for each thread that reads. The cache owns all three
+ * until it is no longer used. Returns 0 on success or -1 if bucket_count is
+ * not a power of 2.
+ */
+int hl_cache_init(hl_cache* cache,
+                  void* mem,
+                  size_t size,
+                  hl_cache_entry** buckets,
+                  size_t bucket_count,
+                  hl_cache_reader* readers,
+                  size_t reader_count);
+
+/* Marks the start of reading with reader. Responses from hl_cache_get()
+ * stay as they are until hl_cache_leave(). Keep it short: while a reader is
+ * in, the writer can't reuse what it has evicted since.
+ */
+void hl_cache_enter(hl_cache* cache, hl_cache_reader* reader);
+
+/* Marks the end of reading. Done with every response got since
+ * hl_cache_enter().
+ */
+void hl_cache_leave(hl_cache_reader* reader);
+
+/* Finds the response to method, one of the HL_METHOD_* other than
+ * HL_METHOD_OTHER, at host, the Host header's value, and url, as in the
+ * HL_URL token. Both are compared byte for byte. Sets response to the bytes
+ * to send and returns 0, or returns -1 if there is none. Call between
+ * hl_cache_enter() and hl_cache_leave().
+ *
+ * If a send() takes only part of the response, copy the rest before
+ * hl_cache_leave(), or stay in until it has gone.
+ */
+int hl_cache_get(hl_cache* cache,
+                 unsigned char method,
+                 const char* host,
+                 size_t host_len,
+                 const char* url,
+                 size_t url_len,
+                 hl_span* response);
+
+/* Copies response, len bytes to send as they are, into cache as the
+ * response to method, host and url, in place of any before. Room is made by
+ * evicting the oldest entries, except those got since they were last
+ * passed over, which go round again. Returns 0, or -1 if it can't be
+ * cached: method is HL_METHOD_OTHER, the entry is bigger than the cache, or
+ * a reader is in that may be using the space. Try again later for that.
+ *
+ * hl_cache_put() and hl_cache_remove() are for one thread at a time, and
+ * not between hl_cache_enter() and hl_cache_leave().
+ */
+int hl_cache_put(hl_cache* cache,
+                 unsigned char method,
+                 const char* host,
+                 size_t host_len,
+                 const char* url,
+                 size_t url_len,
+                 const char* response,
+                 size_t len);
+
+/* Stops hl_cache_get() from finding the response to method, host and url,
+ * E.G. on HL_METHOD_PURGE. Returns 0, or -1 if there was none.
+ */
+int hl_cache_remove(hl_cache* cache,
+                    unsigned char method,
+                    const char* host,
+                    size_t host_len,
+                    const char* url,
+                    size_t url_len);
+
+#endif
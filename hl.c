@@ -1,15 +1,46 @@
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include "hl.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+# define HL_SSE2 1
+# include <emmintrin.h>
+#endif
+
+#ifdef HL_USDT
+# include <sys/sdt.h>
+# define PROBE3(name, a, b, c) DTRACE_PROBE3(hl, name, a, b, c)
+# define PROBE4(name, a, b, c, d) DTRACE_PROBE4(hl, name, a, b, c, d)
+#else
+# define PROBE3(name, a, b, c)
+# define PROBE4(name, a, b, c, d)
+#endif
+
+#ifdef HL_STATS
+# include <time.h>
+# ifndef HL_STATS_NOW
+#  define HL_STATS_NOW() clock()
+# endif
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define SSIZE_MAX_ ((ssize_t)((size_t)-1 >> 1))
+
+static const char* find_any(const char* p, const char* end, const char* set);
 
 enum flag {
   F_CONNECTION_KEEP_ALIVE     = 0x01,
   F_CONNECTION_CLOSE          = 0x02,
   F_TRANSFER_ENCODING_CHUNKED = 0x04,
   F_TRAILER                   = 0x08,
-  F_UPGRADE                   = 0x10
+  F_UPGRADE                   = 0x10,
+  F_UPGRADE_H2C               = 0x20,
+  F_HTTP2_SETTINGS            = 0x40,
+  F_UPGRADE_WEBSOCKET         = 0x80,
+  F_WEBSOCKET_KEY             = 0x100,
+  F_WEBSOCKET_VERSION         = 0x200
 };
 
 enum state {
@@ -22,6 +53,7 @@ enum state {
   S_METHOD,
   S_URL_START,
   S_URL,
+  S_URL_STAR,
   S_REQ_H,
   S_REQ_HT,
   S_REQ_HTT,
@@ -50,6 +82,14 @@ enum state {
   S_CHUNK_CONTENT_CR,
   S_CHUNK_CONTENT_CRLF,
 
+  S_PREFACE, /* "\r\nSM\r\n\r\n" after "PRI * HTTP/2.0\r\n" */
+
+  S_PROXY_START,
+  S_PROXY_V1,
+  S_PROXY_V1_LF,
+  S_PROXY_V2,
+  S_PROXY_V2_BODY,
+
   HS_ANYTHING,
   HS_C,
   HS_CO,
@@ -58,13 +98,124 @@ enum state {
   HS_MATCH_CONTENT_LENGTH,
   HS_MATCH_TRANSFER_ENCODING,
   HS_MATCH_UPGRADE,
+  HS_MATCH_HTTP2_SETTINGS,
+  HS_CONNECTION_LIST, /* Between elements of the Connection value. */
+  HS_CONNECTION_SKIP, /* In an element that isn't of interest. */
   HS_MATCH_KEEP_ALIVE,
-  HS_MATCH_CLOSE
+  HS_MATCH_CLOSE,
+  HS_TE_LIST, /* Likewise for Transfer-Encoding. */
+  HS_TE_SKIP,
+  HS_MATCH_CHUNKED,
+  HS_MATCH_H2C,
+  HS_MATCH_WEBSOCKET,
+  HS_MATCH_SEC_WEBSOCKET_KEY,
+  HS_MATCH_SEC_WEBSOCKET_VERSION,
+  HS_MATCH_VERSION_13,
+  HS_PRI /* Request line so far matches the HTTP/2 preface. */
 };
 
+/* In the order of enum state. */
+static const char* const state_names[] = {
+  "S_REQ_START", "S_MSG_END", "S_EOF", "S_UPGRADE",
+  "S_METHOD_START", "S_METHOD", "S_URL_START", "S_URL", "S_URL_STAR",
+  "S_REQ_H", "S_REQ_HT", "S_REQ_HTT", "S_REQ_HTTP", "S_REQ_HTTP_SLASH",
+  "S_REQ_VMAJOR", "S_REQ_VPERIOD", "S_REQ_VMINOR", "S_REQ_CR", "S_REQ_CRLF",
+  "S_FIELD_START", "S_FIELD_START_CR", "S_FIELD", "S_FIELD_COLON",
+  "S_VALUE_START", "S_VALUE", "S_VALUE_CR", "S_VALUE_CRLF",
+  "S_IDENTITY_CONTENT",
+  "S_CHUNK_START", "S_CHUNK_LEN", "S_CHUNK_LEN_CRLF", "S_CHUNK_KV",
+  "S_CHUNK_CONTENT", "S_CHUNK_CONTENT_CR", "S_CHUNK_CONTENT_CRLF",
+  "S_PREFACE",
+  "S_PROXY_START", "S_PROXY_V1", "S_PROXY_V1_LF", "S_PROXY_V2",
+  "S_PROXY_V2_BODY"
+};
+
+const char* hl_state_name(const hl_lexer* lexer) {
+  return lexer->state < sizeof(state_names) / sizeof(state_names[0]) ?
+      state_names[lexer->state] : "?";
+}
+
+/* Says which part of the message a syntax error in lexer->state is in. */
+static hl_error_code syntax_error(const hl_lexer* lexer) {
+  switch (lexer->state) {
+    case S_PROXY_START:
+    case S_PROXY_V1:
+    case S_PROXY_V1_LF:
+    case S_PROXY_V2:
+    case S_PROXY_V2_BODY:
+      return HL_ERR_PROXY;
+
+    case S_REQ_START:
+    case S_METHOD_START:
+    case S_METHOD:
+      return HL_ERR_METHOD;
+
+    case S_URL_START:
+    case S_URL:
+    case S_URL_STAR:
+      return HL_ERR_URL;
+
+    case S_REQ_H:
+    case S_REQ_HT:
+    case S_REQ_HTT:
+    case S_REQ_HTTP:
+    case S_REQ_HTTP_SLASH:
+    case S_REQ_VMAJOR:
+    case S_REQ_VPERIOD:
+    case S_REQ_VMINOR:
+    case S_REQ_CR:
+      return HL_ERR_VERSION;
+
+    case S_FIELD:
+    case S_FIELD_COLON:
+      return HL_ERR_FIELD;
+
+    case S_REQ_CRLF:
+    case S_FIELD_START_CR:
+    case S_VALUE_CR:
+    case S_VALUE_CRLF:
+      return HL_ERR_LINE_END;
+
+    case S_VALUE:
+      if (lexer->header_state == HS_MATCH_CONTENT_LENGTH) {
+        return HL_ERR_CONTENT_LENGTH;
+      }
+      break;
+
+    case S_CHUNK_START:
+    case S_CHUNK_LEN:
+    case S_CHUNK_LEN_CRLF:
+    case S_CHUNK_KV:
+    case S_CHUNK_CONTENT_CR:
+    case S_CHUNK_CONTENT_CRLF:
+      return HL_ERR_CHUNK;
+
+    case S_PREFACE:
+      return HL_ERR_PREFACE;
+  }
+  return HL_ERR_SYNTAX;
+}
+
 void hl_req_init(hl_lexer* lexer) {
+  /* Everything has a value, for hl_lexer_serialize(). */
+  memset(lexer, 0, sizeof(*lexer));
   lexer->last = HL_EAGAIN;
   lexer->state = S_REQ_START;
+  lexer->header_state = HS_ANYTHING;
+  lexer->match = "";
+  lexer->headers = NULL;
+  lexer->field = 0;
+  lexer->tokens = ~0u;
+  lexer->limits = NULL;
+  lexer->error = HL_ERR_NONE;
+  lexer->offset = 0;
+  lexer->stats = NULL;
+  lexer->key = NULL;
+}
+
+void hl_req_init_proxy(hl_lexer* lexer) {
+  hl_req_init(lexer);
+  lexer->state = S_PROXY_START;
 }
 
 
@@ -72,7 +223,13 @@ void hl_req_init(hl_lexer* lexer) {
 /* TODO replace with lookup tables. */
 #define IS_LETTER(c) (('a' <= (c) && (c) <= 'z') || ('A' <= (c) && (c) <= 'Z'))
 #define IS_WHITESPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\r')
+#define IS_OWS(c) ((c) == ' ' || (c) == '\t')
 #define IS_NUMBER(c) ('0' <= (c) && (c) <= '9')
+#define IS_ALPHANUM(c) (IS_LETTER(c) || IS_NUMBER(c))
+#define IS_SCHEME_CHAR(c) (IS_ALPHANUM(c) || (c) == '+' || (c) == '-' || \
+                           (c) == '.')
+#define IS_HOST_CHAR(c) (IS_ALPHANUM(c) || (c) == '-' || (c) == '.' || \
+                         (c) == '_' || (c) == '~' || (c) == '%')
 #define IS_URL_CHAR(c) is_url_char[(unsigned char)c]
 #define IS_METHOD_CHAR(c) (IS_LETTER(c) || c == '-')
 #define IS_FIELD_CHAR(c) (IS_LETTER(c) || IS_NUMBER(c) || (c) == '-')
@@ -144,8 +301,73 @@ const char unhex[] = {
 #define CHUNKED "chunked"
 #define KEEP_ALIVE "keep-alive"
 #define CLOSE "close"
-#define UPGRADE "upgrade"
+#define HTTP2_SETTINGS "http2-settings"
+#define H2C "h2c"
+#define WEBSOCKET "websocket"
+#define SEC_WEBSOCKET_KEY "sec-websocket-key"
+#define SEC_WEBSOCKET_VERSION "sec-websocket-version"
+#define VERSION_13 "13"
+#define PREFACE_TAIL "\r\nSM\r\n\r\n"
+#define PROXY_V1 "PROXY "
+#define PROXY_V1_MAX 107 /* bytes in the line, CRLF included */
+#define PROXY_V2_SIG "\r\n\r\n\0\r\nQUIT\n" /* 12 bytes */
+#define PROXY_V2_HEADER 16 /* signature, version, family, length */
+
+/* Every string that lexer->match points to, for hl_lexer_serialize(). */
+static const char* const matches[] = {
+  "", CONNECTION, CONTENT_LENGTH, TRANSFER_ENCODING, UPGRADE, CHUNKED,
+  KEEP_ALIVE, CLOSE, HTTP2_SETTINGS, H2C, WEBSOCKET, SEC_WEBSOCKET_KEY,
+  SEC_WEBSOCKET_VERSION, VERSION_13, PREFACE_TAIL
+};
+#define MATCHES (sizeof(matches) / sizeof(matches[0]))
+
+
+#ifdef HL_STATS
+/* Returns the HL_STATS_* class of a state. */
+static int state_class(int state) {
+  if (state >= S_PROXY_START && state <= S_PROXY_V2_BODY) {
+    return HL_STATS_LINE;
+  } else if (state >= S_METHOD_START && state <= S_REQ_CRLF) {
+    return HL_STATS_LINE;
+  } else if (state >= S_FIELD_START && state <= S_VALUE_CRLF) {
+    return HL_STATS_HEADER;
+  } else if (state >= S_IDENTITY_CONTENT && state <= S_CHUNK_CONTENT_CRLF) {
+    return HL_STATS_BODY;
+  }
+  return HL_STATS_OTHER;
+}
+
+/* Counts a return from hl_execute() after n bytes, in a call that started
+ * at start in class. partial is set if a token was cut off.
+ */
+static void stats_return(hl_stats* stats,
+                         const hl_token* token,
+                         int partial,
+                         size_t n,
+                         int class,
+                         unsigned long start) {
+  stats->bytes += n;
+  if (partial) stats->partial++;
+  if (token->kind == HL_EAGAIN) stats->eagain++;
+  stats->ticks[class] += (unsigned long)HL_STATS_NOW() - start;
+}
 
+# define STATS_COUNT(counter)                       \
+  do {                                              \
+    if (lexer->stats) lexer->stats->counter++;      \
+  } while (0)
+
+# define STATS_RETURN(partial, n)                                      \
+  do {                                                                 \
+    if (lexer->stats) {                                                \
+      stats_return(lexer->stats, &token, (partial), (n), stats_class, \
+                   stats_start);                                       \
+    }                                                                  \
+  } while (0)
+#else
+# define STATS_COUNT(counter)
+# define STATS_RETURN(partial, n)
+#endif
 
 /* Don't call this directly, Use HEADER_COMPLETE macro.  This is code to be run
  * when the normal header is complete. The HEADER_COMPLETE macro handles both
@@ -157,16 +379,34 @@ static void basic_header_complete(hl_lexer* lexer,
   assert(token->start == NULL);
   assert(!(lexer->flags & F_TRAILER));
 
+  if (lexer->flags & F_UPGRADE &&
+      lexer->flags & F_UPGRADE_H2C) {
+    /* The server must not upgrade without HTTP2-Settings; HTTP/1 goes on.
+     * Otherwise the request is read as usual, body included, first.
+     */
+    if (lexer->flags & F_HTTP2_SETTINGS) lexer->upgrade = HL_UPGRADE_H2C;
+    lexer->flags &= ~F_UPGRADE;
+  } else if (lexer->flags & F_UPGRADE) {
+    lexer->upgrade = HL_UPGRADE_OTHER;
+    if ((lexer->flags & F_UPGRADE_WEBSOCKET) &&
+        (lexer->flags & F_WEBSOCKET_KEY) &&
+        (lexer->flags & F_WEBSOCKET_VERSION)) {
+      lexer->upgrade = HL_UPGRADE_WEBSOCKET;
+    }
+  }
+
   if (lexer->flags & F_UPGRADE) {
     lexer->state = S_MSG_END;
   } else if (lexer->flags & F_TRANSFER_ENCODING_CHUNKED) {
     lexer->state = S_CHUNK_START;
+    STATS_COUNT(chunked);
   } else {
     if (lexer->content_length <= 0) {
       /* XXX should check connection header to see if we're accepting more */
       lexer->state = S_MSG_END;
     } else {
       lexer->state = S_IDENTITY_CONTENT;
+      STATS_COUNT(identity);
     }
   }
 
@@ -182,11 +422,345 @@ static void basic_header_complete(hl_lexer* lexer,
     if (lexer->flags & F_TRAILER) {                \
       lexer->state = S_MSG_END;                    \
     } else {                                        \
+      PROBE3(header_end, lexer, HL_HEADER_END,      \
+             lexer->head_read + LINE_LEN() + 1);    \
       basic_header_complete(lexer, head, &token);  \
       goto token_complete;                          \
     }                                               \
   } while(0)
 
+/* Steps the matching of Connection or Transfer-Encoding over one character of
+ * the value. These are comma separated lists, and each element is matched
+ * separately: "keep-alive, Upgrade" is keep-alive. Parameters (";...") are
+ * ignored. chunked counts only as the last transfer coding (RFC 7230 3.3.3).
+ */
+static void list_value(hl_lexer* lexer, char c) {
+  switch (lexer->header_state) {
+    case HS_CONNECTION_LIST: {
+      if (c == ',' || IS_OWS(c)) break;
+      lexer->i = 1;
+      if (LOWER(c) == 'k') {
+        lexer->header_state = HS_MATCH_KEEP_ALIVE;
+        lexer->match = KEEP_ALIVE;
+      } else if (LOWER(c) == 'c') {
+        lexer->header_state = HS_MATCH_CLOSE;
+        lexer->match = CLOSE;
+      } else {
+        lexer->header_state = HS_CONNECTION_SKIP;
+      }
+      break;
+    }
+
+    case HS_TE_LIST: {
+      if (c == ',' || IS_OWS(c)) break;
+      if (LOWER(c) == 'c') {
+        lexer->header_state = HS_MATCH_CHUNKED;
+        lexer->match = CHUNKED;
+        lexer->i = 1;
+      } else {
+        lexer->header_state = HS_TE_SKIP;
+        lexer->flags &= ~F_TRANSFER_ENCODING_CHUNKED;
+      }
+      break;
+    }
+
+    case HS_CONNECTION_SKIP: {
+      if (c == ',') lexer->header_state = HS_CONNECTION_LIST;
+      break;
+    }
+
+    case HS_TE_SKIP: {
+      if (c == ',') lexer->header_state = HS_TE_LIST;
+      break;
+    }
+
+    case HS_MATCH_KEEP_ALIVE:
+    case HS_MATCH_CLOSE:
+    case HS_MATCH_CHUNKED: {
+      if (lexer->match[lexer->i] != '\0' &&
+          lexer->match[lexer->i] == LOWER(c)) {
+        lexer->i++;
+        break;
+      }
+
+      /* The element ends, or turns out to be something else. */
+      if (lexer->match[lexer->i] == '\0' &&
+          (c == ',' || c == ';' || IS_OWS(c))) {
+        if (lexer->header_state == HS_MATCH_KEEP_ALIVE) {
+          lexer->flags |= F_CONNECTION_KEEP_ALIVE;
+        } else if (lexer->header_state == HS_MATCH_CLOSE) {
+          lexer->flags |= F_CONNECTION_CLOSE;
+        } else {
+          lexer->flags |= F_TRANSFER_ENCODING_CHUNKED;
+        }
+      } else if (lexer->header_state == HS_MATCH_CHUNKED) {
+        lexer->flags &= ~F_TRANSFER_ENCODING_CHUNKED;
+      }
+
+      if (lexer->header_state == HS_MATCH_CHUNKED) {
+        lexer->header_state = c == ',' ? HS_TE_LIST : HS_TE_SKIP;
+      } else {
+        lexer->header_state = c == ',' ? HS_CONNECTION_LIST
+                                       : HS_CONNECTION_SKIP;
+      }
+      break;
+    }
+
+    default:
+      assert(0);
+  }
+}
+
+/* Names of the HL_METHOD_* values, in the same order. */
+static const char* const methods[] = {
+  "",
+  "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE",
+  "PATCH",
+  "COPY", "LOCK", "MKCOL", "MOVE", "PROPFIND", "PROPPATCH", "SEARCH",
+  "UNLOCK", "REPORT", "MKACTIVITY", "CHECKOUT", "MERGE",
+  "M-SEARCH", "NOTIFY", "SUBSCRIBE", "UNSUBSCRIBE",
+  "PURGE",
+  "PRI"
+};
+
+#define METHODS (sizeof(methods) / sizeof(methods[0]))
+#define METHOD_MAX 11 /* "UNSUBSCRIBE" */
+
+/* Returns the HL_METHOD_* of the whole method [p, p + len), which is
+ * followed by a space.
+ */
+static unsigned char method_find(const char* p, size_t len) {
+  unsigned char k;
+
+  /* Fixed-size memcmp() compiles to a 4 byte compare. */
+  if (len == 3 && memcmp(p, "GET ", 4) == 0) return HL_METHOD_GET;
+  if (len == 4 && memcmp(p, "POST", 4) == 0) return HL_METHOD_POST;
+
+  for (k = 1; k < METHODS; k++) {
+    if (methods[k][0] == *p && strlen(methods[k]) == len &&
+        memcmp(methods[k], p, len) == 0) {
+      return k;
+    }
+  }
+  return HL_METHOD_OTHER;
+}
+
+/* Matches the method one byte at a time, when it is split between buffers.
+ * lexer->method is the first of methods[] that starts with the lexer->i
+ * bytes seen so far, or HL_METHOD_OTHER once none does.
+ */
+static void method_step(hl_lexer* lexer, char c) {
+  const char* sofar = methods[lexer->method];
+  unsigned char k;
+
+  if (lexer->method == HL_METHOD_OTHER) return;
+  for (k = lexer->method; k < METHODS; k++) {
+    if (strncmp(methods[k], sofar, lexer->i) == 0 &&
+        methods[k][lexer->i] == c) {
+      lexer->method = k;
+      lexer->i++;
+      return;
+    }
+  }
+  lexer->method = HL_METHOD_OTHER;
+}
+
+int hl_header_set_init(hl_header_set* set,
+                       const char* const* names,
+                       size_t count) {
+  size_t k, len;
+
+  if (count > HL_HEADER_SET_MAX) return -1;
+  for (k = 0; k < count; k++) {
+    len = strlen(names[k]);
+    if (len == 0 || len > 0xffff) return -1;
+    set->len[k] = (unsigned short)len;
+  }
+  set->names = names;
+  set->count = count;
+  return 0;
+}
+
+void hl_set_headers(hl_lexer* lexer, const hl_header_set* set) {
+  lexer->headers = set;
+}
+
+void hl_limits_init(hl_limits* limits) {
+  limits->url = 8192;
+  limits->field_line = 8192;
+  limits->header = 32768;
+  limits->fields = 100;
+  limits->chunk_line = 1024;
+  limits->body = (size_t)-1;
+}
+
+void hl_set_limits(hl_lexer* lexer, const hl_limits* limits) {
+  lexer->limits = limits;
+}
+
+/* Returns the limit that a message stopped in lexer->state, line bytes into
+ * the current line, is already over. HL_ERR_NONE if none.
+ */
+static hl_error_code over_limit(const hl_lexer* lexer, size_t line) {
+  const hl_limits* limits = lexer->limits;
+
+  switch (lexer->state) {
+    case S_URL:
+    case S_URL_STAR:
+      if (line > limits->url) return HL_ERR_URL_TOO_LONG;
+      break;
+
+    case S_FIELD:
+    case S_FIELD_COLON:
+    case S_VALUE_START:
+    case S_VALUE:
+      if (line > limits->field_line) return HL_ERR_HEADER_TOO_LARGE;
+      break;
+
+    case S_CHUNK_LEN:
+    case S_CHUNK_KV:
+    case S_CHUNK_LEN_CRLF:
+      if (line > limits->chunk_line) return HL_ERR_CHUNK_LINE_TOO_LONG;
+      return HL_ERR_NONE;
+  }
+
+  if (lexer->state >= S_METHOD_START && lexer->state <= S_VALUE_CRLF &&
+      line > limits->header - MIN(lexer->head_read, limits->header)) {
+    return HL_ERR_HEADER_TOO_LARGE;
+  }
+  return HL_ERR_NONE;
+}
+
+/* Bytes of the current line (or URL) so far, this buf and earlier ones. */
+#define LINE_LEN() (lexer->line_read + (size_t)(head - mark))
+
+#define LINE_START()                                \
+  do {                                              \
+    mark = head;                                    \
+    lexer->line_read = 0;                           \
+  } while (0)
+
+#define CHECK_LIMITS(line)                                                 \
+  do {                                                                     \
+    if (lexer->limits && (err = over_limit(lexer, (line))) != HL_ERR_NONE) \
+      goto error;                                                          \
+  } while (0)
+
+void hl_set_stats(hl_lexer* lexer, hl_stats* stats) {
+  lexer->stats = stats;
+}
+
+void hl_stats_add(hl_stats* total, const hl_stats* stats) {
+  const volatile hl_stats* s = stats;
+  int k;
+
+  total->bytes += s->bytes;
+  for (k = 0; k < HL_TOKEN_KINDS; k++) total->tokens[k] += s->tokens[k];
+  total->partial += s->partial;
+  total->eagain += s->eagain;
+  total->messages += s->messages;
+  total->chunked += s->chunked;
+  total->identity += s->identity;
+  for (k = 0; k < HL_STATS_CLASSES; k++) total->ticks[k] += s->ticks[k];
+}
+
+void hl_set_tokens(hl_lexer* lexer, unsigned int mask) {
+  lexer->tokens = mask | HL_TOKEN_BIT(HL_EAGAIN) | HL_TOKEN_BIT(HL_EOF) |
+                  HL_TOKEN_BIT(HL_ERROR) | HL_TOKEN_BIT(HL_UPGRADE);
+}
+
+#if ULONG_MAX > 0xffffffffUL
+# define KEY_K1 0x9e3779b97f4a7c15UL
+# define KEY_K2 0xff51afd7ed558ccdUL
+#else
+# define KEY_K1 0x9e3779b1UL
+# define KEY_K2 0x85ebca6bUL
+#endif
+#define KEY_SHIFT (sizeof(unsigned long) * 4)
+#define KEY_MIX(h, w) ((h) = ((h) ^ (w)) * KEY_K1, (h) ^= (h) >> KEY_SHIFT)
+
+void hl_key_init(hl_key* key, unsigned int tokens, unsigned long fields) {
+  memset(key, 0, sizeof(*key));
+  key->tokens = tokens;
+  key->fields = fields;
+}
+
+void hl_set_key(hl_lexer* lexer, hl_key* key) {
+  lexer->key = key;
+}
+
+/* Mixes [p, p + n) into key->part a word at a time. Bytes left over wait in
+ * key->tail for the next call, so the part hashes the same however it's
+ * split. Words are little-endian whatever the machine.
+ */
+static void key_update(hl_key* key, const char* p, size_t n) {
+  const size_t word = sizeof(unsigned long);
+  unsigned long w;
+  size_t k;
+
+  for (; n && key->len % word; n--, key->len++) {
+    key->tail |= (unsigned long)(unsigned char)*p++ << key->len % word * 8;
+    if ((key->len + 1) % word == 0) {
+      KEY_MIX(key->part, key->tail);
+      key->tail = 0;
+    }
+  }
+  for (; n >= word; n -= word, p += word, key->len += word) {
+    for (w = 0, k = word; k--;) w = w << 8 | (unsigned char)p[k];
+    KEY_MIX(key->part, w);
+  }
+  for (; n; n--, key->len++) {
+    key->tail |= (unsigned long)(unsigned char)*p++ << key->len % word * 8;
+  }
+}
+
+/* Hashes the bytes of token into key, if it is part of the key. */
+static void key_token(hl_key* key, const hl_token* token, int field) {
+  if (token->kind == HL_MSG_START) {
+    key->hash = 0;
+    key->in_head = 1;
+    return;
+  }
+  if (token->kind == HL_HEADER_END) key->in_head = 0;
+  if (!key->in_head) return;
+  if (token->kind != HL_VALUE) field = 0; /* It's of the last HL_FIELD. */
+  if (!(key->tokens & HL_TOKEN_BIT(token->kind)) &&
+      !(token->kind == HL_VALUE && field &&
+        (key->fields >> (field - 1) & 1))) {
+    return;
+  }
+
+  key_update(key, token->start, token->end - token->start);
+  if (token->partial) return;
+  /* The tail, then the length, kind and field, so parts can't run into one
+   * another. Then the part is spread over the whole word.
+   */
+  if (key->len % sizeof(unsigned long)) KEY_MIX(key->part, key->tail);
+  KEY_MIX(key->part, (unsigned long)key->len << 16 | field << 8 | token->kind);
+  key->part *= KEY_K2;
+  key->part ^= key->part >> KEY_SHIFT;
+  key->hash += key->part;
+  key->part = key->tail = 0;
+  key->len = 0;
+}
+
+/* Returns 1 + the index of the name in set that is [p, p + len) or, if
+ * prefix is set, that starts with it. 0 if there is none.
+ */
+static int header_find(const hl_header_set* set,
+                       const char* p,
+                       size_t len,
+                       int prefix) {
+  size_t k, j;
+
+  for (k = 0; k < set->count; k++) {
+    if (prefix ? set->len[k] < len : set->len[k] != len) continue;
+    for (j = 0; j < len && LOWER(set->names[k][j]) == LOWER(p[j]); j++);
+    if (j == len) return (int)k + 1;
+  }
+  return 0;
+}
+
 int should_keep_alive(hl_lexer* lexer) {
   if (lexer->version_major == 1 && lexer->version_minor == 1) {
     if (lexer->flags & F_CONNECTION_CLOSE) {
@@ -208,20 +782,29 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
   hl_token token; /* returned token */
   const char* head = data; /* lexer head */
   const char* end = data + len;
+  const char* field_start = NULL; /* of a field that began in this buf */
+  const char* mark = data; /* where the current line is in this buf */
+  const char* p;
+  hl_error_code err = HL_ERR_SYNTAX;
   int to_read;
   int value;
+#ifdef HL_STATS
+  int stats_class = state_class(lexer->state);
+  unsigned long stats_start = lexer->stats ? (unsigned long)HL_STATS_NOW() : 0;
+#endif
 
   token.kind = lexer->last;
   token.start = lexer->last == HL_EAGAIN ? NULL : data;
   token.end = NULL;
   token.partial = 0;
 
+next_token:
   for (; head < end ||
        lexer->state == S_MSG_END ||
        lexer->state == S_EOF ||
        lexer->state == S_UPGRADE;
        head++) {
-    char c = *head;
+    char c = head < end ? *head : 0;
     switch (lexer->state) {
       default: assert(0);
 
@@ -234,6 +817,12 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
           lexer->version_minor = 9;
           lexer->upgrade = 0;
           lexer->content_read = 0;
+          lexer->head_read = 0;
+          lexer->fields = 0;
+          LINE_START();
+          STATS_COUNT(messages);
+          PROBE3(msg_start, lexer, HL_MSG_START,
+                 lexer->offset + (head - data));
 
           token.start = token.end = head;
           token.kind = HL_MSG_START;
@@ -248,9 +837,10 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
       case S_MSG_END: {
         token.kind = HL_MSG_END;
         token.start = token.end = head;
+        PROBE3(msg_end, lexer, HL_MSG_END, lexer->content_read);
 
-        if (lexer->flags & F_UPGRADE) {
-          lexer->state = S_EOF;
+        if (lexer->upgrade) {
+          lexer->state = S_UPGRADE;
         } else {
           /* Check to see if we have persistant connection. */
           lexer->state = should_keep_alive(lexer) ? S_REQ_START : S_EOF;
@@ -260,34 +850,127 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         break;
       }
 
-      case S_UPGRADE:
+      case S_UPGRADE: {
+        token.kind = HL_UPGRADE;
+        token.start = token.end = head;
+        goto token_complete;
+      }
+
       case S_EOF: {
         token.kind = HL_EOF;
         token.start = token.end = head;
         goto token_complete;
       }
 
+      case S_PROXY_START: {
+        token.kind = HL_PROXY;
+        token.start = head;
+        lexer->i = 1;
+        if (c == PROXY_V1[0]) {
+          lexer->state = S_PROXY_V1;
+        } else if (c == PROXY_V2_SIG[0]) {
+          lexer->state = S_PROXY_V2;
+        } else {
+          goto error;
+        }
+        break;
+      }
+
+      case S_PROXY_V1: {
+        /* The addresses are checked by hl_proxy_parse(). */
+        if (lexer->i < sizeof(PROXY_V1) - 1) {
+          if (c != PROXY_V1[lexer->i]) goto error;
+        } else if (c == '\r') {
+          lexer->state = S_PROXY_V1_LF;
+        } else if (c < ' ' || c > '~') {
+          goto error;
+        }
+        if (++lexer->i >= PROXY_V1_MAX) goto error;
+        break;
+      }
+
+      case S_PROXY_V1_LF: {
+        if (c != '\n') goto error;
+        token.end = head + 1;
+        lexer->state = S_REQ_START;
+        goto token_complete;
+      }
+
+      case S_PROXY_V2: {
+        value = lexer->i++;
+        if (value < 12) {
+          if (c != PROXY_V2_SIG[value]) goto error;
+        } else if (value == 12) {
+          /* Version 2, command LOCAL or PROXY. */
+          if ((c & 0xf0) != 0x20 || (c & 0x0f) > 1) goto error;
+        } else if (value == 14) {
+          lexer->chunk_len = (unsigned char)c << 8;
+        } else if (value == 15) {
+          lexer->chunk_len |= (unsigned char)c;
+          if (lexer->chunk_len == 0) {
+            token.end = head + 1;
+            lexer->state = S_REQ_START;
+            goto token_complete;
+          }
+          lexer->state = S_PROXY_V2_BODY;
+        }
+        break;
+      }
+
+      case S_PROXY_V2_BODY: {
+        /* Addresses and TLVs. */
+        to_read = MIN((size_t)(end - head), lexer->chunk_len);
+        lexer->chunk_len -= to_read;
+        head += to_read;
+
+        if (lexer->chunk_len == 0) {
+          token.end = head;
+          lexer->state = S_REQ_START;
+          goto token_complete;
+        }
+        head--; /* Undo the loop's head++. */
+        break;
+      }
+
       case S_METHOD_START: {
         /* We already checked this in S_REQ_START */
         assert(IS_METHOD_CHAR(c));
 
         token.start = head;
         token.kind = HL_METHOD;
+
+        /* Usually the whole method is here and can be looked up at once. */
+        p = memchr(head, ' ', MIN((size_t)(end - head), METHOD_MAX + 1));
+        if (p) {
+          for (; head < p; head++) {
+            if (!IS_METHOD_CHAR(*head)) goto error;
+          }
+          lexer->method = method_find(token.start, p - token.start);
+          goto method_end;
+        }
+
         lexer->state = S_METHOD;
+        lexer->method = 1;
+        lexer->i = 0;
+        method_step(lexer, c);
         break;
       }
 
       case S_METHOD: {
         if (c == ' ') {
           assert(token.kind == HL_METHOD);
-          token.end = head;
-          lexer->state = S_URL_START;
-          goto token_complete;
+          if (lexer->method != HL_METHOD_OTHER &&
+              methods[lexer->method][lexer->i] != '\0') {
+            lexer->method = HL_METHOD_OTHER;
+          }
+          goto method_end;
         }
 
         if (!IS_METHOD_CHAR(c)) {
           goto error;
         }
+
+        method_step(lexer, c);
         break;
       }
 
@@ -299,25 +982,46 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
 
           token.kind = HL_URL;
           token.start = head;
-          lexer->state = S_URL;
+          lexer->head_read += LINE_LEN();
+          LINE_START();
+          if (lexer->header_state == HS_PRI && c == '*') {
+            lexer->state = S_URL_STAR;
+          } else {
+            lexer->header_state = HS_ANYTHING;
+            lexer->state = S_URL;
+          }
         }
         break;
       }
 
+      case S_URL_STAR: {
+        /* Just "*" so far. If the URL goes on, it's not the preface. */
+        if (IS_URL_CHAR(c)) {
+          lexer->header_state = HS_ANYTHING;
+          lexer->state = S_URL;
+          break;
+        }
+        goto url_end;
+      }
+
       case S_URL: {
         assert(token.kind == HL_URL);
 
-        if (!IS_URL_CHAR(c)) {
-          token.end = head;
-          lexer->state = S_REQ_H;
-          goto token_complete;
-        }
+        if (!IS_URL_CHAR(c)) goto url_end;
         break;
       }
 
       case S_REQ_H: {
         assert(token.kind == HL_EAGAIN);
-        if (c == ' ') {
+        if (c == 'H' && end - head >= 10 &&
+            (memcmp(head, "HTTP/1.1\r\n", 10) == 0 ||
+             memcmp(head, "HTTP/1.0\r\n", 10) == 0)) {
+          /* The usual versions, in one go. */
+          lexer->version_major = 1;
+          lexer->version_minor = head[7] - '0';
+          lexer->state = S_FIELD_START;
+          head += 9;
+        } else if (c == ' ') {
           ;
         } else if (c == 'H') {
           lexer->state = S_REQ_HT;
@@ -417,6 +1121,12 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         assert(token.kind == HL_EAGAIN);
         if (c == '\n') {
           lexer->state = S_FIELD_START;
+          if (lexer->header_state == HS_PRI &&
+              lexer->version_major == 2 && lexer->version_minor == 0) {
+            lexer->state = S_PREFACE;
+            lexer->match = PREFACE_TAIL;
+            lexer->i = 0;
+          }
         } else {
           goto error;
         }
@@ -429,16 +1139,28 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         if (c == '\r') {
           lexer->state = S_FIELD_START_CR;
         } else if (c == '\n') {
+          CHECK_LIMITS(LINE_LEN() + 1);
           HEADER_COMPLETE();
         } else if (c == '\t') {
-          /* Tabs indicate continued header value */
-          assert(0 && "Implement me");
+          /* Tabs indicate continued header value. Not supported. */
+          err = HL_ERR_OBS_FOLD;
           goto error;
         } else if (c == ' ') {
           ;
         } else if (IS_FIELD_CHAR(c)) {
-          token.kind = HL_FIELD;
-          token.start = head;
+          lexer->head_read += LINE_LEN();
+          LINE_START();
+          if (lexer->limits && ++lexer->fields > lexer->limits->fields) {
+            err = HL_ERR_HEADER_TOO_LARGE;
+            goto error;
+          }
+          if (lexer->headers) {
+            /* Returned only once it is known to be wanted. */
+            field_start = head;
+          } else {
+            token.kind = HL_FIELD;
+            token.start = head;
+          }
           if (lexer->flags & F_TRAILER) {
             /* Trailing field/values don't need to be parsed. */
             lexer->header_state = HS_ANYTHING;
@@ -458,6 +1180,18 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
                 lexer->i = 1;
                 break;
 
+              case 'h':
+                lexer->header_state = HS_MATCH_HTTP2_SETTINGS;
+                lexer->match = HTTP2_SETTINGS;
+                lexer->i = 1;
+                break;
+
+              case 's':
+                lexer->header_state = HS_MATCH_SEC_WEBSOCKET_KEY;
+                lexer->match = SEC_WEBSOCKET_KEY;
+                lexer->i = 1;
+                break;
+
               case 't':
                 lexer->header_state = HS_MATCH_TRANSFER_ENCODING;
                 lexer->match = TRANSFER_ENCODING;
@@ -477,6 +1211,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
       case S_FIELD_START_CR: {
         assert(token.kind == HL_EAGAIN);
         if (c == '\n') {
+          CHECK_LIMITS(LINE_LEN() + 1);
           HEADER_COMPLETE();
         } else {
           goto error;
@@ -485,18 +1220,34 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
       }
 
       case S_FIELD: {
-        assert(token.kind == HL_FIELD);
+        assert(token.kind == (lexer->headers ? HL_EAGAIN : HL_FIELD));
 
         if (c == ':') {
-          if (lexer->header_state != HS_ANYTHING &&
-              lexer->match[lexer->i] != '\0') {
+          /* "C", "Co" and "Con" have no match yet. */
+          if (lexer->header_state == HS_C || lexer->header_state == HS_CO ||
+              lexer->header_state == HS_CON ||
+              (lexer->header_state != HS_ANYTHING &&
+               lexer->match[lexer->i] != '\0')) {
             lexer->header_state = HS_ANYTHING;
           }
 
-          token.end = head;
-          assert(token.partial == 0);
           lexer->state = S_FIELD_COLON;
           head--; /* XXX back up head... */
+
+          if (lexer->headers) {
+            /* A field continued from an earlier buf is not wanted; see
+             * below.
+             */
+            lexer->field = field_start == NULL ? 0 :
+                header_find(lexer->headers, field_start,
+                            head + 1 - field_start, 0);
+            if (!lexer->field) break; /* Skip it. */
+            token.kind = HL_FIELD;
+            token.start = field_start;
+          }
+
+          token.end = head + 1;
+          assert(token.partial == 0);
           goto token_complete;
         }
 
@@ -530,16 +1281,25 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
               break;
             }
 
+            case HS_MATCH_SEC_WEBSOCKET_KEY:
+              /* "sec-websocket-" is shared with the version header. */
+              if (c == 'v' && lexer->i == sizeof("sec-websocket-") - 1) {
+                lexer->header_state = HS_MATCH_SEC_WEBSOCKET_VERSION;
+                lexer->match = SEC_WEBSOCKET_VERSION;
+              }
+              /* fall through */
+
             case HS_MATCH_CONTENT_LENGTH:
             case HS_MATCH_CONNECTION:
             case HS_MATCH_TRANSFER_ENCODING:
             case HS_MATCH_UPGRADE:
+            case HS_MATCH_HTTP2_SETTINGS:
+            case HS_MATCH_SEC_WEBSOCKET_VERSION:
               if (lexer->match[lexer->i++] == c) break;
               lexer->header_state = HS_ANYTHING;
               break;
 
             default:
-              assert(0);
               goto error;
           }
         }
@@ -561,8 +1321,10 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         /* Skip spaces at the beginning of values */
         if (c == ' ') break;
         assert(token.kind == HL_EAGAIN);
-        token.kind = HL_VALUE;
-        token.start = head;
+        if (!lexer->headers || lexer->field) {
+          token.kind = HL_VALUE;
+          token.start = head;
+        }
         lexer->state = S_VALUE;
 
         switch (lexer->header_state) {
@@ -575,64 +1337,110 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
           }
 
           case HS_MATCH_CONNECTION: {
-            c = LOWER(c);
-            if (c == 'k') {
-              lexer->header_state = HS_MATCH_KEEP_ALIVE;
-              lexer->match = KEEP_ALIVE;
-              lexer->i = 0;
-            } else if (c == 'c') {
-              lexer->header_state = HS_MATCH_CLOSE;
-              lexer->match = CLOSE;
-              lexer->i = 0;
+            lexer->header_state = HS_CONNECTION_LIST;
+            break;
+          }
+
+          case HS_MATCH_UPGRADE: {
+            lexer->flags |= F_UPGRADE;
+            if (LOWER(c) == 'w') {
+              lexer->header_state = HS_MATCH_WEBSOCKET;
+              lexer->match = WEBSOCKET;
             } else {
-              lexer->header_state = HS_ANYTHING;
+              lexer->header_state = HS_MATCH_H2C;
+              lexer->match = H2C;
             }
+            lexer->i = 0;
             break;
           }
 
-          case HS_MATCH_UPGRADE: {
+          case HS_MATCH_SEC_WEBSOCKET_KEY: {
             lexer->header_state = HS_ANYTHING;
-            lexer->flags |= F_UPGRADE;
+            lexer->flags |= F_WEBSOCKET_KEY;
             break;
           }
 
-          case HS_MATCH_TRANSFER_ENCODING: {
-            lexer->match = CHUNKED;
+          case HS_MATCH_SEC_WEBSOCKET_VERSION: {
+            lexer->header_state = HS_MATCH_VERSION_13;
+            lexer->match = VERSION_13;
             lexer->i = 0;
             break;
           }
 
+          case HS_MATCH_HTTP2_SETTINGS: {
+            lexer->header_state = HS_ANYTHING;
+            lexer->flags |= F_HTTP2_SETTINGS;
+            break;
+          }
+
+          case HS_MATCH_TRANSFER_ENCODING: {
+            lexer->header_state = HS_TE_LIST;
+            break;
+          }
+
           default:
-            assert(0 && "should not reach here");
+            goto error;
         }
         /* pass-through to S_VALUE */
 
       case S_VALUE: {
+        if (token.kind == HL_EAGAIN && lexer->header_state == HS_ANYTHING) {
+          /* Skipping an unwanted value; nothing in it matters. */
+          p = find_any(head, end, "\r\n");
+          if (p == end) {
+            head = end - 1;
+            break;
+          }
+          head = p;
+          c = *p;
+        }
+
         /* End of header value */
         if (c == '\r' || c == '\n') {
-          assert(token.kind == HL_VALUE);
+          CHECK_LIMITS(LINE_LEN());
           token.end = head;
           lexer->state = c == '\r' ? S_VALUE_CR : S_VALUE_CRLF;
 
           if (lexer->header_state != HS_ANYTHING) {
             switch (lexer->header_state) {
-              case HS_MATCH_KEEP_ALIVE: {
+              case HS_MATCH_CONTENT_LENGTH: {
+                if (lexer->limits &&
+                    (size_t)lexer->content_length > lexer->limits->body) {
+                  err = HL_ERR_BODY_TOO_LARGE;
+                  goto error;
+                }
+                break;
+              }
+
+              case HS_CONNECTION_LIST:
+              case HS_CONNECTION_SKIP:
+              case HS_MATCH_KEEP_ALIVE:
+              case HS_MATCH_CLOSE:
+              case HS_TE_LIST:
+              case HS_TE_SKIP:
+              case HS_MATCH_CHUNKED: {
+                /* The end of the value ends the last element. */
+                list_value(lexer, ',');
+                break;
+              }
+
+              case HS_MATCH_H2C: {
                 if (lexer->match[lexer->i] == '\0') {
-                  lexer->flags |= F_CONNECTION_KEEP_ALIVE;
+                  lexer->flags |= F_UPGRADE_H2C;
                 }
                 break;
               }
 
-              case HS_MATCH_CLOSE: {
+              case HS_MATCH_WEBSOCKET: {
                 if (lexer->match[lexer->i] == '\0') {
-                  lexer->flags |= F_CONNECTION_CLOSE;
+                  lexer->flags |= F_UPGRADE_WEBSOCKET;
                 }
                 break;
               }
 
-              case HS_MATCH_TRANSFER_ENCODING: {
+              case HS_MATCH_VERSION_13: {
                 if (lexer->match[lexer->i] == '\0') {
-                  lexer->flags |= F_TRANSFER_ENCODING_CHUNKED;
+                  lexer->flags |= F_WEBSOCKET_VERSION;
                 }
                 break;
               }
@@ -640,6 +1448,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
           }
 
           head--; /* XXX back up head */
+          if (token.kind == HL_EAGAIN) break; /* An unwanted value. */
           goto token_complete;
         }
 
@@ -649,14 +1458,29 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
           switch (lexer->header_state) {
             case HS_MATCH_CONTENT_LENGTH: {
               if (!IS_NUMBER(c)) goto error;
+              if (lexer->content_length > (SSIZE_MAX_ - (c - '0')) / 10) {
+                err = HL_ERR_BODY_TOO_LARGE;
+                goto error;
+              }
               lexer->content_length *= 10;
               lexer->content_length += c - '0';
               break;
             }
 
+            case HS_CONNECTION_LIST:
+            case HS_CONNECTION_SKIP:
             case HS_MATCH_KEEP_ALIVE:
             case HS_MATCH_CLOSE:
-            case HS_MATCH_TRANSFER_ENCODING: {
+            case HS_TE_LIST:
+            case HS_TE_SKIP:
+            case HS_MATCH_CHUNKED: {
+              list_value(lexer, *head);
+              break;
+            }
+
+            case HS_MATCH_H2C:
+            case HS_MATCH_WEBSOCKET:
+            case HS_MATCH_VERSION_13: {
               if (lexer->match[lexer->i++] != c) {
                 lexer->header_state = HS_ANYTHING;
               }
@@ -664,7 +1488,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
             }
 
             default:
-              assert(0 && "should not reach here");
+              goto error;
           }
         }
 
@@ -699,6 +1523,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
           lexer->state = S_MSG_END;
           goto token_complete;
         }
+        head--; /* Undo the loop's head++. */
         break;
       }
 
@@ -708,6 +1533,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         lexer->chunk_read = 0;
         lexer->chunk_len = value;
         lexer->state = S_CHUNK_LEN;
+        LINE_START();
         break;
       }
 
@@ -722,6 +1548,10 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
             goto error;
           }
         } else {
+          if (lexer->chunk_len >> (sizeof(lexer->chunk_len) * 8 - 4)) {
+            err = HL_ERR_BODY_TOO_LARGE;
+            goto error;
+          }
           lexer->chunk_len *= 16;
           lexer->chunk_len += value;
         }
@@ -743,11 +1573,22 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
       case S_CHUNK_LEN_CRLF: {
         if (c != '\n') goto error;
         assert(lexer->chunk_read == 0);
+        CHECK_LIMITS(LINE_LEN() + 1);
+        if (lexer->limits && lexer->chunk_len >
+            lexer->limits->body - MIN(lexer->content_read,
+                                      lexer->limits->body)) {
+          err = HL_ERR_BODY_TOO_LARGE;
+          goto error;
+        }
 
         if (lexer->chunk_len == 0) {
           /* Last chunk. There may be trailing headers. RFC 2616 14.40. */
           lexer->state = S_FIELD_START;
           lexer->flags |= F_TRAILER;
+          lexer->head_read = 0;
+          lexer->fields = 0;
+          LINE_START();
+          mark++; /* The trailer starts after this LF. */
         } else {
           lexer->state = S_CHUNK_CONTENT;
         }
@@ -761,6 +1602,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         to_read = MIN(end - head,
                       lexer->chunk_len - lexer->chunk_read);
         lexer->chunk_read += to_read;
+        lexer->content_read += to_read;
         head += to_read;
 
         if (lexer->chunk_len == lexer->chunk_read) {
@@ -769,6 +1611,7 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
           lexer->state = S_CHUNK_CONTENT_CR;
           goto token_complete;
         }
+        head--; /* Undo the loop's head++. */
         break;
       }
 
@@ -789,23 +1632,1539 @@ hl_token hl_execute(hl_lexer* lexer, const char* data, size_t len) {
         lexer->state = S_CHUNK_START;
         break;
       }
+
+      case S_PREFACE: {
+        if (c != lexer->match[lexer->i++]) goto error;
+        if (lexer->match[lexer->i] == '\0') {
+          lexer->upgrade = HL_UPGRADE_H2;
+          lexer->state = S_UPGRADE;
+          token.kind = HL_UPGRADE;
+          token.start = token.end = head + 1;
+          goto token_complete;
+        }
+        break;
+      }
     }
   }
 
+  if (lexer->state == S_FIELD && field_start &&
+      header_find(lexer->headers, field_start, head - field_start, 1)) {
+    /* The field may be wanted. Start over on it with more data, so that
+     * HL_FIELD is never partial.
+     */
+    lexer->state = S_FIELD_START;
+    head = field_start;
+    if (lexer->limits) lexer->fields--; /* It's counted again. */
+  }
+  CHECK_LIMITS(LINE_LEN());
+  lexer->line_read = LINE_LEN();
   token.end = head;
   token.partial = 1;
   lexer->last = token.kind;
+  lexer->offset += head - data;
+  if (token.kind != HL_EAGAIN) {
+    PROBE3(partial, lexer, token.kind, head - token.start);
+    if (lexer->key) key_token(lexer->key, &token, lexer->field);
+  }
+  if (!(lexer->tokens & HL_TOKEN_BIT(token.kind))) {
+    token.kind = HL_EAGAIN;
+    token.start = NULL;
+    token.partial = 0;
+  }
+  STATS_RETURN(lexer->last != HL_EAGAIN, head - data);
   return token;
 
+method_end:
+  /* head is at the space after the method. */
+  lexer->header_state =
+      lexer->method == HL_METHOD_PRI ? HS_PRI : HS_ANYTHING;
+  token.end = head;
+  lexer->state = S_URL_START;
+  goto token_complete;
+
+url_end:
+  /* head is just past the URL. */
+  CHECK_LIMITS(LINE_LEN());
+  lexer->head_read += LINE_LEN();
+  LINE_START();
+  token.end = head;
+  lexer->state = S_REQ_H;
+
 token_complete:
   assert(token.partial == 0);
   assert(token.end);
   lexer->last = HL_EAGAIN;
+  STATS_COUNT(tokens[token.kind]);
+  if (lexer->key) key_token(lexer->key, &token, lexer->field);
+  if (!(lexer->tokens & HL_TOKEN_BIT(token.kind))) {
+    /* Suppressed; carry on as the caller would, from token.end. */
+    head = token.end;
+    token.kind = HL_EAGAIN;
+    token.start = token.end = NULL;
+    goto next_token;
+  }
+  /* The next call starts its buf at token.end. */
+  lexer->line_read += token.end - mark;
+  lexer->offset += token.end - data;
+  STATS_RETURN(0, token.end - data);
   return token;
 
 error:
+  /* The state is left as it was, for hl_state_name(). */
+  lexer->error = err == HL_ERR_SYNTAX ? syntax_error(lexer) : err;
+  lexer->offset += head - data;
+  PROBE4(error, lexer, HL_ERROR, lexer->error, lexer->offset);
   token.kind = HL_ERROR;
   token.start = NULL;
   token.end = head;
+  STATS_RETURN(0, head - data);
   return token;
 }
+
+
+#define SNAPSHOT_VERSION 1
+
+/* The order of the fields in a snapshot. Each is a varint: 7 bits a byte,
+ * least significant first, with the top bit set on all but the last.
+ */
+enum snapshot_field {
+  SF_FLAGS,
+  SF_LAST,
+  SF_STATE,
+  SF_HEADER_STATE,
+  SF_I,
+  SF_MATCH,
+  SF_TOKENS,
+  SF_CHUNK_READ,
+  SF_CHUNK_LEN,
+  SF_LINE_READ,
+  SF_HEAD_READ,
+  SF_FIELDS,
+  SF_VERSION_MAJOR,
+  SF_VERSION_MINOR,
+  SF_METHOD,
+  SF_CONTENT_READ,
+  SF_UPGRADE,
+  SF_CONTENT_LENGTH, /* plus 1, so -1 is 0 */
+  SF_CODE,
+  SF_FIELD,
+  SF_ERROR,
+  SF_OFFSET,
+  SNAPSHOT_FIELDS
+};
+
+ssize_t hl_lexer_serialize(const hl_lexer* lexer,
+                           unsigned char* buf,
+                           size_t len) {
+  unsigned char snapshot[HL_LEXER_SNAPSHOT_MAX];
+  unsigned char* p = snapshot;
+  size_t v[SNAPSHOT_FIELDS];
+  size_t k;
+
+  for (k = 0; k < MATCHES && strcmp(lexer->match, matches[k]) != 0; k++);
+  assert(k < MATCHES);
+
+  v[SF_FLAGS] = lexer->flags;
+  v[SF_LAST] = lexer->last;
+  v[SF_STATE] = lexer->state;
+  v[SF_HEADER_STATE] = lexer->header_state;
+  v[SF_I] = lexer->i;
+  v[SF_MATCH] = k;
+  v[SF_TOKENS] = lexer->tokens;
+  v[SF_CHUNK_READ] = lexer->chunk_read;
+  v[SF_CHUNK_LEN] = lexer->chunk_len;
+  v[SF_LINE_READ] = lexer->line_read;
+  v[SF_HEAD_READ] = lexer->head_read;
+  v[SF_FIELDS] = lexer->fields;
+  v[SF_VERSION_MAJOR] = lexer->version_major;
+  v[SF_VERSION_MINOR] = lexer->version_minor;
+  v[SF_METHOD] = lexer->method;
+  v[SF_CONTENT_READ] = lexer->content_read;
+  v[SF_UPGRADE] = (unsigned char)lexer->upgrade;
+  v[SF_CONTENT_LENGTH] = (size_t)lexer->content_length + 1;
+  v[SF_CODE] = lexer->code;
+  v[SF_FIELD] = lexer->field;
+  v[SF_ERROR] = lexer->error;
+  v[SF_OFFSET] = lexer->offset;
+
+  *p++ = SNAPSHOT_VERSION;
+  for (k = 0; k < SNAPSHOT_FIELDS; k++) {
+    for (; v[k] > 0x7f; v[k] >>= 7) *p++ = (unsigned char)(v[k] | 0x80);
+    *p++ = (unsigned char)v[k];
+  }
+
+  if ((size_t)(p - snapshot) > len) return -1;
+  memcpy(buf, snapshot, p - snapshot);
+  return p - snapshot;
+}
+
+/* Returns 1 if a restored lexer in state can't index past the end of a
+ * string with i.
+ */
+static int snapshot_in_bounds(const hl_lexer* lexer) {
+  switch (lexer->state) {
+    case S_METHOD:
+      return lexer->method == HL_METHOD_OTHER ||
+             lexer->i <= strlen(methods[lexer->method]);
+
+    case S_FIELD:
+    case S_FIELD_COLON:
+    case S_VALUE_START:
+    case S_VALUE:
+      switch (lexer->header_state) {
+        case HS_ANYTHING:
+        case HS_C:
+        case HS_CO:
+        case HS_CON:
+        case HS_CONNECTION_LIST:
+        case HS_CONNECTION_SKIP:
+        case HS_TE_LIST:
+        case HS_TE_SKIP:
+          return 1;
+      }
+      /* fall through */
+
+    case S_PREFACE:
+      return lexer->i <= strlen(lexer->match);
+
+    case S_IDENTITY_CONTENT:
+      return lexer->content_length >= 0 &&
+             lexer->content_read <= (size_t)lexer->content_length;
+
+    case S_CHUNK_CONTENT:
+      return lexer->chunk_len > 0 && lexer->chunk_read <= lexer->chunk_len;
+  }
+  return 1;
+}
+
+ssize_t hl_lexer_restore(hl_lexer* lexer,
+                         const unsigned char* buf,
+                         size_t len) {
+  const unsigned char* p = buf;
+  const unsigned char* end = buf + len;
+  size_t v[SNAPSHOT_FIELDS];
+  size_t k;
+  unsigned int shift;
+
+  if (len == 0 || *p++ != SNAPSHOT_VERSION) return -1;
+  for (k = 0; k < SNAPSHOT_FIELDS; k++) {
+    v[k] = 0;
+    for (shift = 0;; shift += 7) {
+      if (p == end || shift >= sizeof(size_t) * 8) return -1;
+      v[k] |= (size_t)(*p & 0x7f) << shift;
+      if (!(*p++ & 0x80)) break;
+    }
+  }
+
+  if (v[SF_FLAGS] > UINT_MAX || v[SF_LAST] >= HL_TOKEN_KINDS ||
+      v[SF_STATE] > S_PROXY_V2_BODY ||
+      v[SF_HEADER_STATE] < HS_ANYTHING || v[SF_HEADER_STATE] > HS_PRI ||
+      v[SF_I] > UCHAR_MAX || v[SF_MATCH] >= MATCHES ||
+      v[SF_TOKENS] > UINT_MAX || v[SF_FIELDS] > UINT_MAX ||
+      v[SF_VERSION_MAJOR] > UCHAR_MAX || v[SF_VERSION_MINOR] > UCHAR_MAX ||
+      v[SF_METHOD] >= METHODS || v[SF_UPGRADE] > HL_UPGRADE_WEBSOCKET ||
+      v[SF_CONTENT_LENGTH] > (size_t)SSIZE_MAX_ + 1 ||
+      v[SF_CODE] > UINT_MAX || v[SF_FIELD] > HL_HEADER_SET_MAX ||
+      v[SF_ERROR] > HL_ERR_PREFACE) {
+    return -1;
+  }
+
+  hl_req_init(lexer);
+  lexer->flags = (unsigned int)v[SF_FLAGS];
+  lexer->last = (hl_token_kind)v[SF_LAST];
+  lexer->state = (unsigned char)v[SF_STATE];
+  lexer->header_state = (unsigned char)v[SF_HEADER_STATE];
+  lexer->i = (unsigned char)v[SF_I];
+  lexer->match = matches[v[SF_MATCH]];
+  lexer->tokens = (unsigned int)v[SF_TOKENS];
+  lexer->chunk_read = v[SF_CHUNK_READ];
+  lexer->chunk_len = v[SF_CHUNK_LEN];
+  lexer->line_read = v[SF_LINE_READ];
+  lexer->head_read = v[SF_HEAD_READ];
+  lexer->fields = (unsigned int)v[SF_FIELDS];
+  lexer->version_major = (unsigned char)v[SF_VERSION_MAJOR];
+  lexer->version_minor = (unsigned char)v[SF_VERSION_MINOR];
+  lexer->method = (unsigned char)v[SF_METHOD];
+  lexer->content_read = v[SF_CONTENT_READ];
+  lexer->upgrade = (char)v[SF_UPGRADE];
+  lexer->content_length = v[SF_CONTENT_LENGTH] == 0 ? -1 :
+                          (ssize_t)(v[SF_CONTENT_LENGTH] - 1);
+  lexer->code = (unsigned int)v[SF_CODE];
+  lexer->field = (unsigned char)v[SF_FIELD];
+  lexer->error = (unsigned char)v[SF_ERROR];
+  lexer->offset = v[SF_OFFSET];
+
+  if (!snapshot_in_bounds(lexer)) return -1;
+  return p - buf;
+}
+
+enum url_state {
+  U_START,
+  U_SCHEME,
+  U_AUTH,
+  U_HOST_V6,
+  U_PATH,
+  U_QUERY,
+  U_FRAGMENT
+};
+
+/* Fills in host and port once the end of the authority has been found.
+ * colon is the last ':' outside of an IPv6 literal and port its value so far,
+ * or -1 if something other than digits followed it.
+ */
+static int url_authority_end(hl_url* url,
+                             const char* host,
+                             const char* colon,
+                             long port,
+                             const char* head) {
+  url->host.start = host;
+  url->host.end = colon ? colon : head;
+  if (url->host.start == url->host.end) return -1;
+
+  if (colon) {
+    if (port < 0) return -1;
+    url->port.start = colon + 1;
+    url->port.end = head;
+    if (url->port.start != url->port.end) {
+      url->port_num = (int)port;
+    }
+  }
+  return 0;
+}
+
+int hl_url_parse(const char* buf, size_t buflen, hl_url* url) {
+  static const hl_url empty;
+  const char* head = buf;
+  const char* end = buf + buflen;
+  const char* host = buf; /* Start of userinfo or host in the authority. */
+  const char* colon = NULL;
+  long port = 0;
+  enum url_state state = U_START;
+  char c;
+
+  *url = empty;
+  url->port_num = -1;
+
+  if (buflen == 0) return -1;
+
+  for (; head < end; head++) {
+    c = *head;
+    if (!IS_URL_CHAR(c)) return -1;
+
+    switch (state) {
+      case U_START: {
+        if (c == '/') {
+          url->form = HL_URL_ORIGIN;
+          url->path.start = head;
+          state = U_PATH;
+        } else if (c == '*' && buflen == 1) {
+          url->form = HL_URL_ASTERISK;
+          url->path.start = head;
+          state = U_PATH;
+        } else if (IS_LETTER(c)) {
+          state = U_SCHEME;
+        } else if (IS_HOST_CHAR(c) || c == '[') {
+          url->form = HL_URL_AUTHORITY;
+          state = U_AUTH;
+          head--; /* Look at c again in U_AUTH. */
+        } else {
+          return -1;
+        }
+        break;
+      }
+
+      case U_SCHEME: {
+        if (c == ':' && end - head > 2 && head[1] == '/' && head[2] == '/') {
+          url->form = HL_URL_ABSOLUTE;
+          url->scheme.start = buf;
+          url->scheme.end = head;
+          head += 2;
+          host = head + 1;
+          state = U_AUTH;
+        } else if (!IS_SCHEME_CHAR(c)) {
+          /* Not a scheme after all, E.G. "example.org:443" */
+          url->form = HL_URL_AUTHORITY;
+          state = U_AUTH;
+          head--;
+        }
+        break;
+      }
+
+      case U_AUTH: {
+        if (c == '/' || c == '?' || c == '#') {
+          /* authority-form is nothing but the authority. */
+          if (url->form == HL_URL_AUTHORITY) return -1;
+          if (url_authority_end(url, host, colon, port, head)) return -1;
+
+          if (c == '/') {
+            url->path.start = head;
+            state = U_PATH;
+          } else if (c == '?') {
+            url->query.start = head + 1;
+            state = U_QUERY;
+          } else {
+            url->fragment.start = head + 1;
+            state = U_FRAGMENT;
+          }
+        } else if (c == '@') {
+          /* What we took for the host was the userinfo. */
+          if (url->userinfo.start) return -1;
+          url->userinfo.start = host;
+          url->userinfo.end = head;
+          host = head + 1;
+          colon = NULL;
+        } else if (c == ':') {
+          colon = head;
+          port = 0;
+        } else if (c == '[' && head == host) {
+          state = U_HOST_V6;
+        } else if (colon) {
+          if (port >= 0 && IS_NUMBER(c)) {
+            port = port * 10 + (c - '0');
+            if (port > 65535) port = -1;
+          } else {
+            port = -1;
+          }
+        }
+        break;
+      }
+
+      case U_HOST_V6: {
+        if (c == ']') {
+          state = U_AUTH;
+        } else if (!(IS_ALPHANUM(c) || c == ':' || c == '.' || c == '%')) {
+          return -1;
+        }
+        break;
+      }
+
+      case U_PATH: {
+        if (c == '?') {
+          url->path.end = head;
+          url->query.start = head + 1;
+          state = U_QUERY;
+        } else if (c == '#') {
+          url->path.end = head;
+          url->fragment.start = head + 1;
+          state = U_FRAGMENT;
+        }
+        break;
+      }
+
+      case U_QUERY: {
+        if (c == '#') {
+          url->query.end = head;
+          url->fragment.start = head + 1;
+          state = U_FRAGMENT;
+        }
+        break;
+      }
+
+      case U_FRAGMENT:
+        break;
+    }
+  }
+
+  switch (state) {
+    case U_SCHEME:
+      /* Only scheme characters, E.G. "localhost". */
+      url->form = HL_URL_AUTHORITY;
+      /* fall through */
+
+    case U_AUTH:
+      return url_authority_end(url, host, colon, port, end);
+
+    case U_PATH:
+      url->path.end = end;
+      break;
+
+    case U_QUERY:
+      url->query.end = end;
+      break;
+
+    case U_FRAGMENT:
+      url->fragment.end = end;
+      break;
+
+    default:
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/* Returns the first byte in [p, end) that is one of the (at most 8) bytes in
+ * set, or end if there is none.
+ */
+static const char* find_any(const char* p, const char* end, const char* set) {
+  size_t n = strlen(set);
+#ifdef HL_SSE2
+  __m128i needles[8];
+  __m128i block, hits;
+  size_t i;
+  int mask;
+
+  assert(n <= 8);
+  for (i = 0; i < n; i++) {
+    needles[i] = _mm_set1_epi8(set[i]);
+  }
+
+  for (; end - p >= 16; p += 16) {
+    block = _mm_loadu_si128((const __m128i*)p);
+    hits = _mm_cmpeq_epi8(block, needles[0]);
+    for (i = 1; i < n; i++) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+    }
+    mask = _mm_movemask_epi8(hits);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (memchr(set, *p, n)) return p;
+  }
+  return end;
+}
+
+/* Returns the first '/' in [p, end) that starts a dot segment "/." (or, if
+ * merge is set, an empty segment "//"), or end if there is none.
+ */
+static const char* find_dot_segment(const char* p, const char* end,
+                                    int merge) {
+#ifdef HL_SSE2
+  __m128i slash = _mm_set1_epi8('/');
+  __m128i dot = _mm_set1_epi8('.');
+  __m128i cur, next;
+  int mask;
+
+  /* Compare each byte and its successor 16 at a time. */
+  for (; end - p > 16; p += 16) {
+    cur = _mm_loadu_si128((const __m128i*)p);
+    next = _mm_loadu_si128((const __m128i*)(p + 1));
+    mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(cur, slash),
+                      merge ? _mm_or_si128(_mm_cmpeq_epi8(next, dot),
+                                           _mm_cmpeq_epi8(next, slash))
+                            : _mm_cmpeq_epi8(next, dot)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; end - p > 1; p++) {
+    if (p[0] == '/' && (p[1] == '.' || (merge && p[1] == '/'))) return p;
+  }
+  return end;
+}
+
+ssize_t hl_url_normalize(char* path, size_t len, int flags) {
+  char* end = path + len;
+  char* r = path; /* read head */
+  char* w = path; /* write head, never ahead of r */
+  char* next;
+  int hi, lo, c;
+
+  if (len == 0) return 0;
+  if (*path != '/') return -1;
+
+  /* Pass one: decode %XX. memchr() skips the clean stretches. */
+  for (;;) {
+    next = memchr(r, '%', end - r);
+    if (next == NULL) next = end;
+    if (w != r) memmove(w, r, next - r);
+    w += next - r;
+    r = next;
+    if (r == end) break;
+
+    if (end - r < 3) return -1;
+    hi = UNHEX(r[1]);
+    lo = UNHEX(r[2]);
+    if (hi < 0 || lo < 0) return -1;
+    c = hi * 16 + lo;
+
+    if (c == 0 && !(flags & HL_NORM_ALLOW_NUL)) return -1;
+
+    if (c == '/') {
+      /* Decoding this would create a segment boundary that wasn't there. */
+      if (!(flags & HL_NORM_KEEP_SLASH)) return -1;
+      w[0] = r[0];
+      w[1] = r[1];
+      w[2] = r[2];
+      w += 3;
+    } else {
+      *w++ = (char)c;
+    }
+    r += 3;
+  }
+
+  /* Pass two: remove dot segments. */
+  end = w;
+  r = w = path;
+  for (;;) {
+    next = (char*)find_dot_segment(r, end, flags & HL_NORM_MERGE_SLASHES);
+    if (w != r) memmove(w, r, next - r);
+    w += next - r;
+    r = next;
+    if (r == end) break;
+
+    /* r[0] == '/' and r[1] is '.' or '/' */
+    if (r[1] == '/') {
+      /* Empty segment. Drop this slash, keep the next. */
+      r++;
+    } else if (r + 2 == end || r[2] == '/') {
+      /* "/." */
+      r += 2;
+      if (r == end) *w++ = '/';
+    } else if (r[2] == '.' && (r + 3 == end || r[3] == '/')) {
+      /* "/.." Back up over the last segment written. */
+      r += 3;
+      while (w > path) {
+        if (*--w == '/') break;
+      }
+      if (r == end) *w++ = '/';
+    } else {
+      /* A segment that merely starts with a dot, E.G. "/.htaccess" */
+      *w++ = *r++;
+    }
+  }
+
+  return w - path;
+}
+
+
+int hl_query_next(hl_span* query, hl_query_param* param) {
+  const char* head = query->start;
+  const char* end = query->end;
+  hl_span* part;
+  char* escaped;
+
+  /* Skip empty pairs, E.G. "a=1&&b=2" */
+  while (head < end && (*head == '&' || *head == ';')) head++;
+  if (head >= end) {
+    query->start = end;
+    return 0;
+  }
+
+  param->key.start = head;
+  param->value.start = param->value.end = NULL;
+  param->key_escaped = param->value_escaped = 0;
+  part = &param->key;
+  escaped = &param->key_escaped;
+
+  for (;;) {
+    /* Once an escape is seen the rest of the part doesn't need checking. */
+    if (part == &param->key) {
+      head = find_any(head, end, *escaped ? "&;=" : "&;=%+");
+    } else {
+      head = find_any(head, end, *escaped ? "&;" : "&;%+");
+    }
+
+    if (head == end || *head == '&' || *head == ';') {
+      part->end = head;
+      query->start = head == end ? end : head + 1;
+      return 1;
+    }
+
+    if (*head == '=') {
+      part->end = head;
+      part = &param->value;
+      part->start = head + 1;
+      escaped = &param->value_escaped;
+    } else {
+      *escaped = 1;
+    }
+    head++;
+  }
+}
+
+ssize_t hl_query_decode(const char* src, size_t len, char* dst) {
+  const char* end = src + len;
+  const char* next;
+  char* w = dst;
+  int hi, lo;
+
+  for (;;) {
+    next = find_any(src, end, "%+");
+    if (w != src) memmove(w, src, next - src);
+    w += next - src;
+    src = next;
+    if (src == end) break;
+
+    if (*src == '+') {
+      *w++ = ' ';
+      src++;
+    } else {
+      if (end - src < 3) return -1;
+      hi = UNHEX(src[1]);
+      lo = UNHEX(src[2]);
+      if (hi < 0 || lo < 0) return -1;
+      *w++ = (char)(hi * 16 + lo);
+      src += 3;
+    }
+  }
+
+  return w - dst;
+}
+
+
+/* Parses a qvalue: "0", "1", or up to three decimals as in "0.125". */
+static unsigned int parse_q(const char* p, const char* end) {
+  unsigned int q, scale = 100;
+
+  if (p == end || (*p != '0' && *p != '1')) return 0;
+  q = (*p++ - '0') * 1000;
+  if (p < end && *p == '.') {
+    for (p++; p < end && IS_NUMBER(*p) && scale > 0; p++, scale /= 10) {
+      q += (*p - '0') * scale;
+    }
+  }
+  return p == end && q <= 1000 ? q : 0;
+}
+
+/* Finds the q parameter in params of hl_list_next(). */
+static unsigned int list_q(const char* p, const char* end) {
+  const char* next;
+  const char* e;
+
+  for (;; p = next + 1) {
+    next = find_any(p, end, ";");
+    while (p < next && IS_OWS(*p)) p++;
+    if (next - p >= 2 && LOWER(p[0]) == 'q' && p[1] == '=') {
+      for (e = next; e > p && IS_OWS(e[-1]); e--);
+      return parse_q(p + 2, e);
+    }
+    if (next == end) return 1000;
+  }
+}
+
+int hl_list_next(hl_span* list, hl_list_item* item) {
+  const char* head = list->start;
+  const char* end = list->end;
+  const char* e;
+
+  /* Skip empty elements, E.G. "gzip, , br" */
+  while (head < end && (*head == ',' || IS_OWS(*head))) head++;
+  if (head >= end) {
+    list->start = end;
+    return 0;
+  }
+
+  item->token.start = head;
+  item->params.start = item->params.end = NULL;
+  item->q = 1000;
+
+  head = find_any(head, end, ",;");
+  for (e = head; e > item->token.start && IS_OWS(e[-1]); e--);
+  item->token.end = e;
+
+  if (head < end && *head == ';') {
+    for (head++; head < end && IS_OWS(*head); head++);
+    item->params.start = head;
+    for (; head < end && *head != ','; head++) {
+      if (*head != '"') continue;
+      /* Skip the quoted string. */
+      for (head++; head < end && *head != '"'; head++) {
+        if (*head == '\\' && head + 1 < end) head++;
+      }
+      if (head == end) break;
+    }
+    for (e = head; e > item->params.start && IS_OWS(e[-1]); e--);
+    item->params.end = e;
+    item->q = list_q(item->params.start, item->params.end);
+  }
+
+  list->start = head == end ? end : head + 1;
+  return 1;
+}
+
+
+/* Stores the cookie pair that starts at head, which is not ';' or
+ * whitespace, and returns where the next one starts.
+ */
+static const char* cookie_pair(const char* head,
+                               const char* end,
+                               hl_cookie* cookie) {
+  const char* p = find_any(head, end, ";=");
+  const char* e;
+
+  for (e = p; e > head && IS_OWS(e[-1]); e--);
+  cookie->name.start = head;
+  cookie->name.end = e;
+
+  if (p == end || *p == ';') {
+    cookie->value.start = cookie->value.end = NULL;
+    return p;
+  }
+
+  for (head = p + 1; head < end && IS_OWS(*head); head++);
+  p = find_any(head, end, ";");
+  for (e = p; e > head && IS_OWS(e[-1]); e--);
+
+  /* A quoted value can't contain ';' (RFC 6265 4.1.1), so the quotes are at
+   * the ends.
+   */
+  if (e - head >= 2 && *head == '"' && e[-1] == '"') {
+    head++;
+    e--;
+  }
+  cookie->value.start = head;
+  cookie->value.end = e;
+  return p;
+}
+
+int hl_cookie_next(hl_span* cookies, hl_cookie* cookie) {
+  const char* head = cookies->start;
+  const char* end = cookies->end;
+
+  /* Skip empty pairs and the space after ';' */
+  while (head < end && (*head == ';' || IS_OWS(*head))) head++;
+  if (head >= end) {
+    cookies->start = end;
+    return 0;
+  }
+
+  head = cookie_pair(head, end, cookie);
+  cookies->start = head == end ? end : head + 1;
+  return 1;
+}
+
+void hl_cookie_set_init(hl_cookie_set* set,
+                        const char* const* names,
+                        size_t count) {
+  unsigned char c;
+  size_t i;
+
+  set->names = names;
+  set->count = count;
+  memset(set->first, 0, sizeof(set->first));
+  for (i = 0; i < count; i++) {
+    c = (unsigned char)names[i][0];
+    set->first[c >> 3] |= 1 << (c & 7);
+  }
+}
+
+int hl_cookie_find(hl_span* cookies,
+                   const hl_cookie_set* set,
+                   hl_cookie* cookie) {
+  const char* head = cookies->start;
+  const char* end = cookies->end;
+  unsigned char c;
+  size_t i, len;
+
+  for (;;) {
+    while (head < end && (*head == ';' || IS_OWS(*head))) head++;
+    if (head >= end) {
+      cookies->start = end;
+      return 0;
+    }
+
+    c = (unsigned char)*head;
+    if (set->first[c >> 3] & (1 << (c & 7))) {
+      head = cookie_pair(head, end, cookie);
+      len = cookie->name.end - cookie->name.start;
+      for (i = 0; i < set->count; i++) {
+        if (strlen(set->names[i]) == len &&
+            memcmp(set->names[i], cookie->name.start, len) == 0) {
+          cookies->start = head == end ? end : head + 1;
+          return (int)i + 1;
+        }
+      }
+    } else {
+      head = memchr(head, ';', end - head);
+      if (head == NULL) head = end;
+    }
+  }
+}
+
+
+/* Parses a dotted quad, all of p to end, into 4 bytes at addr. */
+static int parse_ip4(const char* p, const char* end, unsigned char* addr) {
+  int n, digits, value;
+
+  for (n = 0; n < 4; n++) {
+    if (n > 0 && (p == end || *p++ != '.')) return -1;
+    for (value = 0, digits = 0; p < end && IS_NUMBER(*p); p++, digits++) {
+      value = value * 10 + (*p - '0');
+    }
+    if (digits == 0 || digits > 3 || value > 255) return -1;
+    addr[n] = (unsigned char)value;
+  }
+  return p == end ? 0 : -1;
+}
+
+/* Parses an IPv6 address (RFC 4291 2.2), all of p to end, into 16 bytes at
+ * addr.
+ */
+static int parse_ip6(const char* p, const char* end, unsigned char* addr) {
+  const char* group;
+  int n = 0; /* bytes so far */
+  int gap = -1; /* where "::" was */
+  int digits, value;
+
+  if (end - p >= 2 && p[0] == ':' && p[1] == ':') {
+    gap = 0;
+    p += 2;
+  }
+
+  while (p < end) {
+    group = p;
+    for (value = 0, digits = 0; p < end && UNHEX(*p) >= 0 && digits < 4;
+         p++, digits++) {
+      value = value * 16 + UNHEX(*p);
+    }
+
+    if (p < end && *p == '.') {
+      /* An IPv4 address in the last 32 bits. */
+      if (n > 12 || parse_ip4(group, end, addr + n) < 0) return -1;
+      n += 4;
+      break;
+    }
+    if (digits == 0 || n == 16) return -1;
+    addr[n++] = (unsigned char)(value >> 8);
+    addr[n++] = (unsigned char)value;
+
+    if (p == end) break;
+    if (*p++ != ':' || p == end) return -1;
+    if (*p == ':') {
+      if (gap >= 0) return -1;
+      gap = n;
+      p++;
+    }
+  }
+
+  if (gap < 0) return n == 16 ? 0 : -1;
+  if (n == 16) return -1; /* "::" must stand for at least one group. */
+  memmove(addr + 16 - (n - gap), addr + gap, n - gap);
+  memset(addr + gap, 0, 16 - n);
+  return 0;
+}
+
+static int parse_port(const char* p, const char* end, unsigned int* port) {
+  unsigned long value = 0;
+
+  if (p == end || end - p > 5) return -1;
+  for (; p < end; p++) {
+    if (!IS_NUMBER(*p)) return -1;
+    value = value * 10 + (*p - '0');
+  }
+  if (value > 65535) return -1;
+  *port = (unsigned int)value;
+  return 0;
+}
+
+/* "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n" */
+static int parse_proxy_v1(const char* p, const char* end, hl_proxy* proxy) {
+  const char* fields[4];
+  const char* field_end[4];
+  int (*parse_ip)(const char*, const char*, unsigned char*);
+  int i;
+
+  if (end - p < 8 || memcmp(p, PROXY_V1, sizeof(PROXY_V1) - 1) != 0 ||
+      end[-2] != '\r' || end[-1] != '\n') {
+    return -1;
+  }
+  proxy->version = 1;
+  p += sizeof(PROXY_V1) - 1;
+  end -= 2;
+
+  /* Anything may follow UNKNOWN. */
+  if (end - p >= 7 && memcmp(p, "UNKNOWN", 7) == 0 &&
+      (end - p == 7 || p[7] == ' ')) {
+    proxy->family = HL_PROXY_UNSPEC;
+    return 0;
+  }
+
+  if (end - p < 5 || memcmp(p, "TCP", 3) != 0 || p[4] != ' ') return -1;
+  if (p[3] == '4') {
+    proxy->family = HL_PROXY_TCP4;
+    parse_ip = parse_ip4;
+  } else if (p[3] == '6') {
+    proxy->family = HL_PROXY_TCP6;
+    parse_ip = parse_ip6;
+  } else {
+    return -1;
+  }
+  p += 5;
+
+  /* Source and destination address and port, one space apart. */
+  for (i = 0; i < 4; i++) {
+    fields[i] = p;
+    while (p < end && *p != ' ') p++;
+    field_end[i] = p;
+    if (i < 3 && p++ == end) return -1;
+  }
+  if (p != end) return -1;
+
+  if (parse_ip(fields[0], field_end[0], proxy->src_addr) < 0 ||
+      parse_ip(fields[1], field_end[1], proxy->dst_addr) < 0 ||
+      parse_port(fields[2], field_end[2], &proxy->src_port) < 0 ||
+      parse_port(fields[3], field_end[3], &proxy->dst_port) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Sets span to the bytes from p up to the first NUL, at most len of them. */
+static void unix_path(const char* p, size_t len, hl_span* span) {
+  const char* nul = memchr(p, '\0', len);
+
+  span->start = p;
+  span->end = nul ? nul : p + len;
+}
+
+static int parse_proxy_v2(const char* buf, const char* end, hl_proxy* proxy) {
+  const unsigned char* u = (const unsigned char*)buf;
+  const char* p;
+  size_t len, addr_len;
+
+  if (end - buf < PROXY_V2_HEADER) return -1;
+  p = buf + PROXY_V2_HEADER;
+  len = ((size_t)u[14] << 8) | u[15];
+  if ((u[12] & 0xf0) != 0x20 || (u[12] & 0x0f) > 1 ||
+      (size_t)(end - p) != len) {
+    return -1;
+  }
+  proxy->version = 2;
+
+  /* Address family in the high nibble, protocol in the low. */
+  switch (u[13]) {
+    case 0x11: proxy->family = HL_PROXY_TCP4; addr_len = 12; break;
+    case 0x12: proxy->family = HL_PROXY_UDP4; addr_len = 12; break;
+    case 0x21: proxy->family = HL_PROXY_TCP6; addr_len = 36; break;
+    case 0x22: proxy->family = HL_PROXY_UDP6; addr_len = 36; break;
+    case 0x31: proxy->family = HL_PROXY_UNIX_STREAM; addr_len = 216; break;
+    case 0x32: proxy->family = HL_PROXY_UNIX_DGRAM; addr_len = 216; break;
+    default:
+      if ((u[13] >> 4) > 3 || (u[13] & 0x0f) > 2) return -1;
+      proxy->family = HL_PROXY_UNSPEC;
+      addr_len = 0;
+      break;
+  }
+  if (len < addr_len) return -1;
+
+  switch (proxy->family) {
+    case HL_PROXY_TCP4:
+    case HL_PROXY_UDP4:
+      memcpy(proxy->src_addr, p, 4);
+      memcpy(proxy->dst_addr, p + 4, 4);
+      u = (const unsigned char*)p + 8;
+      break;
+    case HL_PROXY_TCP6:
+    case HL_PROXY_UDP6:
+      memcpy(proxy->src_addr, p, 16);
+      memcpy(proxy->dst_addr, p + 16, 16);
+      u = (const unsigned char*)p + 32;
+      break;
+    case HL_PROXY_UNIX_STREAM:
+    case HL_PROXY_UNIX_DGRAM:
+      unix_path(p, 108, &proxy->src_path);
+      unix_path(p + 108, 108, &proxy->dst_path);
+      u = NULL;
+      break;
+    default:
+      u = NULL;
+      break;
+  }
+  if (u) {
+    proxy->src_port = ((unsigned int)u[0] << 8) | u[1];
+    proxy->dst_port = ((unsigned int)u[2] << 8) | u[3];
+  }
+
+  /* LOCAL: the load balancer talking for itself. */
+  if ((buf[12] & 0x0f) == 0) proxy->family = HL_PROXY_UNSPEC;
+
+  if (len > addr_len) {
+    proxy->tlv.start = p + addr_len;
+    proxy->tlv.end = end;
+  }
+  return 0;
+}
+
+int hl_proxy_parse(const char* buf, size_t buflen, hl_proxy* proxy) {
+  memset(proxy, 0, sizeof(*proxy));
+  if (buflen >= 12 && memcmp(buf, PROXY_V2_SIG, 12) == 0) {
+    return parse_proxy_v2(buf, buf + buflen, proxy);
+  }
+  return parse_proxy_v1(buf, buf + buflen, proxy);
+}
+
+
+enum multipart_state {
+  MP_START,
+  MP_PREAMBLE,
+  MP_DELIMITER,
+  MP_AFTER_DELIM,
+  MP_PADDING,
+  MP_DELIM_CR,
+  MP_CLOSE_DASH,
+  MP_FIELD_START,
+  MP_FIELD_START_CR,
+  MP_FIELD,
+  MP_FIELD_COLON,
+  MP_VALUE_START,
+  MP_VALUE,
+  MP_VALUE_CR,
+  MP_VALUE_CRLF,
+  MP_BODY,
+  MP_EOF
+};
+
+int hl_multipart_init(hl_multipart* mp, const char* boundary, size_t len) {
+  if (len == 0 || len > HL_MULTIPART_MAX_BOUNDARY) return -1;
+
+  mp->last = HL_EAGAIN;
+  mp->state = MP_START;
+  mp->i = 0;
+  mp->delim_len = (unsigned char)(4 + len);
+  memcpy(mp->delim, "\r\n--", 4);
+  memcpy(mp->delim + 4, boundary, len);
+  return 0;
+}
+
+/* Finds the delimiter d of length k in [p, end). Returns a pointer to it, or
+ * to a prefix of it that runs up to end, or end if neither is found.
+ *
+ * Candidates are filtered 16 at a time by comparing both the first byte of
+ * the delimiter ('\r') and its last byte at the right distance; only
+ * positions where both agree are checked with memcmp().
+ */
+static const char* find_delim(const char* d, size_t k,
+                              const char* p, const char* end) {
+#ifdef HL_SSE2
+  __m128i first = _mm_set1_epi8(d[0]);
+  __m128i last = _mm_set1_epi8(d[k - 1]);
+  int mask;
+
+  for (; (size_t)(end - p) >= k - 1 + 16; p += 16) {
+    mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), first),
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + k - 1)), last)));
+    while (mask) {
+      if (memcmp(p + __builtin_ctz(mask) + 1, d + 1, k - 2) == 0) {
+        return p + __builtin_ctz(mask);
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; p < end; p++) {
+    p = memchr(p, d[0], end - p);
+    if (p == NULL) return end;
+    if (memcmp(p, d, MIN(k, (size_t)(end - p))) == 0) return p;
+  }
+  return end;
+}
+
+hl_token hl_multipart_execute(hl_multipart* mp,
+                              const char* data,
+                              size_t len) {
+  hl_token token; /* returned token */
+  const char* head = data; /* lexer head */
+  const char* end = data + len;
+  const size_t k = mp->delim_len;
+  const char* found;
+
+  token.kind = mp->last;
+  token.start = mp->last == HL_EAGAIN ? NULL : data;
+  token.end = NULL;
+  token.partial = 0;
+
+  for (; head < end || mp->state == MP_EOF; head++) {
+    char c = head < end ? *head : 0;
+    switch (mp->state) {
+      default: assert(0);
+
+      case MP_START: {
+        /* The first delimiter may come without the leading CRLF. */
+        if (c == mp->delim[2 + mp->i]) {
+          if (2 + ++mp->i == k) {
+            mp->state = MP_AFTER_DELIM;
+          }
+          break;
+        }
+        mp->state = MP_PREAMBLE;
+        /* pass-through to MP_PREAMBLE */
+      }
+
+      case MP_PREAMBLE: {
+        found = find_delim(mp->delim, k, head, end);
+        if ((size_t)(end - found) >= k) {
+          head = found + k - 1;
+          mp->state = MP_AFTER_DELIM;
+          break;
+        }
+        token.kind = HL_EAGAIN;
+        token.start = NULL;
+        token.end = found;
+        return token;
+      }
+
+      case MP_DELIMITER: {
+        /* find_delim() already saw the whole delimiter here. */
+        if (c != mp->delim[mp->i]) goto error;
+        if (++mp->i == k) {
+          mp->state = MP_AFTER_DELIM;
+          goto part_end;
+        }
+        break;
+      }
+
+      case MP_AFTER_DELIM: {
+        if (c == '-') {
+          mp->state = MP_CLOSE_DASH;
+        } else if (c == ' ' || c == '\t') {
+          mp->state = MP_PADDING;
+        } else if (c == '\r') {
+          mp->state = MP_DELIM_CR;
+        } else if (c == '\n') {
+          goto part_start;
+        } else {
+          goto error;
+        }
+        break;
+      }
+
+      case MP_PADDING: {
+        if (c == '\r') {
+          mp->state = MP_DELIM_CR;
+        } else if (c == '\n') {
+          goto part_start;
+        } else if (c != ' ' && c != '\t') {
+          goto error;
+        }
+        break;
+      }
+
+      case MP_DELIM_CR: {
+        if (c != '\n') goto error;
+        goto part_start;
+      }
+
+      case MP_CLOSE_DASH: {
+        if (c != '-') goto error;
+        /* Anything after the close delimiter is epilogue. */
+        mp->state = MP_EOF;
+        break;
+      }
+
+      case MP_EOF: {
+        token.kind = HL_EOF;
+        token.start = token.end = head;
+        goto token_complete;
+      }
+
+      case MP_FIELD_START: {
+        assert(token.kind == HL_EAGAIN);
+        if (c == '\r') {
+          mp->state = MP_FIELD_START_CR;
+        } else if (c == '\n') {
+          goto header_end;
+        } else if (IS_FIELD_CHAR(c)) {
+          token.kind = HL_FIELD;
+          token.start = head;
+          mp->state = MP_FIELD;
+        } else {
+          goto error;
+        }
+        break;
+      }
+
+      case MP_FIELD_START_CR: {
+        if (c != '\n') goto error;
+        goto header_end;
+      }
+
+      case MP_FIELD: {
+        assert(token.kind == HL_FIELD);
+        if (c == ':') {
+          token.end = head;
+          mp->state = MP_FIELD_COLON;
+          goto token_complete;
+        }
+        if (!IS_FIELD_CHAR(c)) goto error;
+        break;
+      }
+
+      case MP_FIELD_COLON: {
+        assert(token.kind == HL_EAGAIN);
+        if (c != ':') goto error;
+        mp->state = MP_VALUE_START;
+        break;
+      }
+
+      case MP_VALUE_START: {
+        /* Skip spaces at the beginning of values */
+        if (c == ' ' || c == '\t') break;
+        token.kind = HL_VALUE;
+        token.start = head;
+        mp->state = MP_VALUE;
+        /* pass-through to MP_VALUE */
+      }
+
+      case MP_VALUE: {
+        assert(token.kind == HL_VALUE);
+        if (c == '\r' || c == '\n') {
+          token.end = head;
+          mp->state = c == '\r' ? MP_VALUE_CR : MP_VALUE_CRLF;
+          goto token_complete;
+        }
+        break;
+      }
+
+      case MP_VALUE_CR: {
+        assert(token.kind == HL_EAGAIN);
+        if (c != '\r') goto error;
+        mp->state = MP_VALUE_CRLF;
+        break;
+      }
+
+      case MP_VALUE_CRLF: {
+        assert(token.kind == HL_EAGAIN);
+        if (c != '\n') goto error;
+        mp->state = MP_FIELD_START;
+        break;
+      }
+
+      case MP_BODY: {
+        /* Bodies are consumed in one go rather than byte by byte. */
+        found = find_delim(mp->delim, k, head, end);
+
+        if ((size_t)(end - found) >= k) {
+          if (found > head || token.kind == HL_BODY) {
+            /* The body, or the last piece of it, ends here. */
+            mp->i = 0;
+            mp->state = MP_DELIMITER;
+            token.kind = HL_BODY;
+            token.start = head;
+            token.end = found;
+            goto token_complete;
+          }
+          /* Empty body. */
+          head = found + k - 1;
+          mp->state = MP_AFTER_DELIM;
+          goto part_end;
+        }
+
+        if (found == head) {
+          /* Could be a delimiter; can't tell until more data arrives. */
+          mp->last = token.kind;
+          token.kind = HL_EAGAIN;
+          token.start = NULL;
+          token.end = found;
+          return token;
+        }
+
+        /* If found < end, stop short of the possible delimiter so the next
+         * call starts with it.
+         */
+        token.kind = HL_BODY;
+        token.start = head;
+        token.end = found;
+        token.partial = 1;
+        mp->last = HL_BODY;
+        return token;
+      }
+    }
+  }
+
+  token.end = head;
+  token.partial = token.kind != HL_EAGAIN;
+  mp->last = token.kind;
+  return token;
+
+part_start:
+  mp->state = MP_FIELD_START;
+  token.kind = HL_PART_START;
+  token.start = token.end = head + 1;
+  goto token_complete;
+
+header_end:
+  mp->state = MP_BODY;
+  token.kind = HL_HEADER_END;
+  token.start = token.end = head + 1;
+  goto token_complete;
+
+part_end:
+  token.kind = HL_PART_END;
+  token.start = token.end = head + 1;
+  goto token_complete;
+
+token_complete:
+  assert(token.partial == 0);
+  assert(token.end);
+  mp->last = HL_EAGAIN;
+  return token;
+
+error:
+  token.kind = HL_ERROR;
+  token.start = NULL;
+  token.end = head;
+  return token;
+}
+
+
+enum form_state {
+  FS_PAIR_START,
+  FS_KEY,
+  FS_NO_VALUE,
+  FS_EQUALS,
+  FS_VALUE,
+  FS_DONE
+};
+
+void hl_form_init(hl_form* form) {
+  form->last = HL_EAGAIN;
+  form->state = FS_PAIR_START;
+  form->esc = 0;
+}
+
+hl_token hl_form_execute(hl_form* form, const char* data, size_t len) {
+  hl_token token; /* returned token */
+  const char* head = data; /* lexer head */
+  const char* end = data + len;
+
+  token.kind = form->last;
+  token.start = form->last == HL_EAGAIN ? NULL : data;
+  token.end = NULL;
+  token.partial = 0;
+
+  while (head < end) {
+    switch (form->state) {
+      default: assert(0);
+
+      case FS_PAIR_START: {
+        /* Skip empty pairs, E.G. "a=1&&b=2" */
+        if (*head == '&') {
+          head++;
+          break;
+        }
+        token.kind = HL_FIELD;
+        token.start = head;
+        form->state = FS_KEY;
+        break;
+      }
+
+      case FS_KEY: {
+        assert(token.kind == HL_FIELD);
+        head = find_any(head, end, "&=");
+        if (head == end) break;
+
+        /* Stop at the separator; the next call deals with it. */
+        token.end = head;
+        form->state = *head == '=' ? FS_EQUALS : FS_NO_VALUE;
+        goto token_complete;
+      }
+
+      case FS_NO_VALUE: {
+        assert(token.kind == HL_EAGAIN);
+        token.kind = HL_VALUE;
+        token.start = token.end = head;
+        form->state = FS_PAIR_START;
+        goto token_complete;
+      }
+
+      case FS_EQUALS: {
+        assert(*head == '=');
+        head++;
+        token.kind = HL_VALUE;
+        token.start = head;
+        form->state = FS_VALUE;
+        break;
+      }
+
+      case FS_VALUE: {
+        assert(token.kind == HL_VALUE);
+        head = memchr(head, '&', end - head);
+        if (head == NULL) {
+          head = end;
+          break;
+        }
+
+        token.end = head;
+        form->state = FS_PAIR_START;
+        goto token_complete;
+      }
+    }
+  }
+
+  token.end = head;
+  token.partial = token.kind != HL_EAGAIN;
+  form->last = token.kind;
+  return token;
+
+token_complete:
+  assert(token.partial == 0);
+  form->last = HL_EAGAIN;
+  return token;
+}
+
+hl_token hl_form_end(hl_form* form) {
+  hl_token token;
+
+  token.start = token.end = NULL;
+  token.partial = 0;
+  form->last = HL_EAGAIN;
+
+  switch (form->state) {
+    case FS_KEY:
+      token.kind = HL_FIELD;
+      form->state = FS_NO_VALUE;
+      break;
+
+    case FS_NO_VALUE:
+    case FS_EQUALS:
+    case FS_VALUE:
+      token.kind = HL_VALUE;
+      form->state = FS_DONE;
+      break;
+
+    default:
+      token.kind = HL_EOF;
+      form->state = FS_DONE;
+      break;
+  }
+
+  return token;
+}
+
+ssize_t hl_form_decode(hl_form* form, hl_token token, char* dst) {
+  const char* src = token.start;
+  const char* end = token.end;
+  const char* next;
+  char* w = dst;
+  int value;
+
+  for (;;) {
+    /* Finish a "%XX" that started in an earlier token. */
+    while (form->esc && src < end) {
+      value = UNHEX(*src++);
+      if (value < 0) goto error;
+      form->esc_value = form->esc_value * 16 + value;
+      if (++form->esc == 3) {
+        *w++ = (char)form->esc_value;
+        form->esc = 0;
+      }
+    }
+
+    next = find_any(src, end, "%+");
+    if (w != src && next != src) memmove(w, src, next - src);
+    w += next - src;
+    src = next;
+    if (src == end) break;
+
+    if (*src++ == '+') {
+      *w++ = ' ';
+    } else {
+      form->esc = 1;
+      form->esc_value = 0;
+    }
+  }
+
+  if (form->esc && !token.partial) goto error;
+  return w - dst;
+
+error:
+  form->esc = 0;
+  return -1;
+}
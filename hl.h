@@ -6,6 +6,13 @@
  * - Transfer-Encoding: chunked
  * - Trailing header.
  * - Streaming bodies.
+ * - Splitting URLs into scheme, host, port, path, query and fragment.
+ * - Streaming multipart/form-data and x-www-form-urlencoded bodies.
+ * - Hands off to HTTP/2 (hl2.h) on "Upgrade: h2c" or the HTTP/2 preface.
+ * - Hands off to WebSocket (ws.h) on "Upgrade: websocket".
+ * - PROXY protocol v1 and v2 headers from load balancers, optionally.
+ * - Optional limits on URL, header and body sizes (414, 431, 413).
+ * - Optional hash of the request head for cache keys, kept while lexing.
  * - No syscalls - pure computation.
  * - No allocations - you own all the memory.
  * - No callbacks.
@@ -26,6 +33,7 @@
 /* Every HTTP stream will contain one or more requests which are broken up
    into tokens.
 
+   HL_PROXY?
    (HL_MSG_START
     HL_METHOD HL_URL
     (HL_FIELD HL_VALUE)*
@@ -33,10 +41,16 @@
     HL_BODY*
     (HL_FIELD HL_VALUE)*
     HL_MSG_END)+
-    HL_EOF
+    (HL_EOF | HL_UPGRADE)
 
    Note that a trailing header may be present after the body. However, this is
    very uncommon. See RFC 2616 14.40.
+
+   A request with an Upgrade header is the last one; HL_UPGRADE follows its
+   HL_MSG_END. The HTTP/2 connection preface (RFC 7540 3.5) is lexed as
+   HL_MSG_START HL_METHOD ("PRI") HL_URL ("*") HL_UPGRADE.
+
+   HL_PROXY is only lexed after hl_req_init_proxy().
  */
 
 typedef enum {
@@ -52,9 +66,50 @@ typedef enum {
   HL_VALUE, /* E.G. "text/plain" */
   HL_HEADER_END,
   HL_BODY, /* Many HL_BODY chunks may appear in a row. */
-  HL_MSG_END
+  HL_MSG_END,
+
+  HL_PART_START, /* Multipart only. A body part begins. */
+  HL_PART_END, /* Multipart only. A body part ends. */
+
+  /* HTTP ends and another protocol begins at token.end; lexer->upgrade says
+   * which. Do not call hl_execute() again.
+   */
+  HL_UPGRADE,
+
+  /* The PROXY protocol header sent by a load balancer before the first
+   * request, E.G. "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n". See
+   * hl_proxy_parse().
+   */
+  HL_PROXY
 } hl_token_kind;
 
+#define HL_TOKEN_KINDS (HL_PROXY + 1) /* Keep HL_PROXY last. */
+
+/* Values of lexer->upgrade. */
+enum {
+  HL_UPGRADE_NONE,
+  HL_UPGRADE_OTHER, /* Check the Upgrade header. */
+
+  /* "Upgrade: h2c" with an HTTP2-Settings header (RFC 7540 3.2). Reply
+   * "101 Switching Protocols", then lex the rest with hl2_req_init(); the
+   * client sends the preface next. The request, body included, was HTTP/1
+   * and is answered on stream 1.
+   */
+  HL_UPGRADE_H2C,
+
+  /* The HTTP/2 preface: the client knew the server speaks HTTP/2. The preface
+   * has been consumed; lex the rest with hl2_req_init_no_preface().
+   */
+  HL_UPGRADE_H2,
+
+  /* "Upgrade: websocket" with Sec-WebSocket-Key and "Sec-WebSocket-Version:
+   * 13" (RFC 6455 4.2.1). Reply "101 Switching Protocols" with the
+   * Sec-WebSocket-Accept computed from the key, then lex the rest with
+   * hl_ws_server_init().
+   */
+  HL_UPGRADE_WEBSOCKET
+};
+
 typedef struct {
   hl_token_kind kind;
 
@@ -62,42 +117,327 @@ typedef struct {
    * strings; some are just points, like HL_MSG_START, HL_HEADER_END,
    * HL_MSG_END, and HL_ERROR. They will have start and end pointing to
    * the same location. The other tokens delimit strings:
-   * HL_METHOD, HL_REASON, HL_URL, HL_FIELD, HL_VALUE, HL_BODY.
+   * HL_METHOD, HL_REASON, HL_URL, HL_FIELD, HL_VALUE, HL_BODY, HL_PROXY.
    */
   const char* start;
   const char* end;
 
   /* If partial is non-zero, the next token will be of the same kind. This can
    * happen in the case that a string is split over multiple packets. Used for
-   * HL_METHOD, HL_REASON, HL_URL, HL_FIELD, HL_VALUE, HL_BODY.
+   * HL_METHOD, HL_REASON, HL_URL, HL_FIELD, HL_VALUE, HL_BODY, HL_PROXY.
    */
   char partial;
 } hl_token;
 
+/* Values of lexer->method. */
+enum {
+  HL_METHOD_OTHER, /* Any other method; see the HL_METHOD token. */
+  HL_METHOD_GET,
+  HL_METHOD_HEAD,
+  HL_METHOD_POST,
+  HL_METHOD_PUT,
+  HL_METHOD_DELETE,
+  HL_METHOD_CONNECT,
+  HL_METHOD_OPTIONS,
+  HL_METHOD_TRACE,
+  HL_METHOD_PATCH,
+
+  /* WebDAV */
+  HL_METHOD_COPY,
+  HL_METHOD_LOCK,
+  HL_METHOD_MKCOL,
+  HL_METHOD_MOVE,
+  HL_METHOD_PROPFIND,
+  HL_METHOD_PROPPATCH,
+  HL_METHOD_SEARCH,
+  HL_METHOD_UNLOCK,
+  HL_METHOD_REPORT,
+  HL_METHOD_MKACTIVITY,
+  HL_METHOD_CHECKOUT,
+  HL_METHOD_MERGE,
+
+  /* UPnP */
+  HL_METHOD_MSEARCH, /* "M-SEARCH" */
+  HL_METHOD_NOTIFY,
+  HL_METHOD_SUBSCRIBE,
+  HL_METHOD_UNSUBSCRIBE,
+
+  HL_METHOD_PURGE, /* Cache invalidation. */
+  HL_METHOD_PRI /* The HTTP/2 preface. */
+};
+
+/* Maximum number of names in an hl_header_set. */
+#define HL_HEADER_SET_MAX 32
+
+/* The header fields a server wants to see. See hl_set_headers(). */
 typedef struct {
   /* private */
-  char flags;
+  const char* const* names;
+  size_t count;
+  unsigned short len[HL_HEADER_SET_MAX];
+} hl_header_set;
+
+/* Limits on what one message may make the server keep. See hl_set_limits().
+ * Sizes are in bytes.
+ */
+typedef struct {
+  size_t url; /* The URL. 414 URI Too Long. */
+  size_t field_line; /* A field name and value. 431. */
+  size_t header; /* The request line and header, or trailer. 431. */
+  unsigned int fields; /* Fields in the header, or trailer. 431. */
+  size_t chunk_line; /* A chunk size line, extensions and CRLF included. */
+  size_t body; /* Content-Length, or the sum of the chunks. 413. */
+} hl_limits;
+
+/* Why hl_execute() returned HL_ERROR. See lexer->error. */
+typedef enum {
+  HL_ERR_NONE,
+  HL_ERR_SYNTAX, /* 400 Bad Request. None of the below. */
+  HL_ERR_URL_TOO_LONG, /* 414 URI Too Long */
+  HL_ERR_HEADER_TOO_LARGE, /* 431 Request Header Fields Too Large */
+  HL_ERR_BODY_TOO_LARGE, /* 413 Content Too Large. Also on overflow. */
+  HL_ERR_CHUNK_LINE_TOO_LONG, /* 400 Bad Request */
+
+  /* 400 Bad Request, by where it went wrong. */
+  HL_ERR_PROXY, /* The PROXY protocol header. */
+  HL_ERR_METHOD, /* Also a bad byte where a request should start. */
+  HL_ERR_URL,
+  HL_ERR_VERSION, /* The rest of the request line. */
+  HL_ERR_FIELD, /* A field name. */
+  HL_ERR_OBS_FOLD, /* A value continued on the next line with a tab. */
+  HL_ERR_LINE_END, /* CR without LF. */
+  HL_ERR_CONTENT_LENGTH, /* Not a number. */
+  HL_ERR_CHUNK, /* A chunk size line, or CRLF after a chunk. */
+  HL_ERR_PREFACE /* The HTTP/2 connection preface. */
+} hl_error_code;
+
+/* Parts of a message that hl_stats times. */
+enum {
+  HL_STATS_LINE, /* The PROXY header and request line. */
+  HL_STATS_HEADER, /* And trailer. */
+  HL_STATS_BODY, /* Chunk size lines too. */
+  HL_STATS_OTHER, /* Between messages. */
+  HL_STATS_CLASSES
+};
+
+/* Counters kept by hl_execute() when hl.c is built with -DHL_STATS. See
+ * hl_set_stats(). Without HL_STATS they are never touched.
+ */
+typedef struct {
+  unsigned long bytes; /* Lexed. */
+  unsigned long tokens[HL_TOKEN_KINDS]; /* Completed, by kind. */
+  unsigned long partial; /* Returns with a partial token. */
+  unsigned long eagain; /* Returns with HL_EAGAIN. */
+  unsigned long messages;
+  unsigned long chunked; /* Bodies, by framing. */
+  unsigned long identity;
+
+  /* Time in hl_execute(), by the part of the message each call started
+   * in. In units of HL_STATS_NOW(), which defaults to clock().
+   */
+  unsigned long ticks[HL_STATS_CLASSES];
+} hl_stats;
+
+/* A hash of chosen parts of each request head, kept by hl_execute() as
+ * they go past, for a cache key. See hl_set_key().
+ */
+typedef struct {
+  unsigned int tokens; /* HL_TOKEN_BIT()s of the kinds to hash. */
+  unsigned long fields; /* Bit k: values of the name at index k of the set. */
+
+  /* read-only */
+  /* Of the head so far; the key once HL_HEADER_END is returned. Each part
+   * is hashed on its own with its kind and field, and the parts are added,
+   * so the order of the header fields doesn't matter.
+   */
+  unsigned long hash;
+
+  /* private */
+  unsigned long part;
+  unsigned long tail; /* The bytes of part not yet mixed in. */
+  size_t len; /* of part */
+  char in_head;
+} hl_key;
+
+typedef struct {
+  /* private */
+  unsigned int flags;
   hl_token_kind last;
   unsigned char state;
   unsigned char header_state;
   unsigned char i;
+  unsigned int tokens;
   const char* match;
   size_t chunk_read;
   size_t chunk_len;
+  const hl_header_set* headers;
+  const hl_limits* limits;
+  size_t line_read; /* of the current line, in earlier bufs */
+  size_t head_read; /* of the header, up to the current line */
+  unsigned int fields;
+  hl_stats* stats;
+  hl_key* key;
 
   /* read-only */
   /* These values should be copied out the struct on HL_HEADER_END. */
   unsigned char version_major;
   unsigned char version_minor;
-  size_t content_read;
-  char upgrade; /* 1 means that HTTP ends. Do not call hl_execute() again. */
+  unsigned char method; /* HL_METHOD_*. Set with the HL_METHOD token. */
+  size_t content_read; /* Of the body so far, chunked or not. */
+  char upgrade; /* HL_UPGRADE_*. Non-zero means that HTTP ends. */
   ssize_t content_length; /* -1 means unknown body length */
   unsigned int code; /* responses only. E.G. 200, 404. */
+
+  /* With hl_set_headers(): 1 + the index in the set of the name of the
+   * last HL_FIELD.
+   */
+  unsigned char field;
+
+  /* After HL_ERROR: why, and where in the stream the lexer stopped. The
+   * offset counts every byte lexed since hl_req_init(). See also
+   * hl_state_name().
+   */
+  unsigned char error; /* HL_ERR_* */
+  size_t offset;
 } hl_lexer;
 
 /* Initializes an HTTP request lexer. Used in HTTP servers. */
 void hl_req_init(hl_lexer* lexer);
 
+/* Like hl_req_init(), for servers behind a load balancer that speaks the
+ * PROXY protocol (v1 or v2). The connection must start with a PROXY header,
+ * which is returned as an HL_PROXY token before the first HL_MSG_START.
+ * Anything else is an HL_ERROR.
+ */
+void hl_req_init_proxy(hl_lexer* lexer);
+
+/* Initializes a set of count header names, E.G. { "Host", "Content-Type" },
+ * for hl_set_headers(). names must outlive set. The set is never changed by
+ * the lexer, so one can be shared by all connections. Returns 0 on success
+ * or -1 if there are more than HL_HEADER_SET_MAX names or one is empty.
+ */
+int hl_header_set_init(hl_header_set* set,
+                       const char* const* names,
+                       size_t count);
+
+/* Makes hl_execute() return HL_FIELD and HL_VALUE tokens only for the
+ * header fields named in set, compared case-insensitively. The others are
+ * checked and skipped without returning; their values are searched for the
+ * line end 16 bytes at a time with SSE2. Content-Length, Transfer-Encoding
+ * and the like still take effect when skipped. Call after hl_req_init().
+ *
+ * lexer->field says which name an HL_FIELD is, and HL_FIELD is never
+ * partial. For that, as with hl_multipart_execute(), HL_EAGAIN may come
+ * with token.end short of the end of buf when buf ends in what could be a
+ * wanted name. Keep the bytes from token.end on and pass them again in
+ * front of the next data.
+ */
+void hl_set_headers(hl_lexer* lexer, const hl_header_set* set);
+
+/* The name of the lexer's state, E.G. "S_FIELD". After HL_ERROR it is the
+ * state that failed. For logs.
+ */
+const char* hl_state_name(const hl_lexer* lexer);
+
+/* Bytes that a snapshot from hl_lexer_serialize() can take. Most take
+ * under 40.
+ */
+#define HL_LEXER_SNAPSHOT_MAX 256
+
+/* Writes the state of lexer to buf, to move a connection to another thread
+ * or process without draining it. The snapshot has no pointers and a
+ * version, and hl_lexer_restore() goes on exactly where lexer stopped, even
+ * mid-header or mid-chunk. Returns its length, or -1 if len is too short.
+ *
+ * The header set, limits, stats and key are not in it. Set them again after
+ * restoring, before hl_execute(): a header set is needed if it was set.
+ */
+ssize_t hl_lexer_serialize(const hl_lexer* lexer,
+                           unsigned char* buf,
+                           size_t len);
+
+/* Makes lexer from a snapshot written by hl_lexer_serialize(). Returns the
+ * length of the snapshot, or -1 if buf is not one of this version.
+ */
+ssize_t hl_lexer_restore(hl_lexer* lexer,
+                         const unsigned char* buf,
+                         size_t len);
+
+/* Fills in limits suitable for most servers: 8 KB URLs and field lines,
+ * 32 KB headers, 100 fields and 1 KB chunk size lines. The body is not
+ * limited.
+ */
+void hl_limits_init(hl_limits* limits);
+
+/* Makes hl_execute() return HL_ERROR once a message goes over limits, with
+ * lexer->error saying which kind. Lines are checked as they end and at the
+ * end of each buf, so a caller that keeps partial tokens never has to keep
+ * much more than a limit. Stays in effect for the connection; limits must
+ * outlive lexer and can be shared. Call after hl_req_init(); the default is
+ * no limits.
+ *
+ * A Content-Length or chunk size too big for the lexer is always an
+ * HL_ERR_BODY_TOO_LARGE.
+ */
+void hl_set_limits(hl_lexer* lexer, const hl_limits* limits);
+
+/* The bit of a token kind in a mask for hl_set_tokens(). */
+#define HL_TOKEN_BIT(kind) (1u << (kind))
+
+/* Makes hl_execute() return only the token kinds in mask, E.G.
+ * HL_TOKEN_BIT(HL_METHOD) | HL_TOKEN_BIT(HL_URL) | HL_TOKEN_BIT(HL_MSG_END)
+ * for an access log. The other kinds are still checked, and still take
+ * effect, but hl_execute() goes on past them instead of returning.
+ * HL_EAGAIN, HL_EOF, HL_ERROR and HL_UPGRADE are always returned. Call after
+ * hl_req_init(); the default is every kind.
+ *
+ * Bytes of a suppressed token at the end of buf come back as HL_EAGAIN.
+ */
+void hl_set_tokens(hl_lexer* lexer, unsigned int mask);
+
+/* Makes hl_execute() count into stats, which is usually one per thread and
+ * shared by its lexers. Only with -DHL_STATS. Call after hl_req_init(); the
+ * default is no stats.
+ */
+void hl_set_stats(hl_lexer* lexer, hl_stats* stats);
+
+/* Adds stats to total, E.G. to scrape the stats of every thread. Takes no
+ * locks: each counter is read once while its thread may be writing it, so
+ * it's the old value or the new one, as long as unsigned long is written
+ * in one go.
+ */
+void hl_stats_add(hl_stats* total, const hl_stats* stats);
+
+/* Sets key to hash the tokens whose kinds are in tokens, E.G.
+ * HL_TOKEN_BIT(HL_METHOD) | HL_TOKEN_BIT(HL_URL), and the HL_VALUEs of the
+ * names in the header set whose bits are in fields, E.G. 1 for the first.
+ */
+void hl_key_init(hl_key* key, unsigned int tokens, unsigned long fields);
+
+/* Makes hl_execute() hash the head of each request into key as it is lexed,
+ * partial tokens included, so that key->hash is ready at HL_HEADER_END
+ * without going over the bytes again. Bytes are hashed as sent; the URL is
+ * not normalized. Fields are picked with hl_set_headers(). Tokens are
+ * hashed even when hl_set_tokens() leaves them out. key is for one
+ * connection. Call after hl_req_init(); the default is no key.
+ *
+ * Two requests with the same key->hash are very likely, not certain, to be
+ * the same; a cache should compare what it stored when that matters.
+ */
+void hl_set_key(hl_lexer* lexer, hl_key* key);
+
+/* Built with -DHL_USDT (and sys/sdt.h from SystemTap), hl.c has USDT probes
+ * for bpftrace and SystemTap. Each is a single NOP until traced.
+ *
+ *   hl:msg_start   lexer, HL_MSG_START, stream offset of the message
+ *   hl:header_end  lexer, HL_HEADER_END, bytes of request line and header
+ *   hl:msg_end     lexer, HL_MSG_END, bytes of body
+ *   hl:partial     lexer, kind of the token cut off, its bytes in this buf
+ *   hl:error       lexer, HL_ERROR, lexer->error, lexer->offset
+ *
+ * E.G. bpftrace -e 'usdt:./server:hl:header_end { @ = hist(arg2); }'
+ */
+
 /* buf is a buffer filled with HTTP data. buflen is the length of the
  * buffer.
  *
@@ -107,8 +447,8 @@ void hl_req_init(hl_lexer* lexer);
  * hl_execute() must be restarted repeatedly with buf = token.end. Even if
  * token.end == buf + buflen, that is, zero length in the buffer remaining,
  *
- * Continue to call hl_execute() until HL_EAGAIN, EP2_EOF, or HL_ERROR is
- * returned.
+ * Continue to call hl_execute() until HL_EAGAIN, HL_EOF, HL_UPGRADE or
+ * HL_ERROR is returned.
  *
  * If token.kind == HL_EAGAIN, the lexer has completed parsing buf and needs
  * new input. (Supplied by your next call to recv(2).)
@@ -118,6 +458,305 @@ void hl_req_init(hl_lexer* lexer);
 hl_token hl_execute(hl_lexer* lexer, const char* buf, size_t buflen);
 
 
+/* A string delimited by start and end, like the data of an hl_token. Parts
+ * that are absent have start == end == NULL.
+ */
+typedef struct {
+  const char* start;
+  const char* end;
+} hl_span;
+
+/* The four request-target forms of RFC 7230 5.3. */
+typedef enum {
+  HL_URL_ORIGIN, /* E.G. "/where?q=now#top" */
+  HL_URL_ABSOLUTE, /* E.G. "http://user@example.org:8080/where?q=now" */
+  HL_URL_AUTHORITY, /* CONNECT only. E.G. "example.org:443" */
+  HL_URL_ASTERISK /* OPTIONS only. "*" */
+} hl_url_form;
+
+typedef struct {
+  hl_url_form form;
+  hl_span scheme; /* "http" */
+  hl_span userinfo; /* "user" */
+  hl_span host; /* "example.org", or "[::1]" for IPv6 literals */
+  hl_span port; /* "8080" */
+  hl_span path; /* "/where", or "*" for HL_URL_ASTERISK */
+  hl_span query; /* "q=now", without the '?' */
+  hl_span fragment; /* "top", without the '#' */
+  int port_num; /* port as a number. -1 if no port was given. */
+} hl_url;
+
+/* Splits the data of an HL_URL token into its parts in a single pass. All
+ * spans point into buf; nothing is copied. Returns 0 on success or -1 if buf
+ * is not a valid request-target.
+ *
+ * The form is detected from the URL itself: "*" is asterisk-form, a leading
+ * '/' is origin-form, "scheme://" is absolute-form and anything else is
+ * treated as authority-form. If the HL_URL token was partial, the pieces must
+ * be joined before calling this.
+ */
+int hl_url_parse(const char* buf, size_t buflen, hl_url* url);
+
+/* Flags for hl_url_normalize(). */
+enum {
+  HL_NORM_ALLOW_NUL = 0x01, /* Decode "%00" instead of failing. */
+  HL_NORM_KEEP_SLASH = 0x02, /* Leave "%2F" encoded instead of failing. */
+  HL_NORM_MERGE_SLASHES = 0x04 /* Collapse "//" into "/". */
+};
+
+/* Percent-decodes a URL path and removes its "." and ".." segments (RFC 3986
+ * 5.2.4), in place. path is usually the path span of hl_url_parse(), which
+ * must start with '/'. The query is not touched; it has its own decoding
+ * rules.
+ *
+ * Decoding happens before dot segments are removed, so "/a/%2e%2e/b" becomes
+ * "/b". An encoded NUL or '/' fails unless allowed by flags, as does a
+ * malformed "%XX". ".." never climbs above "/".
+ *
+ * Returns the length of the result, which starts at path, or -1 on failure.
+ * On failure the contents of path are unspecified.
+ */
+ssize_t hl_url_normalize(char* path, size_t len, int flags);
+
+typedef struct {
+  hl_span key;
+  hl_span value; /* start == end == NULL if there was no '=' */
+
+  /* Non-zero if the key or value contains '%' or '+' and therefore needs
+   * hl_query_decode(). Otherwise the span can be used as-is.
+   */
+  char key_escaped;
+  char value_escaped;
+} hl_query_param;
+
+/* Iterates over the key/value pairs of a query string, E.G. the query span of
+ * hl_url_parse(). Pairs are separated by '&' or ';'; empty pairs are skipped.
+ * Nothing is copied or decoded.
+ *
+ * Each call consumes one pair from the front of query and stores it in param.
+ * Returns 1 if a pair was stored or 0 when query is exhausted.
+ *
+ *   hl_span query = url.query;
+ *   hl_query_param param;
+ *   while (hl_query_next(&query, &param)) { ... }
+ */
+int hl_query_next(hl_span* query, hl_query_param* param);
+
+/* Decodes "%XX" and '+' in a key or value of hl_query_next() into dst, which
+ * must have room for len bytes and may be the same as src. Returns the
+ * decoded length or -1 if src contains a malformed "%XX".
+ */
+ssize_t hl_query_decode(const char* src, size_t len, char* dst);
+
+
+/* An element of a comma separated header value (RFC 7230 7), E.G. the
+ * "gzip;q=0.8" of "Accept-Encoding: br, gzip;q=0.8".
+ */
+typedef struct {
+  hl_span token; /* "gzip" */
+  hl_span params; /* "q=0.8", after the first ';'. NULL if there is none. */
+
+  /* The q parameter (RFC 7231 5.3.1) in thousandths: 0 to 1000. 1000 if
+   * there is none, 0 if it is malformed.
+   */
+  unsigned int q;
+} hl_list_item;
+
+/* Iterates over the elements of a comma separated header value: Connection,
+ * TE, Accept, Accept-Encoding and so on. Empty elements and the whitespace
+ * around elements are skipped. A comma in a quoted parameter value doesn't
+ * end the element. Nothing is copied.
+ *
+ * Each call consumes one element from the front of list and stores it in
+ * item. Returns 1 if an element was stored or 0 when list is exhausted.
+ *
+ *   hl_span list = { value, value + len };
+ *   hl_list_item item;
+ *   while (hl_list_next(&list, &item)) { ... }
+ */
+int hl_list_next(hl_span* list, hl_list_item* item);
+
+
+/* A name=value pair of a Cookie header (RFC 6265 5.4). */
+typedef struct {
+  hl_span name;
+  hl_span value; /* without quotes. NULL if there was no '='. */
+} hl_cookie;
+
+/* Iterates over the pairs of a Cookie header value. Pairs are separated by
+ * ';'; whitespace around names and values and empty pairs are skipped.
+ * Nothing is copied or decoded. Separators are searched for 16 bytes at a
+ * time with SSE2.
+ *
+ * Each call consumes one pair from the front of cookies and stores it in
+ * cookie. Returns 1 if a pair was stored or 0 when cookies is exhausted.
+ *
+ *   hl_span cookies = { value, value + len };
+ *   hl_cookie cookie;
+ *   while (hl_cookie_next(&cookies, &cookie)) { ... }
+ */
+int hl_cookie_next(hl_span* cookies, hl_cookie* cookie);
+
+/* The names of the cookies wanted by hl_cookie_find(). */
+typedef struct {
+  /* private */
+  const char* const* names;
+  size_t count;
+  unsigned char first[32]; /* bitmap of the first bytes of names */
+} hl_cookie_set;
+
+/* names are count NUL-terminated cookie names, which must outlive set. A
+ * set can be shared between connections.
+ */
+void hl_cookie_set_init(hl_cookie_set* set,
+                        const char* const* names,
+                        size_t count);
+
+/* Like hl_cookie_next(), but only returns the cookies named in set. Pairs
+ * whose name can't match are skipped without looking further than the next
+ * ';'. Names are case-sensitive. Returns 1 + the index of the name in the
+ * set, or 0 when cookies is exhausted.
+ *
+ *   static const char* const names[] = { "session", "csrf" };
+ *   hl_cookie_set_init(&set, names, 2);
+ *   ...
+ *   while ((i = hl_cookie_find(&cookies, &set, &cookie)) > 0) { ... }
+ */
+int hl_cookie_find(hl_span* cookies,
+                   const hl_cookie_set* set,
+                   hl_cookie* cookie);
+
+
+/* The addresses of the client and of the load balancer it connected to, from
+ * an HL_PROXY token.
+ */
+typedef enum {
+  /* No addresses; use those of the socket. Sent for the load balancer's own
+   * health checks (v1 "UNKNOWN", v2 LOCAL) and for unsupported protocols.
+   */
+  HL_PROXY_UNSPEC,
+  HL_PROXY_TCP4,
+  HL_PROXY_TCP6,
+  HL_PROXY_UDP4, /* v2 only */
+  HL_PROXY_UDP6, /* v2 only */
+  HL_PROXY_UNIX_STREAM, /* v2 only */
+  HL_PROXY_UNIX_DGRAM /* v2 only */
+} hl_proxy_family;
+
+typedef struct {
+  unsigned char version; /* 1 or 2 */
+  hl_proxy_family family;
+
+  /* In network byte order, like struct in_addr and in6_addr. 4 bytes are
+   * used for IPv4 and 16 for IPv6.
+   */
+  unsigned char src_addr[16];
+  unsigned char dst_addr[16];
+  unsigned int src_port;
+  unsigned int dst_port;
+
+  hl_span src_path; /* UNIX only. Without the trailing NULs. */
+  hl_span dst_path;
+
+  /* v2 only. The type-length-value extensions (E.G. PP2_TYPE_SSL), not
+   * parsed.
+   */
+  hl_span tlv;
+} hl_proxy;
+
+/* Parses the data of an HL_PROXY token. Addresses are copied out; the spans
+ * point into buf. If the token was partial, the pieces must be joined before
+ * calling this. Returns 0 on success or -1 if buf is not a valid PROXY
+ * header.
+ */
+int hl_proxy_parse(const char* buf, size_t buflen, hl_proxy* proxy);
+
+
+/* multipart/form-data bodies, or any other multipart type. The data of the
+   HL_BODY tokens of a request is fed in and broken up into tokens:
+
+   (HL_PART_START
+    (HL_FIELD HL_VALUE)*
+    HL_HEADER_END
+    HL_BODY*
+    HL_PART_END)*
+    HL_EOF
+
+   The preamble and epilogue are skipped.
+ */
+
+#define HL_MULTIPART_MAX_BOUNDARY 70 /* RFC 2046 5.1.1 */
+
+typedef struct {
+  /* private */
+  hl_token_kind last;
+  unsigned char state;
+  unsigned char i;
+  unsigned char delim_len;
+  char delim[4 + HL_MULTIPART_MAX_BOUNDARY]; /* "\r\n--" boundary */
+} hl_multipart;
+
+/* Initializes a multipart lexer. boundary is the boundary parameter of the
+ * Content-Type header, without quotes. Returns 0 on success or -1 if the
+ * boundary is empty or too long.
+ */
+int hl_multipart_init(hl_multipart* mp, const char* boundary, size_t len);
+
+/* Works like hl_execute(): call it repeatedly with buf = token.end until
+ * HL_EAGAIN, HL_EOF or HL_ERROR. It never allocates and keeps no pointers
+ * into buf between calls, so the body can be any size.
+ *
+ * One difference: a boundary may be split between two buffers. When buf ends
+ * with what could be the start of one, HL_EAGAIN is returned with token.end
+ * short of the end of buf. Keep the bytes from token.end on and pass them
+ * again in front of the next data. There are fewer than
+ * HL_MULTIPART_MAX_BOUNDARY + 4 of them.
+ */
+hl_token hl_multipart_execute(hl_multipart* mp,
+                              const char* buf,
+                              size_t buflen);
+
+
+/* application/x-www-form-urlencoded bodies. The data of the HL_BODY tokens
+   of a request is fed in and broken up into tokens:
+
+   (HL_FIELD HL_VALUE)*
+   HL_EOF
+
+   HL_FIELD is a key and HL_VALUE its value, still encoded. A key without '='
+   gets an empty value.
+ */
+
+typedef struct {
+  /* private */
+  hl_token_kind last;
+  unsigned char state;
+  unsigned char esc; /* hl_form_decode(): digits of a split "%XX" so far */
+  unsigned char esc_value;
+} hl_form;
+
+void hl_form_init(hl_form* form);
+
+/* Works like hl_execute(). Data may be split anywhere; keys and values that
+ * run past the end of buf come back partial.
+ */
+hl_token hl_form_execute(hl_form* form, const char* buf, size_t buflen);
+
+/* Call when the body has ended (E.G. on HL_MSG_END) to complete the last
+ * key or value, which hl_form_execute() can't know is finished. Call it until
+ * it returns HL_EOF. The tokens it returns are empty.
+ */
+hl_token hl_form_end(hl_form* form);
+
+/* Decodes "%XX" and '+' in the data of an HL_FIELD or HL_VALUE token from
+ * hl_form_execute() into dst, which must have room for
+ * token.end - token.start bytes and may be token.start itself. A "%XX" split
+ * between partial tokens is completed on the next call. Returns the decoded
+ * length or -1 if the data contains a malformed "%XX".
+ */
+ssize_t hl_form_decode(hl_form* form, hl_token token, char* dst);
+
+
 /* If you are writing a web server, stop here. The rest is for writing http
  * clients; that is, parsing the responses from web servers.
  */
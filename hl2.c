@@ -0,0 +1,369 @@
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include "hl2.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+enum state {
+  S2_PREFACE,
+  S2_HEADER,
+  S2_PAD_LENGTH,
+  S2_PRIORITY,
+  S2_CONTENT, /* DATA, HEADERS, CONTINUATION and PING payloads */
+  S2_FIELDS, /* SETTINGS, WINDOW_UPDATE, RST_STREAM and GOAWAY payloads */
+  S2_SKIP, /* Padding, GOAWAY debug data and ignored frames */
+  S2_FRAME_END
+};
+
+#define DEFAULT_MAX_FRAME_SIZE 16384
+
+void hl2_req_init(hl2_lexer* lexer) {
+  hl2_res_init(lexer);
+  lexer->state = S2_PREFACE;
+  lexer->need_settings = 0;
+}
+
+void hl2_req_init_no_preface(hl2_lexer* lexer) {
+  /* Once past the preface, requests start like responses: with SETTINGS. */
+  hl2_res_init(lexer);
+}
+
+void hl2_res_init(hl2_lexer* lexer) {
+  lexer->last = HL2_EAGAIN;
+  lexer->state = S2_HEADER;
+  lexer->i = 0;
+  lexer->pad = 0;
+  lexer->need_settings = 1; /* The first frame must be SETTINGS. */
+  lexer->continuation = 0;
+  lexer->length = 0;
+  lexer->type = 0;
+  lexer->flags = 0;
+  lexer->stream_id = 0;
+  lexer->max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+}
+
+/* Decides where the payload goes once the fields before it are read. */
+static void payload_next(hl2_lexer* lexer) {
+  if (lexer->remaining > 0) {
+    lexer->state = S2_CONTENT;
+  } else if (lexer->pad > 0) {
+    lexer->remaining = lexer->pad;
+    lexer->pad = 0;
+    lexer->state = S2_SKIP;
+  } else {
+    lexer->state = S2_FRAME_END;
+  }
+}
+
+/* Loads the 9 byte frame header h, checks it against RFC 7540 section 6 and
+ * picks the state for the payload. Returns 0 or an error code.
+ */
+static int frame_start(hl2_lexer* lexer, const unsigned char* h) {
+  lexer->length = ((unsigned long)h[0] << 16) |
+                  ((unsigned long)h[1] << 8) | h[2];
+  lexer->type = h[3];
+  lexer->flags = h[4];
+  lexer->stream_id = ((unsigned long)(h[5] & 0x7f) << 24) |
+                     ((unsigned long)h[6] << 16) |
+                     ((unsigned long)h[7] << 8) | h[8];
+  lexer->remaining = lexer->length;
+  lexer->pad = 0;
+  lexer->i = 0;
+  lexer->acc = 0;
+  lexer->id = 0;
+
+  if (lexer->length > lexer->max_frame_size) return HL2_FRAME_SIZE_ERROR;
+
+  if (lexer->need_settings) {
+    if (lexer->type != HL2_FRAME_SETTINGS || lexer->flags & HL2_FLAG_ACK) {
+      return HL2_PROTOCOL_ERROR;
+    }
+    lexer->need_settings = 0;
+  }
+
+  /* Nothing may come between HEADERS and its CONTINUATIONs. */
+  if (lexer->continuation) {
+    if (lexer->type != HL2_FRAME_CONTINUATION ||
+        lexer->stream_id != lexer->continuation) {
+      return HL2_PROTOCOL_ERROR;
+    }
+  }
+
+  switch (lexer->type) {
+    case HL2_FRAME_DATA:
+    case HL2_FRAME_HEADERS: {
+      if (lexer->stream_id == 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->type == HL2_FRAME_HEADERS &&
+          !(lexer->flags & HL2_FLAG_END_HEADERS)) {
+        lexer->continuation = lexer->stream_id;
+      }
+      if (lexer->flags & HL2_FLAG_PADDED) {
+        if (lexer->length < 1) return HL2_FRAME_SIZE_ERROR;
+        lexer->state = S2_PAD_LENGTH;
+      } else if (lexer->type == HL2_FRAME_HEADERS &&
+                 lexer->flags & HL2_FLAG_PRIORITY) {
+        if (lexer->length < 5) return HL2_FRAME_SIZE_ERROR;
+        lexer->state = S2_PRIORITY;
+      } else {
+        payload_next(lexer);
+      }
+      return 0;
+    }
+
+    case HL2_FRAME_CONTINUATION: {
+      if (lexer->continuation == 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->flags & HL2_FLAG_END_HEADERS) lexer->continuation = 0;
+      payload_next(lexer);
+      return 0;
+    }
+
+    case HL2_FRAME_PRIORITY: {
+      if (lexer->stream_id == 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->length != 5) return HL2_FRAME_SIZE_ERROR;
+      lexer->state = S2_SKIP;
+      return 0;
+    }
+
+    case HL2_FRAME_RST_STREAM: {
+      if (lexer->stream_id == 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->length != 4) return HL2_FRAME_SIZE_ERROR;
+      lexer->state = S2_FIELDS;
+      return 0;
+    }
+
+    case HL2_FRAME_SETTINGS: {
+      if (lexer->stream_id != 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->flags & HL2_FLAG_ACK && lexer->length != 0) {
+        return HL2_FRAME_SIZE_ERROR;
+      }
+      if (lexer->length % 6 != 0) return HL2_FRAME_SIZE_ERROR;
+      lexer->state = lexer->length ? S2_FIELDS : S2_FRAME_END;
+      return 0;
+    }
+
+    case HL2_FRAME_PUSH_PROMISE: {
+      /* Clients must turn push off with SETTINGS_ENABLE_PUSH = 0; servers
+       * never receive it.
+       */
+      return HL2_PROTOCOL_ERROR;
+    }
+
+    case HL2_FRAME_PING: {
+      if (lexer->stream_id != 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->length != 8) return HL2_FRAME_SIZE_ERROR;
+      lexer->state = S2_CONTENT;
+      return 0;
+    }
+
+    case HL2_FRAME_GOAWAY: {
+      if (lexer->stream_id != 0) return HL2_PROTOCOL_ERROR;
+      if (lexer->length < 8) return HL2_FRAME_SIZE_ERROR;
+      lexer->state = S2_FIELDS;
+      return 0;
+    }
+
+    case HL2_FRAME_WINDOW_UPDATE: {
+      if (lexer->length != 4) return HL2_FRAME_SIZE_ERROR;
+      lexer->state = S2_FIELDS;
+      return 0;
+    }
+
+    default: {
+      /* Unknown frame types must be ignored. */
+      lexer->state = lexer->length ? S2_SKIP : S2_FRAME_END;
+      return 0;
+    }
+  }
+}
+
+hl2_token hl2_execute(hl2_lexer* lexer, const char* data, size_t len) {
+  hl2_token token; /* returned token */
+  const char* head = data; /* lexer head */
+  const char* end = data + len;
+  unsigned char c;
+  size_t to_read;
+  int err;
+
+  token.kind = lexer->last;
+  token.start = lexer->last == HL2_EAGAIN ? NULL : data;
+  token.end = NULL;
+  token.partial = 0;
+  token.id = 0;
+  token.value = 0;
+
+  for (; head < end || lexer->state == S2_FRAME_END; head++) {
+    switch (lexer->state) {
+      default: assert(0);
+
+      case S2_PREFACE: {
+        if (*head != HL2_PREFACE_STR[lexer->i]) {
+          err = HL2_PROTOCOL_ERROR;
+          goto error;
+        }
+        if (++lexer->i == HL2_PREFACE_LEN) {
+          lexer->i = 0;
+          lexer->need_settings = 1;
+          lexer->state = S2_HEADER;
+          token.kind = HL2_PREFACE;
+          token.start = token.end = head + 1;
+          goto token_complete;
+        }
+        break;
+      }
+
+      case S2_HEADER: {
+        if (lexer->i == 0 && end - head >= 9) {
+          /* The whole header is here; no need to copy it. */
+          err = frame_start(lexer, (const unsigned char*)head);
+          head += 8;
+        } else {
+          lexer->header[lexer->i++] = *head;
+          if (lexer->i < 9) break;
+          err = frame_start(lexer, (const unsigned char*)lexer->header);
+        }
+        if (err) goto error;
+
+        token.kind = HL2_FRAME_START;
+        token.start = token.end = head + 1;
+        goto token_complete;
+      }
+
+      case S2_PAD_LENGTH: {
+        lexer->pad = (unsigned char)*head;
+        lexer->remaining--;
+        if (lexer->pad > lexer->remaining) {
+          err = HL2_PROTOCOL_ERROR;
+          goto error;
+        }
+        lexer->remaining -= lexer->pad;
+
+        if (lexer->type == HL2_FRAME_HEADERS &&
+            lexer->flags & HL2_FLAG_PRIORITY) {
+          if (lexer->remaining < 5) {
+            err = HL2_FRAME_SIZE_ERROR;
+            goto error;
+          }
+          lexer->state = S2_PRIORITY;
+        } else {
+          payload_next(lexer);
+        }
+        break;
+      }
+
+      case S2_PRIORITY: {
+        /* Stream dependency and weight are ignored. */
+        lexer->remaining--;
+        if (++lexer->i == 5) {
+          lexer->i = 0;
+          payload_next(lexer);
+        }
+        break;
+      }
+
+      case S2_CONTENT: {
+        switch (lexer->type) {
+          case HL2_FRAME_DATA: token.kind = HL2_DATA; break;
+          case HL2_FRAME_PING: token.kind = HL2_PING; break;
+          default: token.kind = HL2_HEADER_BLOCK; break;
+        }
+        token.start = head;
+        to_read = MIN((size_t)(end - head), lexer->remaining);
+        lexer->remaining -= to_read;
+        head += to_read;
+
+        if (lexer->remaining == 0) {
+          token.end = head;
+          payload_next(lexer);
+          goto token_complete;
+        }
+        head--; /* Undo the loop's head++. */
+        break;
+      }
+
+      case S2_FIELDS: {
+        /* Fixed-size fields, big-endian. SETTINGS has a 2 byte id before
+         * each value, GOAWAY a 4 byte last stream id before the error code.
+         */
+        c = (unsigned char)*head;
+        if ((lexer->type == HL2_FRAME_SETTINGS && lexer->i < 2) ||
+            (lexer->type == HL2_FRAME_GOAWAY && lexer->i < 4)) {
+          lexer->id = (lexer->id << 8) | c;
+        } else {
+          lexer->acc = (lexer->acc << 8) | c;
+        }
+        lexer->remaining--;
+        lexer->i++;
+
+        if (lexer->type == HL2_FRAME_SETTINGS) {
+          if (lexer->i < 6) break;
+          token.kind = HL2_SETTING;
+        } else if (lexer->type == HL2_FRAME_GOAWAY) {
+          if (lexer->i < 8) break;
+          token.kind = HL2_GOAWAY;
+          lexer->id &= 0x7fffffff;
+        } else {
+          if (lexer->i < 4) break;
+          token.kind = lexer->type == HL2_FRAME_RST_STREAM ?
+                       HL2_RST_STREAM : HL2_WINDOW_UPDATE;
+          if (lexer->type == HL2_FRAME_WINDOW_UPDATE) {
+            lexer->acc &= 0x7fffffff;
+          }
+        }
+
+        token.id = lexer->id;
+        token.value = lexer->acc;
+        token.start = token.end = head + 1;
+        lexer->i = 0;
+        lexer->id = 0;
+        lexer->acc = 0;
+        if (lexer->remaining == 0) {
+          lexer->state = S2_FRAME_END;
+        } else if (lexer->type != HL2_FRAME_SETTINGS) {
+          lexer->state = S2_SKIP; /* GOAWAY debug data */
+        }
+        goto token_complete;
+      }
+
+      case S2_SKIP: {
+        to_read = MIN((size_t)(end - head), lexer->remaining);
+        lexer->remaining -= to_read;
+        head += to_read - 1;
+        if (lexer->remaining == 0) {
+          payload_next(lexer);
+        }
+        break;
+      }
+
+      case S2_FRAME_END: {
+        token.kind = HL2_FRAME_END;
+        token.start = token.end = head;
+        lexer->state = S2_HEADER;
+        goto token_complete;
+      }
+    }
+  }
+
+  token.end = head;
+  token.partial = token.kind != HL2_EAGAIN;
+  lexer->last = token.kind;
+  goto frame;
+
+token_complete:
+  assert(token.partial == 0);
+  assert(token.end);
+  lexer->last = HL2_EAGAIN;
+  goto frame;
+
+error:
+  token.kind = HL2_ERROR;
+  token.start = NULL;
+  token.end = head;
+  token.value = err;
+
+frame:
+  token.type = lexer->type;
+  token.flags = lexer->flags;
+  token.stream_id = lexer->stream_id;
+  return token;
+}
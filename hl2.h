@@ -0,0 +1,152 @@
+/* hl2 = HTTP/2 Lexer
+ *
+ * The frame layer of HTTP/2 (RFC 7540) in the style of hl.h:
+ * - Connection preface.
+ * - Frame headers, with the checks of RFC 7540 section 6 and 4.2.
+ * - Padding and priority fields removed from DATA and HEADERS.
+ * - SETTINGS, WINDOW_UPDATE, RST_STREAM and GOAWAY fields decoded.
+ * - No syscalls, no allocations, no callbacks.
+ * - Resumable at any byte.
+ *
+ * Header blocks are returned as-is. Decoding them (HPACK) is a separate step.
+ * PRIORITY, PUSH_PROMISE and unknown frame types are skipped.
+ */
+
+#ifndef HL2_H
+#define HL2_H
+
+#include <sys/types.h>
+
+/* Every HTTP/2 connection is broken up into tokens:
+
+   HL2_PREFACE  (server side only)
+   (HL2_FRAME_START
+    (HL2_DATA* | HL2_HEADER_BLOCK* | HL2_SETTING* | HL2_WINDOW_UPDATE |
+     HL2_PING* | HL2_RST_STREAM | HL2_GOAWAY)
+    HL2_FRAME_END)*
+ */
+
+typedef enum {
+  HL2_EAGAIN, /* Needs more input; read the next packet. */
+  HL2_ERROR, /* Bad HTTP/2. Send GOAWAY with token.value and close. */
+
+  HL2_PREFACE, /* The client connection preface. */
+  HL2_FRAME_START, /* A frame header. See lexer->type, flags, length. */
+  HL2_DATA, /* DATA frame payload, without padding. */
+  HL2_HEADER_BLOCK, /* HEADERS or CONTINUATION fragment, without padding. */
+  HL2_SETTING, /* One SETTINGS parameter: token.id = token.value. */
+  HL2_WINDOW_UPDATE, /* token.value is the increment. */
+  HL2_PING, /* The 8 bytes of opaque data. */
+  HL2_RST_STREAM, /* token.value is the error code. */
+  HL2_GOAWAY, /* token.id is the last stream id, token.value the error code. */
+  HL2_FRAME_END
+} hl2_token_kind;
+
+/* Frame types. */
+enum {
+  HL2_FRAME_DATA = 0x0,
+  HL2_FRAME_HEADERS = 0x1,
+  HL2_FRAME_PRIORITY = 0x2,
+  HL2_FRAME_RST_STREAM = 0x3,
+  HL2_FRAME_SETTINGS = 0x4,
+  HL2_FRAME_PUSH_PROMISE = 0x5,
+  HL2_FRAME_PING = 0x6,
+  HL2_FRAME_GOAWAY = 0x7,
+  HL2_FRAME_WINDOW_UPDATE = 0x8,
+  HL2_FRAME_CONTINUATION = 0x9
+};
+
+/* Frame flags. */
+enum {
+  HL2_FLAG_ACK = 0x1, /* SETTINGS, PING */
+  HL2_FLAG_END_STREAM = 0x1, /* DATA, HEADERS */
+  HL2_FLAG_END_HEADERS = 0x4, /* HEADERS, CONTINUATION */
+  HL2_FLAG_PADDED = 0x8, /* DATA, HEADERS */
+  HL2_FLAG_PRIORITY = 0x20 /* HEADERS */
+};
+
+/* Error codes, RFC 7540 section 7. */
+enum {
+  HL2_NO_ERROR = 0x0,
+  HL2_PROTOCOL_ERROR = 0x1,
+  HL2_INTERNAL_ERROR = 0x2,
+  HL2_FLOW_CONTROL_ERROR = 0x3,
+  HL2_SETTINGS_TIMEOUT = 0x4,
+  HL2_STREAM_CLOSED = 0x5,
+  HL2_FRAME_SIZE_ERROR = 0x6,
+  HL2_REFUSED_STREAM = 0x7,
+  HL2_CANCEL = 0x8,
+  HL2_COMPRESSION_ERROR = 0x9,
+  HL2_CONNECT_ERROR = 0xa,
+  HL2_ENHANCE_YOUR_CALM = 0xb,
+  HL2_INADEQUATE_SECURITY = 0xc,
+  HL2_HTTP_1_1_REQUIRED = 0xd
+};
+
+#define HL2_PREFACE_STR "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HL2_PREFACE_LEN 24
+
+typedef struct {
+  hl2_token_kind kind;
+
+  /* As in hl_token. Points for HL2_PREFACE, HL2_FRAME_START, HL2_SETTING,
+   * HL2_WINDOW_UPDATE, HL2_RST_STREAM, HL2_GOAWAY and HL2_FRAME_END. Strings
+   * for HL2_DATA, HL2_HEADER_BLOCK and HL2_PING.
+   */
+  const char* start;
+  const char* end;
+  char partial;
+
+  /* The frame the token belongs to. */
+  unsigned char type;
+  unsigned char flags;
+  unsigned long stream_id;
+
+  unsigned long id;
+  unsigned long value;
+} hl2_token;
+
+typedef struct {
+  /* private */
+  hl2_token_kind last;
+  unsigned char state;
+  unsigned char i;
+  unsigned char pad;
+  char need_settings;
+  char header[9];
+  unsigned long acc;
+  unsigned long id;
+  unsigned long remaining;
+  unsigned long continuation; /* stream id expecting CONTINUATION, or 0 */
+
+  /* read-only. The current frame header. */
+  unsigned long length;
+  unsigned char type;
+  unsigned char flags;
+  unsigned long stream_id;
+
+  /* read-write. The SETTINGS_MAX_FRAME_SIZE we have advertised. Larger
+   * frames are an error. Defaults to 16384.
+   */
+  unsigned long max_frame_size;
+} hl2_lexer;
+
+/* Initializes a lexer for what clients send. Used in HTTP/2 servers. The
+ * stream must start with the connection preface.
+ */
+void hl2_req_init(hl2_lexer* lexer);
+
+/* Like hl2_req_init() for when hl_execute() has already read the preface and
+ * returned HL_UPGRADE with HL_UPGRADE_H2. Start at its token.end.
+ */
+void hl2_req_init_no_preface(hl2_lexer* lexer);
+
+/* Initializes a lexer for what servers send. Used in HTTP/2 clients. */
+void hl2_res_init(hl2_lexer* lexer);
+
+/* Works like hl_execute(): call it repeatedly with buf = token.end until
+ * HL2_EAGAIN or HL2_ERROR is returned.
+ */
+hl2_token hl2_execute(hl2_lexer* lexer, const char* buf, size_t buflen);
+
+#endif  /* HL2_H */
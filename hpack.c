@@ -0,0 +1,652 @@
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include "hpack.h"
+#include "hpack_huffman.h"
+
+#define ENTRY_OVERHEAD 32 /* RFC 7541 4.1 */
+
+#define LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+#define S(name, value, id) { name, sizeof(name) - 1, value, sizeof(value) - 1, id }
+
+static const struct {
+  const char* name;
+  size_t name_len;
+  const char* value;
+  size_t value_len;
+  unsigned char id;
+} static_table[HL_HPACK_STATIC_COUNT + 1] = {
+  S("", "", 0),
+  S(":authority", "", HL_HPACK_AUTHORITY),
+  S(":method", "GET", HL_HPACK_METHOD),
+  S(":method", "POST", HL_HPACK_METHOD),
+  S(":path", "/", HL_HPACK_PATH),
+  S(":path", "/index.html", HL_HPACK_PATH),
+  S(":scheme", "http", HL_HPACK_SCHEME),
+  S(":scheme", "https", HL_HPACK_SCHEME),
+  S(":status", "200", HL_HPACK_STATUS),
+  S(":status", "204", HL_HPACK_STATUS),
+  S(":status", "206", HL_HPACK_STATUS),
+  S(":status", "304", HL_HPACK_STATUS),
+  S(":status", "400", HL_HPACK_STATUS),
+  S(":status", "404", HL_HPACK_STATUS),
+  S(":status", "500", HL_HPACK_STATUS),
+  S("accept-charset", "", HL_HPACK_ACCEPT_CHARSET),
+  S("accept-encoding", "gzip, deflate", HL_HPACK_ACCEPT_ENCODING),
+  S("accept-language", "", HL_HPACK_ACCEPT_LANGUAGE),
+  S("accept-ranges", "", HL_HPACK_ACCEPT_RANGES),
+  S("accept", "", HL_HPACK_ACCEPT),
+  S("access-control-allow-origin", "", HL_HPACK_ACCESS_CONTROL_ALLOW_ORIGIN),
+  S("age", "", HL_HPACK_AGE),
+  S("allow", "", HL_HPACK_ALLOW),
+  S("authorization", "", HL_HPACK_AUTHORIZATION),
+  S("cache-control", "", HL_HPACK_CACHE_CONTROL),
+  S("content-disposition", "", HL_HPACK_CONTENT_DISPOSITION),
+  S("content-encoding", "", HL_HPACK_CONTENT_ENCODING),
+  S("content-language", "", HL_HPACK_CONTENT_LANGUAGE),
+  S("content-length", "", HL_HPACK_CONTENT_LENGTH),
+  S("content-location", "", HL_HPACK_CONTENT_LOCATION),
+  S("content-range", "", HL_HPACK_CONTENT_RANGE),
+  S("content-type", "", HL_HPACK_CONTENT_TYPE),
+  S("cookie", "", HL_HPACK_COOKIE),
+  S("date", "", HL_HPACK_DATE),
+  S("etag", "", HL_HPACK_ETAG),
+  S("expect", "", HL_HPACK_EXPECT),
+  S("expires", "", HL_HPACK_EXPIRES),
+  S("from", "", HL_HPACK_FROM),
+  S("host", "", HL_HPACK_HOST),
+  S("if-match", "", HL_HPACK_IF_MATCH),
+  S("if-modified-since", "", HL_HPACK_IF_MODIFIED_SINCE),
+  S("if-none-match", "", HL_HPACK_IF_NONE_MATCH),
+  S("if-range", "", HL_HPACK_IF_RANGE),
+  S("if-unmodified-since", "", HL_HPACK_IF_UNMODIFIED_SINCE),
+  S("last-modified", "", HL_HPACK_LAST_MODIFIED),
+  S("link", "", HL_HPACK_LINK),
+  S("location", "", HL_HPACK_LOCATION),
+  S("max-forwards", "", HL_HPACK_MAX_FORWARDS),
+  S("proxy-authenticate", "", HL_HPACK_PROXY_AUTHENTICATE),
+  S("proxy-authorization", "", HL_HPACK_PROXY_AUTHORIZATION),
+  S("range", "", HL_HPACK_RANGE),
+  S("referer", "", HL_HPACK_REFERER),
+  S("refresh", "", HL_HPACK_REFRESH),
+  S("retry-after", "", HL_HPACK_RETRY_AFTER),
+  S("server", "", HL_HPACK_SERVER),
+  S("set-cookie", "", HL_HPACK_SET_COOKIE),
+  S("strict-transport-security", "", HL_HPACK_STRICT_TRANSPORT_SECURITY),
+  S("transfer-encoding", "", HL_HPACK_TRANSFER_ENCODING),
+  S("user-agent", "", HL_HPACK_USER_AGENT),
+  S("vary", "", HL_HPACK_VARY),
+  S("via", "", HL_HPACK_VIA),
+  S("www-authenticate", "", HL_HPACK_WWW_AUTHENTICATE)
+};
+
+#undef S
+
+void hl_hpack_init(hl_hpack* hp, void* mem, size_t table_size) {
+  hp->slots = table_size / ENTRY_OVERHEAD + 1;
+  hp->entries = (hl_hpack_entry*)mem;
+  hp->ring = (char*)(hp->entries + hp->slots);
+  hp->first = 0;
+  hp->count = 0;
+  hp->wpos = 0;
+  hp->update_pending = 0;
+  hp->capacity = table_size;
+  hp->max_size = table_size;
+  hp->size = 0;
+}
+
+int hl_hpack_name_id(const char* name, size_t len) {
+  size_t i, j;
+
+  /* Skip repeated names; each id is the first index with its name. */
+  for (i = 1; i <= HL_HPACK_STATIC_COUNT; i++) {
+    if (static_table[i].id != i || static_table[i].name_len != len) continue;
+    for (j = 0; j < len; j++) {
+      if (LOWER(name[j]) != static_table[i].name[j]) break;
+    }
+    if (j == len) return (int)i;
+  }
+  return 0;
+}
+
+ssize_t hl_hpack_huff_decode(const char* src,
+                             size_t len,
+                             char* dst,
+                             size_t dstlen) {
+  const unsigned char* p = (const unsigned char*)src;
+  const unsigned char* end = p + len;
+  const huff_entry* e;
+  unsigned char state = 0;
+  int accept = 1;
+  size_t n = 0;
+
+  /* Symbols are at least 5 bits, so there is room for the whole output when
+   * dstlen > len * 8 / 5. Then each nibble stores its symbol, if any, without
+   * a branch or a bounds check.
+   */
+  if (dstlen > len + len / 2 + len / 8 + 1) {
+    for (; p < end; p++) {
+      e = &huff_decode[state][*p >> 4];
+      dst[n] = (char)e->sym;
+      n += (e->flags & HUFF_SYM) >> 1;
+      state = e->next;
+      if (e->flags & HUFF_FAIL) return -1;
+
+      e = &huff_decode[state][*p & 0xf];
+      dst[n] = (char)e->sym;
+      n += (e->flags & HUFF_SYM) >> 1;
+      state = e->next;
+      if (e->flags & HUFF_FAIL) return -1;
+      accept = e->flags & HUFF_ACCEPT;
+    }
+  } else {
+    for (; p < end; p++) {
+      e = &huff_decode[state][*p >> 4];
+      if (e->flags & HUFF_FAIL) return -1;
+      if (e->flags & HUFF_SYM) {
+        if (n == dstlen) return -1;
+        dst[n++] = (char)e->sym;
+      }
+      state = e->next;
+
+      e = &huff_decode[state][*p & 0xf];
+      if (e->flags & HUFF_FAIL) return -1;
+      if (e->flags & HUFF_SYM) {
+        if (n == dstlen) return -1;
+        dst[n++] = (char)e->sym;
+      }
+      state = e->next;
+      accept = e->flags & HUFF_ACCEPT;
+    }
+  }
+
+  /* The padding must be the first bits of EOS, less than a byte. */
+  if (!accept) return -1;
+  return (ssize_t)n;
+}
+
+/* Decodes an integer with an n bit prefix (RFC 7541 5.1). Values above
+ * 2^28 are refused; nothing legitimate is that large.
+ */
+static int decode_int(const unsigned char** pp,
+                      const unsigned char* end,
+                      int n,
+                      size_t* out) {
+  const unsigned char* p = *pp;
+  size_t mask = ((size_t)1 << n) - 1;
+  size_t v = *p++ & mask;
+  int shift = 0;
+
+  if (v == mask) {
+    do {
+      if (p == end || shift > 21) return -1;
+      v += (size_t)(*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+  }
+
+  *pp = p;
+  *out = v;
+  return 0;
+}
+
+/* Decodes a string literal (RFC 7541 5.2) into token. Plain strings point
+ * into the block, Huffman strings into buf.
+ */
+static int decode_string(const unsigned char** pp,
+                         const unsigned char* end,
+                         hl_token* token,
+                         char* buf,
+                         size_t buflen,
+                         size_t* used) {
+  const unsigned char* p = *pp;
+  int huffman;
+  size_t len;
+  ssize_t n;
+
+  if (p == end) return -1;
+  huffman = *p & 0x80;
+  if (decode_int(&p, end, 7, &len) || len > (size_t)(end - p)) return -1;
+
+  if (huffman) {
+    n = hl_hpack_huff_decode((const char*)p, len, buf + *used,
+                             buflen - *used);
+    if (n < 0) return -1;
+    token->start = buf + *used;
+    token->end = token->start + n;
+    *used += n;
+  } else {
+    token->start = (const char*)p;
+    token->end = token->start + len;
+  }
+
+  *pp = p + len;
+  return 0;
+}
+
+/* Returns the len bytes at off in the ring. They are copied into buf if they
+ * wrap around, or NULL is returned if buf has no room.
+ */
+static const char* ring_get(const hl_hpack* hp,
+                            size_t off,
+                            size_t len,
+                            char* buf,
+                            size_t buflen,
+                            size_t* used) {
+  size_t first;
+  char* dst;
+
+  off %= hp->capacity;
+  if (off + len <= hp->capacity) return hp->ring + off;
+
+  if (len > buflen - *used) return NULL;
+  dst = buf + *used;
+  first = hp->capacity - off;
+  memcpy(dst, hp->ring + off, first);
+  memcpy(dst + first, hp->ring, len - first);
+  *used += len;
+  return dst;
+}
+
+static void ring_put(hl_hpack* hp, const char* src, size_t len) {
+  size_t first = hp->capacity - hp->wpos;
+
+  if (len < first) {
+    memcpy(hp->ring + hp->wpos, src, len);
+    hp->wpos += len;
+  } else {
+    memcpy(hp->ring + hp->wpos, src, first);
+    memcpy(hp->ring, src + first, len - first);
+    hp->wpos = len - first;
+  }
+}
+
+/* Evicts the oldest entries until extra more bytes fit (RFC 7541 4.4). */
+static void evict(hl_hpack* hp, size_t extra) {
+  hl_hpack_entry* e;
+
+  while (hp->count > 0 && hp->size + extra > hp->max_size) {
+    e = &hp->entries[hp->first];
+    hp->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+    hp->first = (hp->first + 1) % hp->slots;
+    hp->count--;
+  }
+  if (hp->count == 0) hp->wpos = 0; /* Keep new entries contiguous. */
+}
+
+/* Adds the header in hdr to the dynamic table. Its strings must not point
+ * into the ring.
+ */
+static void insert(hl_hpack* hp, const hl_hpack_header* hdr) {
+  size_t name_len = hdr->field.end - hdr->field.start;
+  size_t value_len = hdr->value.end - hdr->value.start;
+  size_t size = name_len + value_len + ENTRY_OVERHEAD;
+  hl_hpack_entry* e;
+
+  evict(hp, size);
+  if (size > hp->max_size) return; /* Too big; the table is now empty. */
+
+  e = &hp->entries[(hp->first + hp->count) % hp->slots];
+  e->offset = hp->wpos;
+  e->name_len = name_len;
+  e->value_len = value_len;
+  e->name_id = hdr->name_id;
+  ring_put(hp, hdr->field.start, name_len);
+  ring_put(hp, hdr->value.start, value_len);
+  hp->count++;
+  hp->size += size;
+  assert(hp->count < hp->slots);
+}
+
+/* Looks up index in the static or dynamic table. The value is only fetched
+ * if with_value is set.
+ */
+static int lookup(hl_hpack* hp,
+                  size_t index,
+                  int with_value,
+                  hl_hpack_header* hdr,
+                  char* buf,
+                  size_t buflen,
+                  size_t* used) {
+  const hl_hpack_entry* e;
+
+  if (index == 0) return -1;
+
+  if (index <= HL_HPACK_STATIC_COUNT) {
+    hdr->field.start = static_table[index].name;
+    hdr->field.end = hdr->field.start + static_table[index].name_len;
+    hdr->value.start = static_table[index].value;
+    hdr->value.end = hdr->value.start + static_table[index].value_len;
+    hdr->name_id = static_table[index].id;
+    return 0;
+  }
+
+  /* Dynamic indexes count back from the newest entry. */
+  index -= HL_HPACK_STATIC_COUNT + 1;
+  if (index >= hp->count) return -1;
+  e = &hp->entries[(hp->first + hp->count - 1 - index) % hp->slots];
+
+  hdr->field.start = ring_get(hp, e->offset, e->name_len, buf, buflen, used);
+  if (!hdr->field.start) return -1;
+  hdr->field.end = hdr->field.start + e->name_len;
+  hdr->name_id = e->name_id;
+  if (with_value) {
+    hdr->value.start = ring_get(hp, e->offset + e->name_len, e->value_len,
+                                buf, buflen, used);
+    if (!hdr->value.start) return -1;
+    hdr->value.end = hdr->value.start + e->value_len;
+  }
+  return 0;
+}
+
+int hl_hpack_decode(hl_hpack* hp,
+                    hl_span* block,
+                    hl_hpack_header* hdr,
+                    char* buf,
+                    size_t buflen) {
+  const unsigned char* p = (const unsigned char*)block->start;
+  const unsigned char* end = (const unsigned char*)block->end;
+  size_t index, used = 0, len;
+  int indexing;
+  char* copy;
+
+  for (;;) {
+    if (p == end) return 0;
+
+    if (*p & 0x80) {
+      /* Indexed header field. */
+      if (decode_int(&p, end, 7, &index)) return -1;
+      if (lookup(hp, index, 1, hdr, buf, buflen, &used)) return -1;
+      hdr->sensitive = 0;
+      break;
+    }
+
+    if ((*p & 0xe0) == 0x20) {
+      /* Dynamic table size update. */
+      if (decode_int(&p, end, 5, &index)) return -1;
+      if (index > hp->capacity) return -1;
+      hp->max_size = index;
+      evict(hp, 0);
+      continue;
+    }
+
+    /* Literal header field: with incremental indexing (01), never indexed
+     * (0001) or without indexing (0000).
+     */
+    indexing = (*p & 0xc0) == 0x40;
+    hdr->sensitive = (*p & 0xf0) == 0x10;
+    if (decode_int(&p, end, indexing ? 6 : 4, &index)) return -1;
+
+    if (index) {
+      if (lookup(hp, index, 0, hdr, buf, buflen, &used)) return -1;
+      if (indexing && index > HL_HPACK_STATIC_COUNT &&
+          hdr->field.start >= hp->ring &&
+          hdr->field.start < hp->ring + hp->capacity) {
+        /* Inserting may evict the entry the name comes from. */
+        len = hdr->field.end - hdr->field.start;
+        if (len > buflen - used) return -1;
+        copy = buf + used;
+        memcpy(copy, hdr->field.start, len);
+        used += len;
+        hdr->field.start = copy;
+        hdr->field.end = copy + len;
+      }
+    } else {
+      if (decode_string(&p, end, &hdr->field, buf, buflen, &used)) return -1;
+      hdr->name_id = hl_hpack_name_id(hdr->field.start,
+                                      hdr->field.end - hdr->field.start);
+    }
+    if (decode_string(&p, end, &hdr->value, buf, buflen, &used)) return -1;
+
+    if (indexing) insert(hp, hdr);
+    break;
+  }
+
+  hdr->field.kind = HL_FIELD;
+  hdr->field.partial = 0;
+  hdr->value.kind = HL_VALUE;
+  hdr->value.partial = 0;
+  block->start = (const char*)p;
+  return 1;
+}
+
+size_t hl_hpack_huff_len(const char* src, size_t len) {
+  const unsigned char* p = (const unsigned char*)src;
+  size_t bits = 0;
+
+  for (; len > 0; p++, len--) bits += huff_len[*p];
+  return (bits + 7) / 8;
+}
+
+size_t hl_hpack_huff_encode(const char* src, size_t len, char* dst) {
+  const unsigned char* p = (const unsigned char*)src;
+  unsigned long acc = 0; /* at most 7 + 24 bits are pending */
+  int bits = 0, n;
+  size_t out = 0;
+
+  for (; len > 0; p++, len--) {
+    n = huff_len[*p];
+    if (n > 24) {
+      /* Codes are up to 30 bits; split them so acc fits in 32 bits. */
+      acc = (acc << (n - 16)) | (huff_code[*p] >> 16);
+      bits += n - 16;
+      while (bits >= 8) dst[out++] = (char)(acc >> (bits -= 8));
+      n = 16;
+    }
+    acc = (acc << n) | (huff_code[*p] & ((1UL << n) - 1));
+    bits += n;
+    while (bits >= 8) dst[out++] = (char)(acc >> (bits -= 8));
+  }
+
+  /* Pad with the first bits of EOS, which are all 1s. */
+  if (bits > 0) dst[out++] = (char)((acc << (8 - bits)) | (0xff >> bits));
+  return out;
+}
+
+/* Encodes v with an n bit prefix after the bits in first. Returns the end of
+ * the integer or NULL if it doesn't fit before end.
+ */
+static char* encode_int(char* p, char* end, size_t v, int n, int first) {
+  size_t mask = ((size_t)1 << n) - 1;
+
+  if (p == end) return NULL;
+  if (v < mask) {
+    *p++ = (char)(first | v);
+    return p;
+  }
+  *p++ = (char)(first | mask);
+  v -= mask;
+  for (; v >= 0x80; v >>= 7) {
+    if (p == end) return NULL;
+    *p++ = (char)(0x80 | (v & 0x7f));
+  }
+  if (p == end) return NULL;
+  *p++ = (char)v;
+  return p;
+}
+
+static char* encode_string(char* p,
+                           char* end,
+                           const char* s,
+                           size_t len,
+                           int flags) {
+  size_t huff = flags & HL_HPACK_NO_HUFFMAN ? len : hl_hpack_huff_len(s, len);
+
+  if (huff < len) {
+    p = encode_int(p, end, huff, 7, 0x80);
+    if (!p || (size_t)(end - p) < huff) return NULL;
+    return p + hl_hpack_huff_encode(s, len, p);
+  }
+  p = encode_int(p, end, len, 7, 0);
+  if (!p || (size_t)(end - p) < len) return NULL;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+/* Compares the len bytes at off in the ring with s. */
+static int ring_eq(const hl_hpack* hp, size_t off, const char* s, size_t len) {
+  size_t first;
+
+  off %= hp->capacity;
+  first = hp->capacity - off;
+  if (len <= first) return memcmp(hp->ring + off, s, len) == 0;
+  return memcmp(hp->ring + off, s, first) == 0 &&
+         memcmp(hp->ring, s + first, len - first) == 0;
+}
+
+/* Searches the dynamic table, newest first, for the header. Returns the
+ * index of an entry with the same name and value, or else minus the index of
+ * one with the same name, or else 0.
+ */
+static long find_dynamic(const hl_hpack* hp,
+                         int name_id,
+                         const char* name,
+                         size_t name_len,
+                         const char* value,
+                         size_t value_len) {
+  const hl_hpack_entry* e;
+  long name_index = 0;
+  size_t i;
+
+  for (i = 0; i < hp->count; i++) {
+    e = &hp->entries[(hp->first + hp->count - 1 - i) % hp->slots];
+    if (name_id ? e->name_id != name_id :
+        e->name_len != name_len || !ring_eq(hp, e->offset, name, name_len)) {
+      continue;
+    }
+    if (e->value_len == value_len &&
+        ring_eq(hp, e->offset + e->name_len, value, value_len)) {
+      return (long)(HL_HPACK_STATIC_COUNT + 1 + i);
+    }
+    if (!name_index) name_index = -(long)(HL_HPACK_STATIC_COUNT + 1 + i);
+  }
+  return name_index;
+}
+
+/* The indexing policy when no flag is given. */
+static int default_flags(int name_id) {
+  switch (name_id) {
+    case HL_HPACK_SERVER:
+    case HL_HPACK_CONTENT_TYPE:
+    case HL_HPACK_CACHE_CONTROL:
+    case HL_HPACK_CONTENT_ENCODING:
+    case HL_HPACK_VARY:
+    case HL_HPACK_ACCESS_CONTROL_ALLOW_ORIGIN:
+    case HL_HPACK_STRICT_TRANSPORT_SECURITY:
+      return HL_HPACK_INDEX;
+    case HL_HPACK_SET_COOKIE:
+    case HL_HPACK_AUTHORIZATION:
+    case HL_HPACK_PROXY_AUTHORIZATION:
+      return HL_HPACK_NEVER_INDEX;
+    default:
+      return HL_HPACK_NO_INDEX;
+  }
+}
+
+static ssize_t encode(hl_hpack* hp,
+                      char* dst,
+                      size_t dstlen,
+                      int name_id,
+                      const char* name,
+                      size_t name_len,
+                      const char* value,
+                      size_t value_len,
+                      int flags) {
+  char* p = dst;
+  char* end = dst + dstlen;
+  long index = 0;
+  int indexing;
+  hl_hpack_header hdr;
+  size_t i;
+
+  if (hp->update_pending) {
+    p = encode_int(p, end, hp->max_size, 5, 0x20);
+    if (!p) return -1;
+  }
+
+  /* A static entry with this value, E.G. ":status: 200". */
+  if (name_id) {
+    for (i = name_id; i <= HL_HPACK_STATIC_COUNT &&
+                      static_table[i].id == name_id; i++) {
+      if (static_table[i].value_len == value_len &&
+          (value_len == 0 ||
+           memcmp(static_table[i].value, value, value_len) == 0)) {
+        index = (long)i;
+        break;
+      }
+    }
+  }
+  if (!index && hp->count > 0) {
+    index = find_dynamic(hp, name_id, name, name_len, value, value_len);
+  }
+
+  if (index > 0) {
+    p = encode_int(p, end, index, 7, 0x80);
+    if (!p) return -1;
+    hp->update_pending = 0;
+    return p - dst;
+  }
+
+  /* Literal value with an indexed name if there is one. */
+  index = index < 0 ? -index : name_id;
+  if (!(flags & (HL_HPACK_INDEX | HL_HPACK_NO_INDEX | HL_HPACK_NEVER_INDEX))) {
+    flags |= default_flags(name_id);
+  }
+  indexing = 0;
+  if (flags & HL_HPACK_NEVER_INDEX) {
+    p = encode_int(p, end, index, 4, 0x10);
+  } else if (flags & HL_HPACK_NO_INDEX) {
+    p = encode_int(p, end, index, 4, 0x00);
+  } else {
+    p = encode_int(p, end, index, 6, 0x40);
+    indexing = 1;
+  }
+  if (p && !index) p = encode_string(p, end, name, name_len, flags);
+  if (p) p = encode_string(p, end, value, value_len, flags);
+  if (!p) return -1;
+
+  if (indexing) {
+    hdr.field.start = name;
+    hdr.field.end = name + name_len;
+    hdr.value.start = value;
+    hdr.value.end = value + value_len;
+    hdr.name_id = (unsigned char)name_id;
+    insert(hp, &hdr);
+  }
+  hp->update_pending = 0;
+  return p - dst;
+}
+
+ssize_t hl_hpack_encode(hl_hpack* hp,
+                        char* dst,
+                        size_t dstlen,
+                        const char* name,
+                        size_t name_len,
+                        const char* value,
+                        size_t value_len,
+                        int flags) {
+  return encode(hp, dst, dstlen, hl_hpack_name_id(name, name_len),
+                name, name_len, value, value_len, flags);
+}
+
+ssize_t hl_hpack_encode_id(hl_hpack* hp,
+                           char* dst,
+                           size_t dstlen,
+                           int name_id,
+                           const char* value,
+                           size_t value_len,
+                           int flags) {
+  assert(name_id > 0 && name_id <= HL_HPACK_STATIC_COUNT);
+  assert(static_table[name_id].id == name_id);
+  return encode(hp, dst, dstlen, name_id, static_table[name_id].name,
+                static_table[name_id].name_len, value, value_len, flags);
+}
+
+void hl_hpack_set_max_size(hl_hpack* hp, size_t size) {
+  if (size > hp->capacity) size = hp->capacity;
+  if (size == hp->max_size) return;
+  hp->max_size = size;
+  evict(hp, 0);
+  hp->update_pending = 1;
+}
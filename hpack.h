@@ -0,0 +1,232 @@
+/* HPACK header compression (RFC 7541) for HTTP/2.
+ *
+ * - Decodes the header blocks returned by hl2_execute() into HL_FIELD and
+ *   HL_VALUE tokens, the same tokens hl_execute() gives for HTTP/1.
+ * - Encodes response headers, reusing the static table and, for headers
+ *   that repeat from response to response, the dynamic table.
+ * - The dynamic table lives in memory you provide. It never grows.
+ * - Names in the static table are reported as HL_HPACK_* ids, so there is
+ *   no need to compare strings for common headers.
+ * - Huffman strings are decoded 4 bits at a time with a state table.
+ * - No syscalls, no allocations, no callbacks.
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <sys/types.h>
+#include "hl.h"
+
+/* Ids of the header names in the static table (RFC 7541 Appendix A). Each is
+ * the first static table index with that name.
+ */
+enum {
+  HL_HPACK_AUTHORITY = 1,
+  HL_HPACK_METHOD = 2,
+  HL_HPACK_PATH = 4,
+  HL_HPACK_SCHEME = 6,
+  HL_HPACK_STATUS = 8,
+  HL_HPACK_ACCEPT_CHARSET = 15,
+  HL_HPACK_ACCEPT_ENCODING = 16,
+  HL_HPACK_ACCEPT_LANGUAGE = 17,
+  HL_HPACK_ACCEPT_RANGES = 18,
+  HL_HPACK_ACCEPT = 19,
+  HL_HPACK_ACCESS_CONTROL_ALLOW_ORIGIN = 20,
+  HL_HPACK_AGE = 21,
+  HL_HPACK_ALLOW = 22,
+  HL_HPACK_AUTHORIZATION = 23,
+  HL_HPACK_CACHE_CONTROL = 24,
+  HL_HPACK_CONTENT_DISPOSITION = 25,
+  HL_HPACK_CONTENT_ENCODING = 26,
+  HL_HPACK_CONTENT_LANGUAGE = 27,
+  HL_HPACK_CONTENT_LENGTH = 28,
+  HL_HPACK_CONTENT_LOCATION = 29,
+  HL_HPACK_CONTENT_RANGE = 30,
+  HL_HPACK_CONTENT_TYPE = 31,
+  HL_HPACK_COOKIE = 32,
+  HL_HPACK_DATE = 33,
+  HL_HPACK_ETAG = 34,
+  HL_HPACK_EXPECT = 35,
+  HL_HPACK_EXPIRES = 36,
+  HL_HPACK_FROM = 37,
+  HL_HPACK_HOST = 38,
+  HL_HPACK_IF_MATCH = 39,
+  HL_HPACK_IF_MODIFIED_SINCE = 40,
+  HL_HPACK_IF_NONE_MATCH = 41,
+  HL_HPACK_IF_RANGE = 42,
+  HL_HPACK_IF_UNMODIFIED_SINCE = 43,
+  HL_HPACK_LAST_MODIFIED = 44,
+  HL_HPACK_LINK = 45,
+  HL_HPACK_LOCATION = 46,
+  HL_HPACK_MAX_FORWARDS = 47,
+  HL_HPACK_PROXY_AUTHENTICATE = 48,
+  HL_HPACK_PROXY_AUTHORIZATION = 49,
+  HL_HPACK_RANGE = 50,
+  HL_HPACK_REFERER = 51,
+  HL_HPACK_REFRESH = 52,
+  HL_HPACK_RETRY_AFTER = 53,
+  HL_HPACK_SERVER = 54,
+  HL_HPACK_SET_COOKIE = 55,
+  HL_HPACK_STRICT_TRANSPORT_SECURITY = 56,
+  HL_HPACK_TRANSFER_ENCODING = 57,
+  HL_HPACK_USER_AGENT = 58,
+  HL_HPACK_VARY = 59,
+  HL_HPACK_VIA = 60,
+  HL_HPACK_WWW_AUTHENTICATE = 61
+};
+
+#define HL_HPACK_STATIC_COUNT 61
+
+typedef struct {
+  hl_token field; /* kind HL_FIELD, never partial */
+  hl_token value; /* kind HL_VALUE, never partial */
+
+  /* HL_HPACK_* id of the name, or 0 if the name is not in the static
+   * table.
+   */
+  unsigned char name_id;
+
+  /* Non-zero for "never indexed" fields (RFC 7541 6.2.3). A proxy must
+   * forward them the same way.
+   */
+  char sensitive;
+} hl_hpack_header;
+
+typedef struct {
+  /* private */
+  size_t offset; /* of the name in the ring; the value follows */
+  size_t name_len;
+  size_t value_len;
+  unsigned char name_id;
+} hl_hpack_entry;
+
+typedef struct {
+  /* private */
+  hl_hpack_entry* entries; /* ring of entry slots, oldest at first */
+  size_t slots;
+  size_t first;
+  size_t count;
+  char* ring; /* ring of name and value bytes */
+  size_t wpos;
+  char update_pending; /* encoder: a size update must be sent */
+
+  /* read-only */
+  size_t capacity; /* table_size of hl_hpack_init() */
+  size_t max_size; /* current limit, <= capacity */
+  size_t size; /* current size, as defined in RFC 7541 4.1 */
+} hl_hpack;
+
+/* Bytes of memory hl_hpack_init() needs for a table of table_size. */
+#define HL_HPACK_MEM_SIZE(table_size) \
+  ((table_size) + ((table_size) / 32 + 1) * sizeof(hl_hpack_entry))
+
+/* Initializes a decoder or encoder whose dynamic table holds table_size
+ * bytes. mem must be HL_HPACK_MEM_SIZE(table_size) bytes, aligned like
+ * malloc(3) memory, and outlive it. One of each per connection.
+ *
+ * For a decoder, table_size is the SETTINGS_HEADER_TABLE_SIZE we advertise
+ * (4096 by default). For an encoder it can be anything up to the one the
+ * peer advertises; a smaller table just compresses less.
+ */
+void hl_hpack_init(hl_hpack* hp, void* mem, size_t table_size);
+
+/* Decodes the next header of a header block. block is the whole block:
+ * the data of the HL2_HEADER_BLOCK tokens of a HEADERS frame and its
+ * CONTINUATIONs, joined. Each call consumes one header from the front of
+ * block and stores it in hdr. Blocks must be decoded in the order they were
+ * received, and completely, since they change the dynamic table.
+ *
+ * The data of hdr points into block, the static table, the dynamic table or
+ * buf, and stays valid until the next call. buf holds Huffman-decoded
+ * strings and table entries that wrap around the ring. Twice the length of
+ * the block plus the table size is always enough.
+ *
+ * Returns 1 if a header was stored, 0 when block is exhausted, or -1 on a
+ * decoding error or if buf is too small. After -1 the decoder is unusable;
+ * send GOAWAY with HL2_COMPRESSION_ERROR.
+ *
+ *   hl_span block = { data, data + len };
+ *   hl_hpack_header hdr;
+ *   while ((r = hl_hpack_decode(&hp, &block, &hdr, buf, sizeof(buf))) > 0) {
+ *     ...
+ *   }
+ */
+int hl_hpack_decode(hl_hpack* hp,
+                    hl_span* block,
+                    hl_hpack_header* hdr,
+                    char* buf,
+                    size_t buflen);
+
+/* Flags for hl_hpack_encode(). By default the dynamic table is used for
+ * headers that usually repeat on a connection: server, content-type,
+ * cache-control, content-encoding, vary, access-control-allow-origin and
+ * strict-transport-security. set-cookie, authorization and
+ * proxy-authorization are never indexed.
+ */
+enum {
+  HL_HPACK_INDEX = 0x01, /* Add the header to the dynamic table. */
+  HL_HPACK_NO_INDEX = 0x02, /* Don't. */
+  HL_HPACK_NEVER_INDEX = 0x04, /* Don't, and tell proxies not to either. */
+  HL_HPACK_NO_HUFFMAN = 0x08 /* Send strings as-is even when longer. */
+};
+
+/* Encodes one header into dst and returns the number of bytes written, or
+ * -1 if dst is too small, in which case nothing changes. The headers of a
+ * block are encoded one after another into the same buffer, and blocks must
+ * be sent in the order they were encoded.
+ *
+ * name must be lowercase, as HTTP/2 requires. A header matching a static or
+ * dynamic table entry usually takes one byte. Otherwise each string is Huffman
+ * coded if that makes it shorter.
+ */
+ssize_t hl_hpack_encode(hl_hpack* hp,
+                        char* dst,
+                        size_t dstlen,
+                        const char* name,
+                        size_t name_len,
+                        const char* value,
+                        size_t value_len,
+                        int flags);
+
+/* Like hl_hpack_encode() for a name from the static table, E.G.
+ * HL_HPACK_CONTENT_TYPE. Saves looking the name up.
+ */
+ssize_t hl_hpack_encode_id(hl_hpack* hp,
+                           char* dst,
+                           size_t dstlen,
+                           int name_id,
+                           const char* value,
+                           size_t value_len,
+                           int flags);
+
+/* Call when the peer's SETTINGS_HEADER_TABLE_SIZE changes. The table of an
+ * encoder shrinks to size if it is smaller than the table, and the change is
+ * sent at the start of the next header encoded, which must be the first of a
+ * block.
+ */
+void hl_hpack_set_max_size(hl_hpack* hp, size_t size);
+
+/* Returns the HL_HPACK_* id of a header name, or 0 if it is not in the
+ * static table. Case-insensitive, so it works on the HL_FIELD tokens of
+ * HTTP/1 too.
+ */
+int hl_hpack_name_id(const char* name, size_t len);
+
+/* Decodes the Huffman-coded string src into dst. Returns the decoded length
+ * or -1 if src is not valid (RFC 7541 5.2) or dst is too small. The result
+ * is at most len * 8 / 5 bytes.
+ */
+ssize_t hl_hpack_huff_decode(const char* src,
+                             size_t len,
+                             char* dst,
+                             size_t dstlen);
+
+/* Returns the Huffman-coded length of src in bytes. */
+size_t hl_hpack_huff_len(const char* src, size_t len);
+
+/* Huffman-codes src into dst, which must have room for
+ * hl_hpack_huff_len(src, len) bytes. Returns that length.
+ */
+size_t hl_hpack_huff_encode(const char* src, size_t len, char* dst);
+
+#endif  /* HPACK_H */
@@ -4,8 +4,15 @@
 #include <stdlib.h>
 
 #include "hl.h"
+#include "hl2.h"
+#include "hpack.h"
+#include "ws.h"
+#include "cache.h"
+#include "timer.h"
 #include "test_data.h"
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 void expect_eq(const char* expected, hl_token token) {
   int len = token.end - token.start;
   int expected_len = strlen(expected);
@@ -21,6 +28,32 @@ void expect_eq(const char* expected, hl_token token) {
   }
 }
 
+void expect_span_eq(const char* expected, hl_span span) {
+  hl_token token;
+
+  /* Absent spans are {NULL, NULL}; don't hand NULL to strncmp(). */
+  if (span.start == span.end && expected[0] == '\0') return;
+  token.start = span.start;
+  token.end = span.end;
+  expect_eq(expected, token);
+}
+
+
+/* HL_METHOD_* of name, for checking lexer->method. */
+int method_id(const char* name) {
+  static const char* const names[] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE",
+    "PATCH", "COPY", "LOCK", "MKCOL", "MOVE", "PROPFIND", "PROPPATCH",
+    "SEARCH", "UNLOCK", "REPORT", "MKACTIVITY", "CHECKOUT", "MERGE",
+    "M-SEARCH", "NOTIFY", "SUBSCRIBE", "UNSUBSCRIBE", "PURGE", "PRI"
+  };
+  int i;
+
+  for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    if (strcmp(names[i], name) == 0) return HL_METHOD_GET + i;
+  }
+  return HL_METHOD_OTHER;
+}
 
 void test_req(const struct message* req) {
   hl_lexer lexer;
@@ -30,7 +63,7 @@ void test_req(const struct message* req) {
   int len = raw_len;
   int num_headers = 0;
   int body_len = strlen(req->body);
-  char* body = malloc(body_len);
+  char* body = malloc(body_len + 1);
   int body_read = 0;
   int chunk_len;
 
@@ -46,6 +79,7 @@ void test_req(const struct message* req) {
   assert(token.kind == HL_METHOD);
   assert(token.partial == 0);
   expect_eq(req->method, token);
+  assert(lexer.method == method_id(req->method));
 
   len -= token.end - buf;
   buf = token.end;
@@ -144,6 +178,7 @@ void test_req(const struct message* req) {
   assert(num_headers == req->num_headers);
 
   assert(body_len == body_read);
+  body[body_read] = '\0';
   assert(strcmp(body, req->body) == 0);
   printf("bodys match. body_len = %d\n", body_len);
 
@@ -158,7 +193,9 @@ void test_req(const struct message* req) {
   buf = token.end;
   token = hl_execute(&lexer, buf, len);
   if (req->upgrade) {
-    assert(token.kind == HL_EOF);
+    /* CONNECT tunnels end HTTP without an Upgrade header. */
+    assert(token.kind ==
+           (strcmp(req->method, "CONNECT") == 0 ? HL_EOF : HL_UPGRADE));
     token.end = buf + len;
     expect_eq(req->upgrade, token);
   } else if (req->should_keep_alive) {
@@ -221,6 +258,70 @@ void test_pipeline(const struct message* req1,
 }
 
 
+/* A body cut off by the end of the buffer is a partial HL_BODY token that
+ * ends there, and the rest of it comes from where that token ended.
+ */
+void manual_test_body_split() {
+  static const char* const raws[] = {
+    "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "a\r\n0123456789\r\n0\r\n\r\n"
+  };
+  hl_lexer lexer;
+  hl_token token;
+  const char* raw;
+  const char* body;
+  int i;
+
+  for (i = 0; i < (int)(sizeof(raws) / sizeof(raws[0])); i++) {
+    raw = raws[i];
+    body = strstr(raw, "0123456789");
+    hl_req_init(&lexer);
+
+    /* The buffer ends 4 bytes into the body. */
+    token.end = raw;
+    do {
+      token = hl_execute(&lexer, token.end, body + 4 - token.end);
+      assert(token.kind != HL_ERROR && token.kind != HL_EAGAIN);
+    } while (token.kind != HL_BODY);
+    assert(token.partial == 1);
+    assert(token.start == body);
+    assert(token.end == body + 4);
+
+    token = hl_execute(&lexer, token.end, strlen(token.end));
+    assert(token.kind == HL_BODY);
+    assert(token.partial == 0);
+    assert(token.start == body + 4);
+    assert(token.end == body + 10);
+  }
+}
+
+
+/* A request that ends at the end of the buffer, in a buffer of its size:
+ * the lexer must not read past it to get to HL_MSG_END.
+ */
+void manual_test_exact_buffer() {
+  static const char req[] = "GET / HTTP/1.1\r\n\r\n";
+  char* buf = malloc(sizeof(req) - 1);
+  const char* b = buf;
+  size_t len = sizeof(req) - 1;
+  hl_lexer lexer;
+  hl_token token;
+
+  memcpy(buf, req, len);
+  hl_req_init(&lexer);
+  do {
+    token = hl_execute(&lexer, b, len);
+    assert(token.kind != HL_ERROR && token.kind != HL_EAGAIN);
+    len -= token.end - b;
+    b = token.end;
+  } while (token.kind != HL_MSG_END);
+  assert(token.end == buf + sizeof(req) - 1);
+  assert(hl_execute(&lexer, b, 0).kind == HL_EAGAIN);
+  free(buf);
+}
+
+
 void manual_test_CURL_GET() {
   hl_lexer lexer;
   hl_token token;
@@ -332,6 +433,2276 @@ void manual_test_CURL_GET() {
 }
 
 
+void test_url(const struct message* req) {
+  hl_url url;
+  const char* raw = req->request_url;
+  int r = hl_url_parse(raw, strlen(raw), &url);
+  assert(r == 0);
+
+  expect_span_eq(req->request_path, url.path);
+  expect_span_eq(req->query_string, url.query);
+  expect_span_eq(req->fragment, url.fragment);
+  if (req->host) {
+    assert(url.form == HL_URL_ABSOLUTE);
+    expect_span_eq("http", url.scheme);
+    expect_span_eq(req->host, url.host);
+  }
+  if (req->userinfo) {
+    expect_span_eq(req->userinfo, url.userinfo);
+  }
+  if (req->port) {
+    assert(url.port_num == req->port);
+  }
+}
+
+
+void manual_test_url_forms() {
+  hl_url url;
+  const char* s;
+
+  s = "0-home0.netscape.com:443";
+  assert(hl_url_parse(s, strlen(s), &url) == 0);
+  assert(url.form == HL_URL_AUTHORITY);
+  assert(url.scheme.start == NULL);
+  expect_span_eq("0-home0.netscape.com", url.host);
+  expect_span_eq("443", url.port);
+  assert(url.port_num == 443);
+
+  s = "HOME0.NETSCAPE.COM:443";
+  assert(hl_url_parse(s, strlen(s), &url) == 0);
+  assert(url.form == HL_URL_AUTHORITY);
+  expect_span_eq("HOME0.NETSCAPE.COM", url.host);
+  assert(url.port_num == 443);
+
+  s = "*";
+  assert(hl_url_parse(s, strlen(s), &url) == 0);
+  assert(url.form == HL_URL_ASTERISK);
+  expect_span_eq("*", url.path);
+
+  s = "https://[::1]:8443/a?b#c";
+  assert(hl_url_parse(s, strlen(s), &url) == 0);
+  assert(url.form == HL_URL_ABSOLUTE);
+  expect_span_eq("https", url.scheme);
+  expect_span_eq("[::1]", url.host);
+  assert(url.port_num == 8443);
+  expect_span_eq("/a", url.path);
+  expect_span_eq("b", url.query);
+  expect_span_eq("c", url.fragment);
+
+  s = "http://example.org/";
+  assert(hl_url_parse(s, strlen(s), &url) == 0);
+  assert(url.port_num == -1);
+  assert(url.port.start == NULL);
+
+  /* Bad ports, empty hosts and junk after an authority. */
+  s = "http://example.org:99999/";
+  assert(hl_url_parse(s, strlen(s), &url) == -1);
+  s = "http://example.org:80x/";
+  assert(hl_url_parse(s, strlen(s), &url) == -1);
+  s = "http:///path";
+  assert(hl_url_parse(s, strlen(s), &url) == -1);
+  s = "example.org:443/path";
+  assert(hl_url_parse(s, strlen(s), &url) == -1);
+  s = "http://[::1/";
+  assert(hl_url_parse(s, strlen(s), &url) == -1);
+  assert(hl_url_parse("", 0, &url) == -1);
+}
+
+
+void expect_normalize(const char* in, int flags, const char* expected) {
+  char buf[256];
+  ssize_t len;
+
+  strcpy(buf, in);
+  len = hl_url_normalize(buf, strlen(buf), flags);
+
+  if (expected == NULL) {
+    assert(len == -1);
+  } else {
+    assert(len == (ssize_t)strlen(expected));
+    assert(strncmp(buf, expected, len) == 0);
+  }
+}
+
+
+void manual_test_url_normalize() {
+  expect_normalize("/", 0, "/");
+  expect_normalize("/static/app.min.js", 0, "/static/app.min.js");
+  expect_normalize("/a/b/c/./../../g", 0, "/a/g");
+  expect_normalize("/a/./b/.", 0, "/a/b/");
+  expect_normalize("/a/b/..", 0, "/a/");
+  expect_normalize("/../../etc/passwd", 0, "/etc/passwd");
+  expect_normalize("/a/.htaccess", 0, "/a/.htaccess");
+  expect_normalize("/a/..b/c", 0, "/a/..b/c");
+  expect_normalize("/hello%20world", 0, "/hello world");
+  expect_normalize("/a/%2e%2E/b", 0, "/b");
+  expect_normalize("/%25%32%65", 0, "/%2e");
+  expect_normalize("/a//b", 0, "/a//b");
+  expect_normalize("/a//b//", HL_NORM_MERGE_SLASHES, "/a/b/");
+  expect_normalize("/x/%00", 0, NULL);
+  {
+    char nul[] = "/x/%00";
+    assert(hl_url_normalize(nul, 6, HL_NORM_ALLOW_NUL) == 4);
+    assert(memcmp(nul, "/x/", 4) == 0);
+  }
+  expect_normalize("/a%2fb/../c", 0, NULL);
+  expect_normalize("/a%2fb/../c", HL_NORM_KEEP_SLASH, "/c");
+  expect_normalize("/a%2fb/c", HL_NORM_KEEP_SLASH, "/a%2fb/c");
+  expect_normalize("/bad%2", 0, NULL);
+  expect_normalize("/bad%zz", 0, NULL);
+  expect_normalize("relative", 0, NULL);
+  /* Long enough to go through the vector loops. */
+  expect_normalize("/aaaaaaaaaaaaaaaa/bbbbbbbbbbbbbbbbbbbb/../cccccccccccccccc/./"
+                   "%64%64%64%64%64%64%64%64%64%64%64%64%64%64%64%64%64",
+                   0,
+                   "/aaaaaaaaaaaaaaaa/cccccccccccccccc/ddddddddddddddddd");
+}
+
+
+void manual_test_query() {
+  const char* s = "a=1&&b=hello+world;flag&c=%41%42=&e=&=f";
+  hl_span query;
+  hl_query_param param;
+  char buf[64];
+  ssize_t len;
+  int n = 0;
+
+  query.start = s;
+  query.end = s + strlen(s);
+
+  assert(hl_query_next(&query, &param) == 1);
+  expect_span_eq("a", param.key);
+  expect_span_eq("1", param.value);
+  assert(!param.key_escaped && !param.value_escaped);
+
+  assert(hl_query_next(&query, &param) == 1);
+  expect_span_eq("b", param.key);
+  expect_span_eq("hello+world", param.value);
+  assert(!param.key_escaped && param.value_escaped);
+  len = hl_query_decode(param.value.start,
+                        param.value.end - param.value.start,
+                        buf);
+  assert(len == 11 && strncmp(buf, "hello world", len) == 0);
+
+  assert(hl_query_next(&query, &param) == 1);
+  expect_span_eq("flag", param.key);
+  assert(param.value.start == NULL);
+
+  assert(hl_query_next(&query, &param) == 1);
+  expect_span_eq("c", param.key);
+  expect_span_eq("%41%42=", param.value);
+  assert(param.value_escaped);
+  len = hl_query_decode(param.value.start,
+                        param.value.end - param.value.start,
+                        buf);
+  assert(len == 3 && strncmp(buf, "AB=", len) == 0);
+
+  assert(hl_query_next(&query, &param) == 1);
+  expect_span_eq("e", param.key);
+  expect_span_eq("", param.value);
+  assert(param.value.start != NULL);
+
+  assert(hl_query_next(&query, &param) == 1);
+  expect_span_eq("", param.key);
+  expect_span_eq("f", param.value);
+
+  assert(hl_query_next(&query, &param) == 0);
+  assert(hl_query_next(&query, &param) == 0);
+
+  assert(hl_query_decode("%4", 2, buf) == -1);
+
+  /* Many pairs, long enough for the vector loop. */
+  s = "utm_source=newsletter&utm_medium=email&utm_campaign=spring_sale"
+      "&utm_content=header_link&session_identifier=0123456789abcdef";
+  query.start = s;
+  query.end = s + strlen(s);
+  while (hl_query_next(&query, &param)) {
+    assert(param.value.start != NULL);
+    assert(!param.key_escaped && !param.value_escaped);
+    n++;
+  }
+  assert(n == 5);
+  expect_span_eq("0123456789abcdef", param.value);
+}
+
+
+const char multipart_body[] =
+  "This is the preamble.\r\n"
+  "--AaB03x\r\n"
+  "Content-Disposition: form-data; name=\"submit-name\"\r\n"
+  "\r\n"
+  "Larry\r\n"
+  "--AaB03x  \r\n"
+  "Content-Disposition: form-data; name=\"files\"; filename=\"file1.txt\"\r\n"
+  "Content-Type: text/plain\r\n"
+  "\r\n"
+  "contents of file1.txt with a fake \r\n--AaB03 boundary and \r\n-\r\n"
+  "--AaB03x\r\n"
+  "\r\n"
+  "\r\n"
+  "--AaB03x--\r\n"
+  "This is the epilogue.\r\n";
+
+const char multipart_expected[] =
+  "<part>"
+  "[Content-Disposition][form-data; name=\"submit-name\"]"
+  "<header_end>{Larry}<part_end>"
+  "<part>"
+  "[Content-Disposition][form-data; name=\"files\"; filename=\"file1.txt\"]"
+  "[Content-Type][text/plain]"
+  "<header_end>"
+  "{contents of file1.txt with a fake \r\n--AaB03 boundary and \r\n-}"
+  "<part_end>"
+  "<part><header_end><part_end>"
+  "<eof>";
+
+/* Feeds multipart_body to the lexer in pieces of at most chunk bytes,
+ * keeping any tail the lexer hands back, and writes the tokens to out.
+ */
+void run_multipart(size_t chunk, char* out) {
+  hl_multipart mp;
+  hl_token token;
+  char buf[sizeof(multipart_body) + 16];
+  const char* src = multipart_body;
+  const char* src_end = multipart_body + strlen(multipart_body);
+  const char* b;
+  size_t len = 0; /* bytes in buf */
+  size_t n;
+  int last_partial = 0;
+
+  assert(hl_multipart_init(&mp, "AaB03x", 6) == 0);
+  *out = '\0';
+
+  for (;;) {
+    n = MIN(chunk, (size_t)(src_end - src));
+    memcpy(buf + len, src, n);
+    src += n;
+    len += n;
+    b = buf;
+
+    for (;;) {
+      token = hl_multipart_execute(&mp, b, len);
+      assert(token.kind != HL_ERROR);
+      if (token.kind == HL_EOF) {
+        strcat(out, "<eof>");
+        return;
+      }
+      if (token.kind == HL_EAGAIN) break;
+
+      switch (token.kind) {
+        case HL_PART_START: strcat(out, "<part>"); break;
+        case HL_PART_END: strcat(out, "<part_end>"); break;
+        case HL_HEADER_END: strcat(out, "<header_end>"); break;
+        case HL_FIELD:
+        case HL_VALUE:
+        case HL_BODY:
+          if (!last_partial) {
+            strcat(out, token.kind == HL_FIELD ? "[" :
+                        token.kind == HL_VALUE ? "[" : "{");
+          }
+          strncat(out, token.start, token.end - token.start);
+          if (!token.partial) {
+            strcat(out, token.kind == HL_BODY ? "}" : "]");
+          }
+          break;
+        default:
+          assert(0);
+      }
+      last_partial = token.partial;
+
+      len -= token.end - b;
+      b = token.end;
+      if (token.partial && len == 0) break;
+    }
+
+    /* Keep what wasn't consumed. */
+    len = b + len - token.end;
+    memmove(buf, token.end, len);
+    assert(len < 4 + 6);
+    assert(src < src_end);
+  }
+}
+
+
+void manual_test_multipart() {
+  char out[1024];
+  size_t chunk;
+  hl_multipart mp;
+
+  for (chunk = 1; chunk <= strlen(multipart_body); chunk++) {
+    run_multipart(chunk, out);
+    if (strcmp(out, multipart_expected) != 0) {
+      printf("multipart chunk = %d\n%s\n", (int)chunk, out);
+      abort();
+    }
+  }
+
+  assert(hl_multipart_init(&mp, "", 0) == -1);
+
+  /* A body that ends at the close delimiter, in a buffer of its size. */
+  {
+    static const char body[] = "--b\r\n\r\nx\r\n--b--";
+    char* buf = malloc(sizeof(body) - 1);
+    const char* b = buf;
+    size_t len = sizeof(body) - 1;
+    hl_token token;
+
+    memcpy(buf, body, len);
+    assert(hl_multipart_init(&mp, "b", 1) == 0);
+    do {
+      token = hl_multipart_execute(&mp, b, len);
+      assert(token.kind != HL_ERROR && token.kind != HL_EAGAIN);
+      len -= token.end - b;
+      b = token.end;
+    } while (token.kind != HL_EOF);
+    assert(token.end == buf + sizeof(body) - 1);
+    free(buf);
+  }
+}
+
+
+const char form_body[] =
+  "name=John+Doe&email=john%40example.com&&flag&empty=&x=%41%2b&=v&k";
+
+const char form_expected[] =
+  "[name=John Doe][email=john@example.com][flag=][empty=][x=A+][=v][k=]";
+
+/* Feeds form_body to the lexer in pieces of chunk bytes, decoding every
+ * token, and writes the pairs to out.
+ */
+void run_form(size_t chunk, char* out) {
+  hl_form form;
+  hl_token token;
+  char buf[sizeof(form_body)];
+  const char* b;
+  size_t off, len;
+  ssize_t n;
+  int last_partial = 0;
+
+  hl_form_init(&form);
+  *out = '\0';
+
+  for (off = 0; off < strlen(form_body); off += chunk) {
+    /* Copy each piece so tokens can only point into the current one. */
+    len = MIN(chunk, strlen(form_body) - off);
+    memcpy(buf, form_body + off, len);
+    b = buf;
+
+    do {
+      token = hl_form_execute(&form, b, len);
+      assert(token.kind != HL_ERROR);
+      if (token.kind == HL_EAGAIN) break;
+
+      n = hl_form_decode(&form, token, (char*)token.start);
+      assert(n >= 0);
+      if (token.kind == HL_FIELD && !last_partial) strcat(out, "[");
+      strncat(out, token.start, n);
+      if (!token.partial) {
+        strcat(out, token.kind == HL_FIELD ? "=" : "]");
+      }
+      last_partial = token.partial;
+
+      len -= token.end - b;
+      b = token.end;
+    } while (len > 0);
+  }
+
+  while ((token = hl_form_end(&form)).kind != HL_EOF) {
+    assert(hl_form_decode(&form, token, NULL) == 0);
+    strcat(out, token.kind == HL_FIELD ? "=" : "]");
+  }
+}
+
+
+void manual_test_form() {
+  char out[256];
+  size_t chunk;
+  hl_form form;
+  hl_token token;
+  char bad[] = "a=%4";
+
+  for (chunk = 1; chunk <= strlen(form_body); chunk++) {
+    run_form(chunk, out);
+    if (strcmp(out, form_expected) != 0) {
+      printf("form chunk = %d\n%s\n", (int)chunk, out);
+      abort();
+    }
+  }
+
+  /* A "%XX" cut short by the end of the body. */
+  hl_form_init(&form);
+  token = hl_form_execute(&form, bad, 4);
+  assert(token.kind == HL_FIELD);
+  token = hl_form_execute(&form, token.end, 3);
+  assert(token.kind == HL_VALUE && token.partial);
+  assert(hl_form_decode(&form, token, bad + 2) == 0);
+  token = hl_form_end(&form);
+  assert(token.kind == HL_VALUE);
+  assert(hl_form_decode(&form, token, bad + 2) == -1);
+  assert(hl_form_end(&form).kind == HL_EOF);
+}
+
+
+/* Writes an HTTP/2 frame header to p. */
+char* h2_frame(char* p, int len, int type, int flags, int stream) {
+  p[0] = len >> 16;
+  p[1] = len >> 8;
+  p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  p[5] = stream >> 24;
+  p[6] = stream >> 16;
+  p[7] = stream >> 8;
+  p[8] = stream;
+  return p + 9;
+}
+
+/* Feeds s to an HTTP/2 request lexer in pieces of chunk bytes and writes the
+ * tokens to out. Returns the last token.
+ */
+hl2_token run_hl2(const char* s, size_t s_len, size_t chunk, char* out) {
+  hl2_lexer lexer;
+  hl2_token token;
+  char buf[256];
+  char tmp[64];
+  const char* b;
+  size_t off, len;
+  int last_partial = 0;
+
+  hl2_req_init(&lexer);
+  *out = '\0';
+  token.kind = HL2_EAGAIN;
+
+  for (off = 0; off < s_len; off += chunk) {
+    len = MIN(chunk, s_len - off);
+    memcpy(buf, s + off, len);
+    b = buf;
+
+    for (;;) {
+      token = hl2_execute(&lexer, b, len);
+      if (token.kind == HL2_ERROR) {
+        sprintf(tmp, "<error %lu>", token.value);
+        strcat(out, tmp);
+        return token;
+      }
+      if (token.kind == HL2_EAGAIN) break;
+
+      switch (token.kind) {
+        case HL2_PREFACE: strcat(out, "<preface>"); break;
+        case HL2_FRAME_START:
+          sprintf(tmp, "<%d %x %lu>", token.type, token.flags,
+                  token.stream_id);
+          strcat(out, tmp);
+          break;
+        case HL2_FRAME_END: strcat(out, "</>"); break;
+        case HL2_SETTING:
+        case HL2_GOAWAY:
+          sprintf(tmp, "[%lu=%lu]", token.id, token.value);
+          strcat(out, tmp);
+          break;
+        case HL2_WINDOW_UPDATE:
+        case HL2_RST_STREAM:
+          sprintf(tmp, "[%lu]", token.value);
+          strcat(out, tmp);
+          break;
+        case HL2_DATA:
+        case HL2_HEADER_BLOCK:
+        case HL2_PING:
+          if (!last_partial) strcat(out, "{");
+          strncat(out, token.start, token.end - token.start);
+          if (!token.partial) strcat(out, "}");
+          break;
+        default:
+          assert(0);
+      }
+      last_partial = token.partial;
+
+      len -= token.end - b;
+      b = token.end;
+      if (token.partial && len == 0) break;
+    }
+  }
+
+  return token;
+}
+
+
+void manual_test_hl2() {
+  char s[512];
+  char out[1024];
+  char* p = s;
+  size_t len, chunk;
+  hl2_token token;
+
+  memcpy(p, HL2_PREFACE_STR, HL2_PREFACE_LEN);
+  p += HL2_PREFACE_LEN;
+
+  /* SETTINGS: HEADER_TABLE_SIZE = 4096, MAX_CONCURRENT_STREAMS = 100 */
+  p = h2_frame(p, 12, HL2_FRAME_SETTINGS, 0, 0);
+  memcpy(p, "\x00\x01\x00\x00\x10\x00\x00\x03\x00\x00\x00\x64", 12);
+  p += 12;
+
+  /* HEADERS, padded with priority, continued. */
+  p = h2_frame(p, 1 + 5 + 4 + 2, HL2_FRAME_HEADERS,
+               HL2_FLAG_PADDED | HL2_FLAG_PRIORITY, 1);
+  memcpy(p, "\x02" "\x00\x00\x00\x00\x0f" "abcd" "\x00\x00", 12);
+  p += 12;
+  p = h2_frame(p, 3, HL2_FRAME_CONTINUATION, HL2_FLAG_END_HEADERS, 1);
+  memcpy(p, "efg", 3);
+  p += 3;
+
+  /* Unknown frame type. */
+  p = h2_frame(p, 3, 0xfa, 0, 0);
+  memcpy(p, "xyz", 3);
+  p += 3;
+
+  /* DATA, padded, ends the stream. */
+  p = h2_frame(p, 1 + 11 + 3, HL2_FRAME_DATA,
+               HL2_FLAG_PADDED | HL2_FLAG_END_STREAM, 1);
+  memcpy(p, "\x03hello world\x00\x00\x00", 15);
+  p += 15;
+
+  /* Empty DATA. */
+  p = h2_frame(p, 0, HL2_FRAME_DATA, HL2_FLAG_END_STREAM, 3);
+
+  p = h2_frame(p, 4, HL2_FRAME_WINDOW_UPDATE, 0, 0);
+  memcpy(p, "\x80\x01\x00\x00", 4);
+  p += 4;
+
+  p = h2_frame(p, 8, HL2_FRAME_PING, 0, 0);
+  memcpy(p, "pingpong", 8);
+  p += 8;
+
+  p = h2_frame(p, 4, HL2_FRAME_RST_STREAM, 0, 3);
+  memcpy(p, "\x00\x00\x00\x08", 4);
+  p += 4;
+
+  p = h2_frame(p, 0, HL2_FRAME_SETTINGS, HL2_FLAG_ACK, 0);
+
+  p = h2_frame(p, 8 + 5, HL2_FRAME_GOAWAY, 0, 0);
+  memcpy(p, "\x00\x00\x00\x03\x00\x00\x00\x00" "debug", 13);
+  p += 13;
+
+  len = p - s;
+  for (chunk = 1; chunk <= len; chunk++) {
+    token = run_hl2(s, len, chunk, out);
+    if (strcmp(out,
+               "<preface><4 0 0>[1=4096][3=100]</>"
+               "<1 28 1>{abcd}</><9 4 1>{efg}</>"
+               "<250 0 0></>"
+               "<0 9 1>{hello world}</><0 1 3></>"
+               "<8 0 0>[65536]</><6 0 0>{pingpong}</>"
+               "<3 0 3>[8]</><4 1 0></>"
+               "<7 0 0>[3=0]</>") != 0) {
+      printf("hl2 chunk = %d\n%s\n", (int)chunk, out);
+      abort();
+    }
+  }
+
+  /* No preface. */
+  token = run_hl2("GET / HTTP/1.1\r\n", 16, 16, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_PROTOCOL_ERROR);
+
+  /* First frame isn't SETTINGS. */
+  p = s + HL2_PREFACE_LEN;
+  p = h2_frame(p, 0, HL2_FRAME_DATA, 0, 1);
+  token = run_hl2(s, p - s, 64, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_PROTOCOL_ERROR);
+
+  /* SETTINGS on a stream. */
+  p = s + HL2_PREFACE_LEN;
+  p = h2_frame(p, 0, HL2_FRAME_SETTINGS, 0, 1);
+  token = run_hl2(s, p - s, 64, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_PROTOCOL_ERROR);
+
+  /* Frame too big. */
+  p = s + HL2_PREFACE_LEN;
+  p = h2_frame(p, 16385, HL2_FRAME_SETTINGS, 0, 0);
+  token = run_hl2(s, p - s, 64, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_FRAME_SIZE_ERROR);
+
+  /* Something other than CONTINUATION after HEADERS without END_HEADERS. */
+  p = s + HL2_PREFACE_LEN;
+  p = h2_frame(p, 0, HL2_FRAME_SETTINGS, 0, 0);
+  p = h2_frame(p, 1, HL2_FRAME_HEADERS, 0, 1);
+  *p++ = 'a';
+  p = h2_frame(p, 1, HL2_FRAME_DATA, 0, 1);
+  *p++ = 'b';
+  token = run_hl2(s, p - s, 64, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_PROTOCOL_ERROR);
+
+  /* Padding longer than the frame. */
+  p = s + HL2_PREFACE_LEN;
+  p = h2_frame(p, 0, HL2_FRAME_SETTINGS, 0, 0);
+  p = h2_frame(p, 2, HL2_FRAME_DATA, HL2_FLAG_PADDED, 1);
+  *p++ = 2;
+  *p++ = 0;
+  token = run_hl2(s, p - s, 64, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_PROTOCOL_ERROR);
+
+  /* Bad PING length. */
+  p = s + HL2_PREFACE_LEN;
+  p = h2_frame(p, 0, HL2_FRAME_SETTINGS, 0, 0);
+  p = h2_frame(p, 4, HL2_FRAME_PING, 0, 0);
+  memcpy(p, "ping", 4);
+  p += 4;
+  token = run_hl2(s, p - s, 64, out);
+  assert(token.kind == HL2_ERROR && token.value == HL2_FRAME_SIZE_ERROR);
+}
+
+
+/* Decodes the header block in hex into "name: value\n" lines in out. Returns
+ * what the last hl_hpack_decode() call returned.
+ */
+int run_hpack(hl_hpack* hp, const char* hex, char* out) {
+  char block[512];
+  char buf[1024];
+  size_t len = 0;
+  unsigned int byte;
+  hl_span span;
+  hl_hpack_header hdr;
+  int r;
+
+  for (; *hex; hex += 2) {
+    sscanf(hex, "%2x", &byte);
+    block[len++] = (char)byte;
+  }
+  span.start = block;
+  span.end = block + len;
+
+  *out = '\0';
+  while ((r = hl_hpack_decode(hp, &span, &hdr, buf, sizeof(buf))) > 0) {
+    assert(hdr.field.kind == HL_FIELD && hdr.value.kind == HL_VALUE);
+    out += sprintf(out, "%.*s: %.*s\n",
+                   (int)(hdr.field.end - hdr.field.start), hdr.field.start,
+                   (int)(hdr.value.end - hdr.value.start), hdr.value.start);
+  }
+  return r;
+}
+
+void manual_test_hpack() {
+  static char mem[HL_HPACK_MEM_SIZE(4096)];
+  char out[1024];
+  char enc[] = "\x9d\x29\xad\x17\x18\x63\xc7\x8f\x0b\x97\xc8\xe9\xae\x82\xae"
+               "\x43\xd3";
+  hl_hpack hp;
+  hl_hpack_header hdr;
+  hl_span span;
+  char buf[64];
+
+  /* RFC 7541 C.4: requests with Huffman coding. */
+  hl_hpack_init(&hp, mem, 4096);
+  assert(run_hpack(&hp, "828684418cf1e3c2e5f23a6ba0ab90f4ff", out) == 0);
+  assert(strcmp(out, ":method: GET\n:scheme: http\n:path: /\n"
+                     ":authority: www.example.com\n") == 0);
+  assert(hp.size == 57);
+
+  assert(run_hpack(&hp, "828684be5886a8eb10649cbf", out) == 0);
+  assert(strcmp(out, ":method: GET\n:scheme: http\n:path: /\n"
+                     ":authority: www.example.com\n"
+                     "cache-control: no-cache\n") == 0);
+  assert(hp.size == 110);
+
+  assert(run_hpack(&hp, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+                   out) == 0);
+  assert(strcmp(out, ":method: GET\n:scheme: https\n:path: /index.html\n"
+                     ":authority: www.example.com\n"
+                     "custom-key: custom-value\n") == 0);
+  assert(hp.size == 164);
+
+  /* RFC 7541 C.6: responses with Huffman coding and a 256 byte table, so
+   * entries are evicted and wrap around the ring.
+   */
+  hl_hpack_init(&hp, mem, 256);
+  assert(run_hpack(&hp,
+                   "488264025885aec3771a4b6196d07abe941054d444a8200595040b81"
+                   "66e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+                   out) == 0);
+  assert(strcmp(out, ":status: 302\ncache-control: private\n"
+                     "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                     "location: https://www.example.com\n") == 0);
+  assert(hp.size == 222);
+
+  assert(run_hpack(&hp, "4883640effc1c0bf", out) == 0);
+  assert(strcmp(out, ":status: 307\ncache-control: private\n"
+                     "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                     "location: https://www.example.com\n") == 0);
+  assert(hp.size == 222);
+
+  assert(run_hpack(&hp,
+                   "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a"
+                   "839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f36"
+                   "72c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+                   out) == 0);
+  assert(strcmp(out, ":status: 200\ncache-control: private\n"
+                     "date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+                     "location: https://www.example.com\n"
+                     "content-encoding: gzip\n"
+                     "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; "
+                     "max-age=3600; version=1\n") == 0);
+  assert(hp.size == 215);
+
+  /* Names are reported by id, also for literal names. */
+  hl_hpack_init(&hp, mem, 4096);
+  span.start = "\x5f\x18text/html; charset=utf-8"
+               "\x10\x0c" "content-type" "\x03" "foo"
+               "\xbe";
+  span.end = span.start + 2 + 24 + 2 + 12 + 4 + 1;
+  assert(hl_hpack_decode(&hp, &span, &hdr, buf, sizeof(buf)) == 1);
+  assert(hdr.name_id == HL_HPACK_CONTENT_TYPE && !hdr.sensitive);
+  assert(hl_hpack_decode(&hp, &span, &hdr, buf, sizeof(buf)) == 1);
+  assert(hdr.name_id == HL_HPACK_CONTENT_TYPE && hdr.sensitive);
+  assert(hl_hpack_decode(&hp, &span, &hdr, buf, sizeof(buf)) == 1);
+  assert(hdr.name_id == HL_HPACK_CONTENT_TYPE);
+  expect_eq("text/html; charset=utf-8", hdr.value);
+  assert(hl_hpack_decode(&hp, &span, &hdr, buf, sizeof(buf)) == 0);
+  assert(hl_hpack_name_id("Content-Type", 12) == HL_HPACK_CONTENT_TYPE);
+  assert(hl_hpack_name_id(":status", 7) == HL_HPACK_STATUS);
+  assert(hl_hpack_name_id("x-request-id", 12) == 0);
+
+  /* Table size updates. */
+  hl_hpack_init(&hp, mem, 256);
+  assert(run_hpack(&hp, "408425a849e980", out) == 0); /* "custom": "" */
+  assert(hp.size == 32 + 6);
+  assert(run_hpack(&hp, "20", out) == 0);
+  assert(hp.size == 0 && hp.max_size == 0);
+  assert(run_hpack(&hp, "3fe201", out) == -1); /* 256 + 1 */
+
+  /* Errors. */
+  hl_hpack_init(&hp, mem, 4096);
+  assert(run_hpack(&hp, "80", out) == -1); /* index 0 */
+  assert(run_hpack(&hp, "be", out) == -1); /* empty dynamic table */
+  assert(run_hpack(&hp, "0003666f6f03", out) == -1); /* short string */
+  assert(run_hpack(&hp, "ffffffffff7f", out) == -1); /* huge index */
+  assert(run_hpack(&hp, "0f", out) == -1); /* truncated integer */
+  assert(run_hpack(&hp, "4181ff00", out) == -1); /* 8 bits of padding */
+  assert(run_hpack(&hp, "4184fffffffc00", out) == -1); /* EOS */
+
+  /* Huffman alone; a small dst takes the checked path. */
+  assert(hl_hpack_huff_decode(enc, sizeof(enc) - 1, buf, sizeof(buf)) == 23);
+  assert(memcmp(buf, "https://www.example.com", 23) == 0);
+  assert(hl_hpack_huff_decode(enc, sizeof(enc) - 1, buf, 23) == 23);
+  assert(memcmp(buf, "https://www.example.com", 23) == 0);
+  assert(hl_hpack_huff_decode(enc, sizeof(enc) - 1, buf, 22) == -1);
+}
+
+void manual_test_hpack_encode() {
+  static char enc_mem[HL_HPACK_MEM_SIZE(4096)];
+  static char dec_mem[HL_HPACK_MEM_SIZE(4096)];
+  hl_hpack enc, dec;
+  char block[256];
+  char out[1024];
+  char buf[256];
+  hl_span span;
+  hl_hpack_header hdr;
+  char* p;
+  ssize_t n;
+  int round;
+
+  hl_hpack_init(&enc, enc_mem, 4096);
+  hl_hpack_init(&dec, dec_mem, 4096);
+
+  for (round = 0; round < 2; round++) {
+    p = block;
+    p += hl_hpack_encode_id(&enc, p, 16, HL_HPACK_STATUS, "200", 3, 0);
+    p += hl_hpack_encode_id(&enc, p, 64, HL_HPACK_CONTENT_TYPE,
+                            "text/html", 9, 0);
+    p += hl_hpack_encode(&enc, p, 64, "server", 6, "hl", 2, 0);
+    p += hl_hpack_encode(&enc, p, 64, "x-request-id", 12, "abc", 3, 0);
+    p += hl_hpack_encode(&enc, p, 64, "set-cookie", 10, "a=b", 3, 0);
+
+    if (round == 0) {
+      assert(memcmp(block, "\x88\x5f", 2) == 0);
+      assert(enc.count == 2);
+    } else {
+      /* content-type and server come from the dynamic table now. */
+      assert(memcmp(block, "\x88\xbf\xbe", 3) == 0);
+    }
+
+    span.start = block;
+    span.end = p;
+    *out = '\0';
+    for (n = 0; hl_hpack_decode(&dec, &span, &hdr, buf, sizeof(buf)) > 0;) {
+      n += sprintf(out + n, "%.*s: %.*s%s\n",
+                   (int)(hdr.field.end - hdr.field.start), hdr.field.start,
+                   (int)(hdr.value.end - hdr.value.start), hdr.value.start,
+                   hdr.sensitive ? " (sensitive)" : "");
+    }
+    assert(span.start == span.end);
+    assert(strcmp(out, ":status: 200\ncontent-type: text/html\nserver: hl\n"
+                       "x-request-id: abc\nset-cookie: a=b (sensitive)\n") ==
+           0);
+    assert(dec.size == enc.size);
+  }
+
+  /* RFC 7541 C.4.1, with and without Huffman coding. */
+  n = hl_hpack_encode_id(&enc, block, sizeof(block), HL_HPACK_AUTHORITY,
+                         "www.example.com", 15, HL_HPACK_INDEX);
+  assert(n == 14);
+  assert(memcmp(block, "\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90"
+                       "\xf4\xff", 14) == 0);
+  n = hl_hpack_encode(&enc, block, sizeof(block), "custom-key", 10,
+                      "custom-value", 12,
+                      HL_HPACK_NO_INDEX | HL_HPACK_NO_HUFFMAN);
+  assert(n == 25);
+  assert(memcmp(block, "\x00\x0a" "custom-key" "\x0c" "custom-value", 25) ==
+         0);
+
+  /* Nothing changes when dst is too small. */
+  n = (ssize_t)enc.count;
+  assert(hl_hpack_encode(&enc, block, 5, "x-new", 5, "value",
+                         5, HL_HPACK_INDEX) == -1);
+  assert((ssize_t)enc.count == n);
+
+  /* Size updates come first in the next block. */
+  hl_hpack_set_max_size(&enc, 0);
+  assert(enc.count == 0 && enc.size == 0);
+  n = hl_hpack_encode_id(&enc, block, sizeof(block), HL_HPACK_STATUS,
+                         "404", 3, 0);
+  assert(n == 2 && memcmp(block, "\x20\x8d", 2) == 0);
+  n = hl_hpack_encode_id(&enc, block, sizeof(block), HL_HPACK_STATUS,
+                         "404", 3, 0);
+  assert(n == 1);
+
+  /* Integers with continuation bytes. */
+  hl_hpack_set_max_size(&enc, 4096);
+  n = hl_hpack_encode_id(&enc, block, sizeof(block), HL_HPACK_SERVER,
+                         "hl", 2, HL_HPACK_NO_HUFFMAN);
+  assert(n == 3 + 1 + 1 + 2);
+  assert(memcmp(block, "\x3f\xe1\x1f" "\x76\x02hl", 7) == 0);
+
+  assert(hl_hpack_huff_len("no-cache", 8) == 6);
+  assert(hl_hpack_huff_encode("no-cache", 8, buf) == 6);
+  assert(memcmp(buf, "\xa8\xeb\x10\x64\x9c\xbf", 6) == 0);
+}
+
+/* Like run_hl() for a lexer that is already initialized. */
+size_t run_hl_inited(const char* s, size_t chunk, char* out,
+                     hl_lexer* lexer) {
+  const char* end = s + strlen(s);
+  const char* b = s;
+  const char* buf_end;
+  hl_token token;
+  int last_partial = 0;
+
+  *out = '\0';
+
+  for (buf_end = MIN(b + chunk, end);; buf_end = MIN(buf_end + chunk, end)) {
+    for (;;) {
+      token = hl_execute(lexer, b, buf_end - b);
+      switch (token.kind) {
+        case HL_EAGAIN: break;
+        case HL_ERROR: strcat(out, "<error>"); return token.end - s;
+        case HL_EOF: strcat(out, "<eof>"); return token.end - s;
+        case HL_UPGRADE: strcat(out, "<upgrade>"); return token.end - s;
+        case HL_MSG_START: strcat(out, "<msg>"); break;
+        case HL_HEADER_END: strcat(out, "<header_end>"); break;
+        case HL_MSG_END: strcat(out, "<msg_end>"); break;
+        default:
+          if (!last_partial) strcat(out, token.kind == HL_BODY ? "{" : "[");
+          strncat(out, token.start, token.end - token.start);
+          if (!token.partial) strcat(out, token.kind == HL_BODY ? "}" : "]");
+          break;
+      }
+      /* Bytes from token.end on are passed again; see hl_set_headers(). */
+      b = token.end;
+      if (token.kind == HL_EAGAIN) break;
+      last_partial = token.partial;
+      if (token.partial && b == buf_end) break;
+    }
+    if (buf_end == end) {
+      strcat(out, "<eagain>");
+      return end - s;
+    }
+  }
+}
+
+/* Feeds s to hl_execute() in pieces of at most chunk bytes and writes the
+ * tokens to out. Returns the offset where HTTP ended.
+ */
+size_t run_hl(const char* s, size_t chunk, char* out, hl_lexer* lexer) {
+  hl_req_init(lexer);
+  return run_hl_inited(s, chunk, out, lexer);
+}
+
+void manual_test_h2c() {
+  char out[1024];
+  char frames[64];
+  const char* s;
+  size_t chunk, len, off;
+  hl_lexer lexer;
+  hl2_lexer lexer2;
+  hl2_token token;
+
+  /* Prior knowledge, followed by a SETTINGS frame. */
+  s = HL2_PREFACE_STR "\x00\x00\x00\x04\x00\x00\x00\x00\x00";
+  len = HL2_PREFACE_LEN + 9;
+  memcpy(frames, s, len);
+  frames[len] = '\0';
+  for (chunk = 1; chunk <= len; chunk++) {
+    off = run_hl(HL2_PREFACE_STR, chunk, out, &lexer);
+    assert(strcmp(out, "<msg>[PRI][*]<upgrade>") == 0);
+    assert(off == HL2_PREFACE_LEN);
+    assert(lexer.upgrade == HL_UPGRADE_H2);
+  }
+  hl2_req_init_no_preface(&lexer2);
+  token = hl2_execute(&lexer2, frames + off, len - off);
+  assert(token.kind == HL2_FRAME_START && token.type == HL2_FRAME_SETTINGS);
+
+  /* Near misses are plain HTTP/1. */
+  run_hl("PRI * HTTP/1.1\r\n\r\n", 64, out, &lexer);
+  assert(strcmp(out, "<msg>[PRI][*]<header_end><msg_end><eagain>") == 0);
+  run_hl("PRI /* HTTP/2.0\r\n\r\nSM\r\n\r\n", 64, out, &lexer);
+  assert(strstr(out, "<upgrade>") == NULL);
+  run_hl("PRIX * HTTP/2.0\r\n\r\nSM\r\n\r\n", 64, out, &lexer);
+  assert(strstr(out, "<upgrade>") == NULL);
+  run_hl("PRI * HTTP/2.0\r\n\r\nXX\r\n\r\n", 64, out, &lexer);
+  assert(strcmp(out, "<msg>[PRI][*]<error>") == 0);
+
+  /* Upgrade: h2c. The body is read before switching. */
+  s = "POST /up HTTP/1.1\r\n"
+      "Connection: Upgrade, HTTP2-Settings\r\n"
+      "Upgrade: h2c\r\n"
+      "HTTP2-Settings: AAMAAABkAAQAAP__\r\n"
+      "Content-Length: 4\r\n"
+      "\r\n"
+      "body"
+      HL2_PREFACE_STR;
+  len = strlen(s);
+  for (chunk = 1; chunk <= len; chunk++) {
+    off = run_hl(s, chunk, out, &lexer);
+    assert(strcmp(out, "<msg>[POST][/up]"
+                       "[Connection][Upgrade, HTTP2-Settings]"
+                       "[Upgrade][h2c]"
+                       "[HTTP2-Settings][AAMAAABkAAQAAP__]"
+                       "[Content-Length][4]"
+                       "<header_end>{body}<msg_end><upgrade>") == 0);
+    assert(lexer.upgrade == HL_UPGRADE_H2C);
+    assert(strcmp(s + off, HL2_PREFACE_STR) == 0);
+  }
+  hl2_req_init(&lexer2);
+  token = hl2_execute(&lexer2, s + off, len - off);
+  assert(token.kind == HL2_PREFACE);
+
+  /* Without HTTP2-Settings the server must stay on HTTP/1. */
+  run_hl("GET / HTTP/1.1\r\nUpgrade: h2c\r\n\r\n"
+         "GET / HTTP/1.1\r\n\r\n", 64, out, &lexer);
+  assert(strcmp(out, "<msg>[GET][/][Upgrade][h2c]<header_end><msg_end>"
+                     "<msg>[GET][/]<header_end><msg_end><eagain>") == 0);
+
+  /* Other upgrades end HTTP right after the header. */
+  off = run_hl("GET /ws HTTP/1.1\r\nUpgrade: websocket\r\n\r\nframes", 64,
+               out, &lexer);
+  assert(strcmp(out, "<msg>[GET][/ws][Upgrade][websocket]<header_end>"
+                     "<msg_end><upgrade>") == 0);
+  assert(lexer.upgrade == HL_UPGRADE_OTHER && off == 40);
+}
+
+/* Writes a WebSocket frame with a 7, 16 (len_bytes = 2) or 64 (len_bytes =
+ * 8) bit length, masked with key unless key is NULL.
+ */
+char* ws_frame(char* p, int b0, int len_bytes, const char* key,
+               const char* payload, size_t len) {
+  int i;
+
+  *p++ = (char)b0;
+  if (len_bytes == 0) {
+    *p++ = (char)len;
+  } else {
+    *p++ = len_bytes == 2 ? 126 : 127;
+    for (i = len_bytes - 1; i >= 0; i--) *p++ = (char)(len >> (i * 8));
+  }
+  if (key) {
+    p[-1 - len_bytes] |= 0x80;
+    memcpy(p, key, 4);
+    p += 4;
+  }
+  for (i = 0; i < (int)len; i++) {
+    *p++ = key ? payload[i] ^ key[i % 4] : payload[i];
+  }
+  return p;
+}
+
+/* Lexes a copy of s, len bytes, in pieces of at most chunk bytes and writes
+ * the tokens to out.
+ */
+hl_ws_token run_ws(hl_ws* ws, const char* s, size_t len, size_t chunk,
+                   char* out) {
+  char copy[1024];
+  char* b = copy;
+  char* end;
+  hl_ws_token token;
+  int last_partial = 0;
+
+  memcpy(copy, s, len);
+  *out = '\0';
+  for (end = b; end < copy + len;) {
+    end = MIN(end + chunk, copy + len);
+    for (;;) {
+      token = hl_ws_execute(ws, b, end - b);
+      if (token.kind == HL_WS_EAGAIN) break;
+      if (token.kind == HL_WS_ERROR) return token;
+
+      switch (token.kind) {
+        case HL_WS_FRAME_START:
+          out += sprintf(out, "<%d %d %d %d>", token.opcode, token.fin,
+                         (int)token.length, token.message);
+          break;
+        case HL_WS_PAYLOAD:
+          if (!last_partial) *out++ = '{';
+          memcpy(out, token.start, token.end - token.start);
+          out += token.end - token.start;
+          if (!token.partial) *out++ = '}';
+          *out = '\0';
+          break;
+        case HL_WS_FRAME_END:
+          strcat(out, "</>");
+          out += 3;
+          break;
+        default:
+          assert(0);
+      }
+      last_partial = token.partial;
+      b = (char*)token.end;
+      if (token.partial && b == end) break;
+    }
+    b = end;
+  }
+  return token;
+}
+
+void manual_test_ws() {
+  static const char key[] = "\x37\xfa\x21\x3d";
+  char s[1024];
+  char big[300];
+  char expected[1024];
+  char out[1024];
+  char a[128], b[128];
+  char* p = s;
+  size_t len, chunk, i, off;
+  hl_ws ws;
+  hl_ws_token token;
+
+  for (i = 0; i < sizeof(big); i++) big[i] = 'a' + i % 26;
+
+  /* A fragmented text message with a ping in the middle. */
+  p = ws_frame(p, HL_WS_TEXT, 0, key, "Hello, ", 7);
+  p = ws_frame(p, 0x80 | HL_WS_PING, 0, key, "ping", 4);
+  p = ws_frame(p, 0x80 | HL_WS_CONTINUATION, 0, key, "world", 5);
+  p = ws_frame(p, 0x80 | HL_WS_BINARY, 2, key, big, 300);
+  p = ws_frame(p, 0x80 | HL_WS_BINARY, 8, key, "64", 2);
+  p = ws_frame(p, 0x80 | HL_WS_PONG, 0, key, "", 0);
+  p = ws_frame(p, 0x80 | HL_WS_CLOSE, 0, key, "\x03\xe8" "bye", 5);
+  len = p - s;
+
+  sprintf(expected, "<1 0 7 1>{Hello, }</><9 1 4 9>{ping}</>"
+                    "<0 1 5 1>{world}</><2 1 300 2>{%.300s}</>"
+                    "<2 1 2 2>{64}</><10 1 0 10></>"
+                    "<8 1 5 8>{\x03\xe8" "bye}</>", big);
+  for (chunk = 1; chunk <= len; chunk++) {
+    hl_ws_server_init(&ws);
+    token = run_ws(&ws, s, len, chunk, out);
+    assert(token.kind == HL_WS_EAGAIN);
+    if (strcmp(out, expected) != 0) {
+      printf("ws chunk = %d\n%s\n", (int)chunk, out);
+      abort();
+    }
+  }
+
+  /* Servers don't mask. */
+  p = ws_frame(s, 0x80 | HL_WS_TEXT, 0, NULL, "hi", 2);
+  hl_ws_client_init(&ws);
+  token = run_ws(&ws, s, p - s, 64, out);
+  assert(token.kind == HL_WS_EAGAIN && strcmp(out, "<1 1 2 1>{hi}</>") == 0);
+
+  /* Errors. */
+#define EXPECT_WS_ERROR(b0, len_bytes, k, payload, n, code) \
+  do { \
+    p = ws_frame(s, b0, len_bytes, k, payload, n); \
+    hl_ws_server_init(&ws); \
+    token = run_ws(&ws, s, p - s, 64, out); \
+    assert(token.kind == HL_WS_ERROR && token.value == code); \
+  } while (0)
+
+  EXPECT_WS_ERROR(0x80 | HL_WS_TEXT, 0, NULL, "hi", 2,
+                  HL_WS_PROTOCOL_ERROR); /* unmasked */
+  EXPECT_WS_ERROR(0x80 | HL_WS_CONTINUATION, 0, key, "hi", 2,
+                  HL_WS_PROTOCOL_ERROR); /* nothing to continue */
+  EXPECT_WS_ERROR(HL_WS_PING, 0, key, "hi", 2,
+                  HL_WS_PROTOCOL_ERROR); /* fragmented control frame */
+  EXPECT_WS_ERROR(0x80 | HL_WS_PING, 2, key, big, 126,
+                  HL_WS_PROTOCOL_ERROR); /* control frame too long */
+  EXPECT_WS_ERROR(0x80 | 0x3, 0, key, "hi", 2,
+                  HL_WS_PROTOCOL_ERROR); /* reserved opcode */
+  EXPECT_WS_ERROR(0x80 | 0x40 | HL_WS_TEXT, 0, key, "hi", 2,
+                  HL_WS_PROTOCOL_ERROR); /* RSV1 */
+
+  /* A new message before the last one is finished. */
+  p = ws_frame(s, HL_WS_TEXT, 0, key, "a", 1);
+  p = ws_frame(p, HL_WS_TEXT, 0, key, "b", 1);
+  hl_ws_server_init(&ws);
+  token = run_ws(&ws, s, p - s, 64, out);
+  assert(token.kind == HL_WS_ERROR && token.value == HL_WS_PROTOCOL_ERROR);
+
+  /* 64 bit length with the top bit set. */
+  memcpy(s, "\x82\xff\x80\x00\x00\x00\x00\x00\x00\x01", 10);
+  hl_ws_server_init(&ws);
+  token = run_ws(&ws, s, 14, 64, out);
+  assert(token.kind == HL_WS_ERROR && token.value == HL_WS_PROTOCOL_ERROR);
+
+  /* The handshake, then frames. */
+  {
+    static const char req[] =
+        "GET /chat HTTP/1.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    hl_lexer lexer;
+
+    for (chunk = 1; chunk <= sizeof(req) - 1; chunk++) {
+      off = run_hl(req, chunk, out, &lexer);
+      assert(off == sizeof(req) - 1);
+      assert(lexer.upgrade == HL_UPGRADE_WEBSOCKET);
+    }
+    run_hl("GET /chat HTTP/1.1\r\nUpgrade: websocket\r\n"
+           "Sec-WebSocket-Version: 13\r\n\r\n", 64, out, &lexer);
+    assert(lexer.upgrade == HL_UPGRADE_OTHER); /* no key */
+    run_hl("GET /chat HTTP/1.1\r\nUpgrade: websocket\r\n"
+           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+           "Sec-WebSocket-Version: 8\r\n\r\n", 64, out, &lexer);
+    assert(lexer.upgrade == HL_UPGRADE_OTHER); /* old version */
+    run_hl("GET /chat HTTP/1.1\r\nUpgrade: websocket\r\n"
+           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+           "Content-Lengthversion: 13\r\n\r\n", 64, out, &lexer);
+    assert(lexer.upgrade == HL_UPGRADE_OTHER); /* not the version header */
+  }
+
+  /* hl_ws_mask() against a byte at a time, at every length and offset. */
+  for (len = 0; len < sizeof(a); len++) {
+    for (off = 0; off < 4; off++) {
+      for (i = 0; i < len; i++) a[i] = b[i] = (char)(i * 7);
+      hl_ws_mask(a, len, (const unsigned char*)key, off);
+      for (i = 0; i < len; i++) b[i] ^= key[(off + i) % 4];
+      assert(memcmp(a, b, len) == 0);
+    }
+  }
+}
+
+/* Feeds len bytes of s to a PROXY lexer in pieces of at most chunk bytes and
+ * joins the HL_PROXY token into header. Returns the offset of HL_MSG_START,
+ * or -1 on HL_ERROR.
+ */
+int run_proxy(const char* s, size_t len, size_t chunk, char* header,
+              size_t* header_len) {
+  const char* end = s + len;
+  const char* b = s;
+  const char* buf_end;
+  hl_lexer lexer;
+  hl_token token;
+
+  hl_req_init_proxy(&lexer);
+  *header_len = 0;
+  for (buf_end = MIN(b + chunk, end);; buf_end = MIN(buf_end + chunk, end)) {
+    for (;;) {
+      token = hl_execute(&lexer, b, buf_end - b);
+      if (token.kind == HL_ERROR) return -1;
+      if (token.kind == HL_MSG_START) return token.start - s;
+      if (token.kind == HL_EAGAIN) break;
+      assert(token.kind == HL_PROXY);
+      memcpy(header + *header_len, token.start, token.end - token.start);
+      *header_len += token.end - token.start;
+      b = token.end;
+      if (token.partial && b == buf_end) break;
+    }
+    b = buf_end;
+    if (buf_end == end) return -1;
+  }
+}
+
+void manual_test_proxy() {
+  static const char v1[] =
+      "PROXY TCP4 192.0.2.1 198.51.100.17 56324 443\r\n";
+  static const char v6[] =
+      "PROXY TCP6 2001:db8::1 ::ffff:198.51.100.7 65535 8080\r\n";
+  static const char v2[] =
+      "\r\n\r\n\0\r\nQUIT\n" "\x21\x11\x00\x12"
+      "\xc0\x00\x02\x01" "\xc6\x33\x64\x11" "\xdc\x04" "\x01\xbb"
+      "\x04\x00\x03" "abc"; /* PP2_TYPE_NOOP */
+  static const char local[] = "\r\n\r\n\0\r\nQUIT\n" "\x20\x00\x00\x00";
+  static const char req[] = "GET / HTTP/1.1\r\n\r\n";
+  char s[512];
+  char header[512];
+  char unix_v2[16 + 216];
+  size_t header_len, chunk, len;
+  hl_proxy proxy;
+
+  /* v1, at every chunk size. */
+  len = sizeof(v1) - 1;
+  memcpy(s, v1, len);
+  memcpy(s + len, req, sizeof(req));
+  for (chunk = 1; chunk <= len + 1; chunk++) {
+    assert(run_proxy(s, strlen(s), chunk, header, &header_len) == (int)len);
+    assert(header_len == len && memcmp(header, v1, len) == 0);
+  }
+  assert(hl_proxy_parse(header, header_len, &proxy) == 0);
+  assert(proxy.version == 1 && proxy.family == HL_PROXY_TCP4);
+  assert(memcmp(proxy.src_addr, "\xc0\x00\x02\x01", 4) == 0);
+  assert(memcmp(proxy.dst_addr, "\xc6\x33\x64\x11", 4) == 0);
+  assert(proxy.src_port == 56324 && proxy.dst_port == 443);
+  assert(proxy.tlv.start == NULL);
+
+  assert(hl_proxy_parse(v6, sizeof(v6) - 1, &proxy) == 0);
+  assert(proxy.family == HL_PROXY_TCP6);
+  assert(memcmp(proxy.src_addr, "\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x01",
+                16) == 0);
+  assert(memcmp(proxy.dst_addr, "\0\0\0\0\0\0\0\0\0\0\xff\xff\xc6\x33\x64\x07",
+                16) == 0);
+  assert(proxy.src_port == 65535 && proxy.dst_port == 8080);
+
+#define PROXY_OK(s) \
+  assert(hl_proxy_parse(s, sizeof(s) - 1, &proxy) == 0)
+#define PROXY_BAD(s) \
+  assert(hl_proxy_parse(s, sizeof(s) - 1, &proxy) == -1)
+
+  PROXY_OK("PROXY UNKNOWN\r\n");
+  assert(proxy.family == HL_PROXY_UNSPEC);
+  PROXY_OK("PROXY UNKNOWN ffff:f...f:ffff 1.2.3.4 0 0\r\n");
+  PROXY_OK("PROXY TCP6 :: 1:2:3:4:5:6:7:8 1 2\r\n");
+  PROXY_OK("PROXY TCP6 1:2:3:4:5:6:7:: ::8 1 2\r\n");
+  assert(proxy.dst_addr[15] == 8 && proxy.src_addr[13] == 7);
+  PROXY_BAD("PROXY TCP4 192.0.2.1 198.51.100.17 56324 443\n");
+  PROXY_BAD("PROXY TCP4 192.0.2 198.51.100.17 56324 443\r\n");
+  PROXY_BAD("PROXY TCP4 192.0.2.256 198.51.100.17 56324 443\r\n");
+  PROXY_BAD("PROXY TCP4 192.0.2.1 198.51.100.17 65536 443\r\n");
+  PROXY_BAD("PROXY TCP4 192.0.2.1  198.51.100.17 56324 443\r\n");
+  PROXY_BAD("PROXY TCP4 192.0.2.1 198.51.100.17 56324\r\n");
+  PROXY_BAD("PROXY TCP4 192.0.2.1 198.51.100.17 56324 443 \r\n");
+  PROXY_BAD("PROXY TCP5 192.0.2.1 198.51.100.17 56324 443\r\n");
+  PROXY_BAD("PROXY TCP6 1::2::3 ::1 1 2\r\n");
+  PROXY_BAD("PROXY TCP6 1:2:3:4:5:6:7:8:9 ::1 1 2\r\n");
+  PROXY_BAD("PROXY TCP6 ::1:2:3:4:5:6:7:8 ::1 1 2\r\n");
+  PROXY_BAD("PROXY TCP6 :1 ::1 1 2\r\n");
+  PROXY_BAD("PROXY TCP6 1: ::1 1 2\r\n");
+  PROXY_BAD("PROXY TCP6 12345:: ::1 1 2\r\n");
+
+  /* v2, at every chunk size. */
+  len = sizeof(v2) - 1;
+  memcpy(s, v2, len);
+  memcpy(s + len, req, sizeof(req));
+  for (chunk = 1; chunk <= len + 1; chunk++) {
+    assert(run_proxy(s, len + sizeof(req) - 1, chunk, header, &header_len) ==
+           (int)len);
+    assert(header_len == len && memcmp(header, v2, len) == 0);
+  }
+  assert(hl_proxy_parse(header, header_len, &proxy) == 0);
+  assert(proxy.version == 2 && proxy.family == HL_PROXY_TCP4);
+  assert(memcmp(proxy.src_addr, "\xc0\x00\x02\x01", 4) == 0);
+  assert(memcmp(proxy.dst_addr, "\xc6\x33\x64\x11", 4) == 0);
+  assert(proxy.src_port == 56324 && proxy.dst_port == 443);
+  assert(proxy.tlv.end - proxy.tlv.start == 6 && proxy.tlv.start[0] == 4);
+
+  /* A health check. */
+  len = sizeof(local) - 1;
+  memcpy(s, local, len);
+  memcpy(s + len, req, sizeof(req));
+  assert(run_proxy(s, len + sizeof(req) - 1, 64, header, &header_len) ==
+         (int)len);
+  assert(hl_proxy_parse(header, header_len, &proxy) == 0);
+  assert(proxy.version == 2 && proxy.family == HL_PROXY_UNSPEC);
+
+  /* UNIX sockets. */
+  memset(unix_v2, 0, sizeof(unix_v2));
+  memcpy(unix_v2, "\r\n\r\n\0\r\nQUIT\n" "\x21\x31\x00\xd8", 16);
+  strcpy(unix_v2 + 16, "/run/lb.sock");
+  strcpy(unix_v2 + 16 + 108, "/run/app.sock");
+  assert(hl_proxy_parse(unix_v2, sizeof(unix_v2), &proxy) == 0);
+  assert(proxy.family == HL_PROXY_UNIX_STREAM);
+  assert(proxy.src_path.end - proxy.src_path.start == 12);
+  assert(memcmp(proxy.dst_path.start, "/run/app.sock", 13) == 0);
+  assert(proxy.dst_path.end - proxy.dst_path.start == 13);
+
+  PROXY_BAD("\r\n\r\n\0\r\nQUIT\n" "\x21\x11\x00\x04" "\0\0\0\0");
+  PROXY_BAD("\r\n\r\n\0\r\nQUIT\n" "\x21\x41\x00\x00");
+  PROXY_BAD("\r\n\r\n\0\r\nQUIT\n" "\x21\x11\x00\x0c" "\0\0\0\0");
+
+  /* The lexer wants a PROXY header first, and a sane one. */
+  assert(run_proxy(req, sizeof(req) - 1, 64, header, &header_len) == -1);
+  memcpy(s, "\r\n\r\n\0\r\nQUIT\n" "\x11\x11\x00\x00", 16);
+  assert(run_proxy(s, 16, 64, header, &header_len) == -1);
+  memset(s, 'x', sizeof(s));
+  memcpy(s, "PROXY UNKNOWN ", 14);
+  memcpy(s + 105, "\r\nGET", 5);
+  assert(run_proxy(s, 110, 64, header, &header_len) == 105 + 2);
+  memcpy(s + 105, "x\r\nGET", 6);
+  assert(run_proxy(s, 111, 64, header, &header_len) == -1);
+}
+
+/* Joins the elements of a list as "token(params)q|". */
+void list_str(const char* value, char* out) {
+  hl_span list;
+  hl_list_item item;
+
+  list.start = value;
+  list.end = value + strlen(value);
+  *out = '\0';
+  while (hl_list_next(&list, &item)) {
+    out += sprintf(out, "%.*s", (int)(item.token.end - item.token.start),
+                   item.token.start);
+    if (item.params.start) {
+      out += sprintf(out, "(%.*s)", (int)(item.params.end - item.params.start),
+                     item.params.start);
+    }
+    out += sprintf(out, "%u|", item.q);
+  }
+  assert(list.start == list.end);
+}
+
+void manual_test_list() {
+  char out[1024];
+  hl_lexer lexer;
+
+  list_str("", out);
+  assert(strcmp(out, "") == 0);
+  list_str(" , ,\t", out);
+  assert(strcmp(out, "") == 0);
+  list_str("gzip", out);
+  assert(strcmp(out, "gzip1000|") == 0);
+  list_str("br;q=1.0, gzip;q=0.8 ,, identity; q=0 ", out);
+  assert(strcmp(out, "br(q=1.0)1000|gzip(q=0.8)800|identity(q=0)0|") == 0);
+  list_str("text/html;level=1;Q=0.125,*/*;q=0.1", out);
+  assert(strcmp(out, "text/html(level=1;Q=0.125)125|*/*(q=0.1)100|") == 0);
+  list_str("a;q=1.5, b;q=0.1234, c;q=, d;q=x, e;qq=0", out);
+  assert(strcmp(out, "a(q=1.5)0|b(q=0.1234)0|c(q=)0|d(q=x)0|e(qq=0)1000|")
+         == 0);
+  list_str("a;x=\"1,2\\\",3\";q=0.5, b", out);
+  assert(strcmp(out, "a(x=\"1,2\\\",3\";q=0.5)500|b1000|") == 0);
+  list_str("a;", out);
+  assert(strcmp(out, "a()1000|") == 0);
+
+  /* The lexer matches each element of Connection and Transfer-Encoding. */
+#define LIST_REQ(version, headers) \
+  run_hl("GET / HTTP/" version "\r\n" headers "\r\n" \
+         "GET / HTTP/1.1\r\n\r\n", 64, out, &lexer)
+
+  LIST_REQ("1.0", "Connection: keep-alive, Upgrade\r\n");
+  assert(strstr(out, "<eof>") == NULL);
+  LIST_REQ("1.0", "Connection: Upgrade,\tKeep-Alive ; x\r\n");
+  assert(strstr(out, "<eof>") == NULL);
+  LIST_REQ("1.0", "Connection: keep-alive-not\r\n");
+  assert(strstr(out, "<eof>") != NULL);
+  LIST_REQ("1.1", "Connection: foo, close\r\n");
+  assert(strstr(out, "<eof>") != NULL);
+  LIST_REQ("1.1", "Connection: closed, cl\r\n");
+  assert(strstr(out, "<eof>") == NULL);
+
+#define TE_REQ(headers) \
+  run_hl("POST / HTTP/1.1\r\n" headers "\r\n" \
+         "3\r\nabc\r\n0\r\n\r\n", 64, out, &lexer)
+
+  TE_REQ("Transfer-Encoding: gzip, chunked\r\n");
+  assert(strstr(out, "{abc}<msg_end>") != NULL);
+  TE_REQ("Transfer-Encoding: gzip\r\nTransfer-Encoding: Chunked \r\n");
+  assert(strstr(out, "{abc}<msg_end>") != NULL);
+  TE_REQ("Transfer-Encoding: chunked, gzip\r\n");
+  assert(strstr(out, "{abc}") == NULL);
+  TE_REQ("Transfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n");
+  assert(strstr(out, "{abc}") == NULL);
+  TE_REQ("Transfer-Encoding: chunkedx\r\n");
+  assert(strstr(out, "{abc}") == NULL);
+}
+
+/* Joins the pairs of a Cookie value as "name=value|", or "name|" without a
+ * value. With set, only the cookies found, as "index:name=value|".
+ */
+void cookie_str(const char* value, const hl_cookie_set* set, char* out) {
+  hl_span cookies;
+  hl_cookie cookie;
+  int i = 1;
+
+  cookies.start = value;
+  cookies.end = value + strlen(value);
+  *out = '\0';
+  while (set ? (i = hl_cookie_find(&cookies, set, &cookie))
+             : hl_cookie_next(&cookies, &cookie)) {
+    if (set) out += sprintf(out, "%d:", i - 1);
+    out += sprintf(out, "%.*s", (int)(cookie.name.end - cookie.name.start),
+                   cookie.name.start);
+    if (cookie.value.start) {
+      out += sprintf(out, "=%.*s",
+                     (int)(cookie.value.end - cookie.value.start),
+                     cookie.value.start);
+    }
+    *out++ = '|';
+    *out = '\0';
+  }
+  assert(cookies.start == cookies.end);
+}
+
+void manual_test_cookie() {
+  static const char* const names[] = { "session", "s", "lang" };
+  char big[8192];
+  char out[8192];
+  char* p;
+  int i;
+  hl_cookie_set set;
+
+  cookie_str("", NULL, out);
+  assert(strcmp(out, "") == 0);
+  cookie_str("a=1", NULL, out);
+  assert(strcmp(out, "a=1|") == 0);
+  cookie_str("a=1; b=2;c=3", NULL, out);
+  assert(strcmp(out, "a=1|b=2|c=3|") == 0);
+  cookie_str(" ;; a = 1 ;\tflag; e=; q=\"x y\"; h=\"; ", NULL, out);
+  assert(strcmp(out, "a=1|flag|e=|q=x y|h=\"|") == 0);
+  cookie_str("b64=YWJj==; url=a=b", NULL, out);
+  assert(strcmp(out, "b64=YWJj==|url=a=b|") == 0);
+
+  hl_cookie_set_init(&set, names, 3);
+  cookie_str("a=1; session=abc; sess=no; lang=en; s=2; sessions=3", &set,
+             out);
+  assert(strcmp(out, "0:session=abc|2:lang=en|1:s=2|") == 0);
+  cookie_str("x=1; y=2", &set, out);
+  assert(strcmp(out, "") == 0);
+
+  /* Long enough for the vector loops, with the wanted cookie last. */
+  p = big;
+  for (i = 0; i < 100; i++) p += sprintf(p, "cookie%d=%040d; ", i, i);
+  strcpy(p, "session=\"xyz\"");
+  cookie_str(big, &set, out);
+  assert(strcmp(out, "0:session=xyz|") == 0);
+  cookie_str(big, NULL, out);
+  assert(strncmp(out, "cookie0=0000", 12) == 0);
+  assert(strstr(out, "|cookie99=") && strstr(out, "|session=xyz|"));
+}
+
+void manual_test_header_set() {
+  static const char* const names[] = { "Host", "content-type", "X-Wanted" };
+  static const char chunked[] =
+      "POST /a HTTP/1.1\r\n"
+      "Host: example.org\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101\r\n"
+      "Accept: text/html,application/xhtml+xml;q=0.9,*/*;q=0.8\r\n"
+      "X-Wanted-Not: 1\r\n"
+      "Hos: 2\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "CONTENT-TYPE: text/plain\r\n"
+      "X-Wanted:\r\n"
+      "\r\n"
+      "3\r\nabc\r\n0\r\n"
+      "Host: trailer\r\n"
+      "\r\n"
+      "GET /b HTTP/1.1\r\n"
+      "Content-Length: 2\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "xy";
+  char out[1024];
+  size_t chunk;
+  hl_header_set set;
+  hl_lexer lexer;
+  hl_token token;
+
+  assert(hl_header_set_init(&set, names, 3) == 0);
+  for (chunk = 1; chunk <= sizeof(chunked) - 1; chunk++) {
+    hl_req_init(&lexer);
+    hl_set_headers(&lexer, &set);
+    run_hl_inited(chunked, chunk, out, &lexer);
+    if (strcmp(out, "<msg>[POST][/a][Host][example.org]"
+                    "[CONTENT-TYPE][text/plain][X-Wanted][]<header_end>"
+                    "{abc}[Host][trailer]<msg_end>"
+                    "<msg>[GET][/b]<header_end>{xy}<msg_end><eof>") != 0) {
+      printf("header set chunk = %d\n%s\n", (int)chunk, out);
+      abort();
+    }
+  }
+
+  /* lexer->field says which one it is. */
+  hl_req_init(&lexer);
+  hl_set_headers(&lexer, &set);
+  token = hl_execute(&lexer, chunked, sizeof(chunked) - 1);
+  while (token.kind != HL_FIELD) {
+    token = hl_execute(&lexer, token.end, chunked + sizeof(chunked) - 1 -
+                                           token.end);
+  }
+  assert(lexer.field == 1);
+  do {
+    token = hl_execute(&lexer, token.end, chunked + sizeof(chunked) - 1 -
+                                          token.end);
+  } while (token.kind != HL_FIELD);
+  assert(lexer.field == 2);
+
+  /* A wanted name split between reads is held back. */
+  hl_req_init(&lexer);
+  hl_set_headers(&lexer, &set);
+  token = hl_execute(&lexer, chunked, 20);
+  while (token.kind != HL_EAGAIN) {
+    token = hl_execute(&lexer, token.end, chunked + 20 - token.end);
+  }
+  assert(token.end == chunked + 18); /* "Ho" */
+  token = hl_execute(&lexer, token.end, 22);
+  assert(token.kind == HL_FIELD && token.start == chunked + 18);
+  while (token.kind != HL_EAGAIN) {
+    token = hl_execute(&lexer, token.end, chunked + 40 - token.end);
+  }
+  assert(token.end == chunked + 40); /* "Use" can't be wanted. */
+
+  /* An empty set skips every field. */
+  hl_header_set_init(&set, names, 0);
+  hl_req_init(&lexer);
+  hl_set_headers(&lexer, &set);
+  run_hl_inited("GET / HTTP/1.1\r\nHost: a\r\n\r\n", 5, out, &lexer);
+  assert(strcmp(out, "<msg>[GET][/]<header_end><msg_end><eagain>") == 0);
+
+  assert(hl_header_set_init(&set, names, HL_HEADER_SET_MAX + 1) == -1);
+}
+
+void manual_test_method() {
+  static const char* const names[] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE",
+    "PATCH", "COPY", "LOCK", "MKCOL", "MOVE", "PROPFIND", "PROPPATCH",
+    "SEARCH", "UNLOCK", "REPORT", "MKACTIVITY", "CHECKOUT", "MERGE",
+    "M-SEARCH", "NOTIFY", "SUBSCRIBE", "UNSUBSCRIBE", "PURGE",
+    "GE", "GETS", "PROP", "PROPFINDX", "UNSUBSCRIBED", "M-", "X-LONG-METHOD",
+    "post", "Get"
+  };
+  char s[128];
+  char out[1024];
+  char expected[1024];
+  size_t i, chunk;
+  hl_lexer lexer;
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    sprintf(s, "%s /x HTTP/1.1\r\nA: b\r\n\r\n", names[i]);
+    sprintf(expected, "<msg>[%s][/x][A][b]<header_end><msg_end><eagain>",
+            names[i]);
+    for (chunk = 1; chunk <= strlen(s); chunk++) {
+      run_hl(s, chunk, out, &lexer);
+      assert(strcmp(out, expected) == 0);
+      assert(lexer.method == method_id(names[i]));
+      assert(lexer.version_major == 1 && lexer.version_minor == 1);
+    }
+  }
+
+  /* Versions other than the usual go the long way. */
+  run_hl("GET / HTTP/1.0\r\n\r\n", 64, out, &lexer);
+  assert(lexer.version_major == 1 && lexer.version_minor == 0);
+  run_hl("GET / HTTP/1.1 \r\n\r\n", 64, out, &lexer);
+  assert(lexer.version_major == 1 && lexer.version_minor == 1);
+  assert(strcmp(out, "<msg>[GET][/]<header_end><msg_end><eagain>") == 0);
+  run_hl("GET / HTTP/1.1\n\r\n", 64, out, &lexer);
+  assert(lexer.version_major == 1 && lexer.version_minor == 1);
+  assert(strcmp(out, "<msg>[GET][/]<header_end><msg_end><eagain>") == 0);
+  run_hl("GET / HTTP/1.2\r\n\r\n", 64, out, &lexer);
+  assert(lexer.version_major == 1 && lexer.version_minor == 2);
+  run_hl("GET / HTTP/1.1\r\r\n", 64, out, &lexer);
+  assert(strcmp(out, "<msg>[GET][/]<error>") == 0);
+
+  /* Bad bytes in the method are caught on both paths. */
+  run_hl("GE\x01 / HTTP/1.1\r\n\r\n", 64, out, &lexer);
+  assert(strcmp(out, "<msg><error>") == 0);
+  run_hl("GE\x01 / HTTP/1.1\r\n\r\n", 1, out, &lexer);
+  assert(strcmp(out, "<msg>[GE<error>") == 0);
+}
+
+void manual_test_tokens() {
+  static const char pipelined[] =
+      "POST /a HTTP/1.1\r\n"
+      "Host: example.org\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n"
+      "3\r\nabc\r\n0\r\n"
+      "X-Trailer: 1\r\n"
+      "\r\n"
+      "GET /b?c=d HTTP/1.1\r\n"
+      "Content-Length: 2\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "xy";
+  char out[1024];
+  size_t chunk;
+  hl_lexer lexer;
+  hl_token token;
+  int calls;
+
+  for (chunk = 1; chunk <= sizeof(pipelined) - 1; chunk++) {
+    /* An access log. */
+    hl_req_init(&lexer);
+    hl_set_tokens(&lexer, HL_TOKEN_BIT(HL_METHOD) | HL_TOKEN_BIT(HL_URL) |
+                          HL_TOKEN_BIT(HL_MSG_END));
+    run_hl_inited(pipelined, chunk, out, &lexer);
+    if (strcmp(out, "[POST][/a]<msg_end>[GET][/b?c=d]<msg_end><eof>") != 0) {
+      printf("tokens chunk = %d\n%s\n", (int)chunk, out);
+      abort();
+    }
+
+    /* A load shedder. */
+    hl_req_init(&lexer);
+    hl_set_tokens(&lexer, HL_TOKEN_BIT(HL_HEADER_END));
+    run_hl_inited(pipelined, chunk, out, &lexer);
+    assert(strcmp(out, "<header_end><header_end><eof>") == 0);
+
+    /* Suppressed bodies are still counted. */
+    hl_req_init(&lexer);
+    hl_set_tokens(&lexer, HL_TOKEN_BIT(HL_FIELD) | HL_TOKEN_BIT(HL_VALUE));
+    run_hl_inited(pipelined, chunk, out, &lexer);
+    assert(strcmp(out, "[Host][example.org][Transfer-Encoding][chunked]"
+                       "[X-Trailer][1][Content-Length][2]"
+                       "[Connection][close]<eof>") == 0);
+  }
+
+  /* The whole stream in one call per request. */
+  hl_req_init(&lexer);
+  hl_set_tokens(&lexer, HL_TOKEN_BIT(HL_MSG_END));
+  token = hl_execute(&lexer, pipelined, sizeof(pipelined) - 1);
+  for (calls = 1; token.kind == HL_MSG_END; calls++) {
+    token = hl_execute(&lexer, token.end,
+                       pipelined + sizeof(pipelined) - 1 - token.end);
+  }
+  assert(token.kind == HL_EOF && calls == 3);
+
+  /* Errors, EOF and upgrades can't be suppressed. */
+  hl_req_init(&lexer);
+  hl_set_tokens(&lexer, 0);
+  run_hl_inited("GET / HTTP/1.1\r\n\r\nGET /\x01", 64, out, &lexer);
+  assert(strcmp(out, "<error>") == 0);
+  hl_req_init(&lexer);
+  hl_set_tokens(&lexer, 0);
+  assert(run_hl_inited("GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n\r\nxyz",
+                       7, out, &lexer) == 131);
+  assert(strcmp(out, "<upgrade>") == 0);
+  assert(lexer.upgrade == HL_UPGRADE_WEBSOCKET);
+  hl_req_init(&lexer);
+  hl_set_tokens(&lexer, 0);
+  run_hl_inited("GET / HTTP/1.1\r\n", 64, out, &lexer);
+  assert(strcmp(out, "<eagain>") == 0);
+}
+
+/* Runs s through a lexer with limits, in pieces of chunk bytes. Returns
+ * lexer->error, or HL_ERR_NONE if it lexed to the end.
+ */
+int run_limits(const char* s, const hl_limits* limits,
+               const hl_header_set* set, size_t chunk) {
+  char out[1024];
+  hl_lexer lexer;
+
+  hl_req_init(&lexer);
+  hl_set_limits(&lexer, limits);
+  if (set) hl_set_headers(&lexer, set);
+  run_hl_inited(s, chunk, out, &lexer);
+  if (strstr(out, "<error>")) {
+    assert(lexer.error != HL_ERR_NONE);
+    return lexer.error;
+  }
+  assert(lexer.error == HL_ERR_NONE);
+  return HL_ERR_NONE;
+}
+
+void manual_test_limits() {
+  static const char* const names[] = { "Host" };
+  static const struct {
+    const char* s;
+    int ok; /* at the limit */
+    int over; /* one byte, field or chunk under it */
+  } cases[] = {
+    { "GET /abcd HTTP/1.1\r\n\r\n", 0, HL_ERR_URL_TOO_LONG },
+    { "GET / HTTP/1.1\r\nAbc: 12345\r\n\r\n", 0, HL_ERR_HEADER_TOO_LARGE },
+    { "GET / HTTP/1.1\r\nA: b\r\n\r\n", 0, HL_ERR_HEADER_TOO_LARGE },
+    { "POST / HTTP/1.1\r\nA: 1\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "3;a=b\r\nabc\r\n0\r\nB: 1\r\nC: 2\r\n\r\n",
+      0, HL_ERR_HEADER_TOO_LARGE },
+    { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "3;a=b\r\nabc\r\n0\r\n\r\n", 0, HL_ERR_CHUNK_LINE_TOO_LONG },
+    { "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc",
+      0, HL_ERR_BODY_TOO_LARGE },
+    { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "2\r\nab\r\n1\r\nc\r\n0\r\n\r\n", 0, HL_ERR_BODY_TOO_LARGE }
+  };
+  hl_limits limits, tight;
+  hl_header_set set;
+  size_t i, chunk;
+
+  hl_limits_init(&limits);
+  assert(limits.url == 8192 && limits.body == (size_t)-1);
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    for (chunk = 1; chunk <= strlen(cases[i].s); chunk++) {
+      tight = limits;
+      switch (i) {
+        case 0: tight.url = 5; break;
+        case 1: tight.field_line = 10; break;
+        case 2: tight.header = 24; break;
+        case 3: tight.fields = 2; break;
+        case 4: tight.chunk_line = 7; break;
+        default: tight.body = 3; break;
+      }
+      assert(run_limits(cases[i].s, &tight, NULL, chunk) == cases[i].ok);
+      tight.url--;
+      tight.field_line--;
+      tight.header--;
+      tight.fields--;
+      tight.chunk_line--;
+      tight.body--;
+      if (run_limits(cases[i].s, &tight, NULL, chunk) != cases[i].over) {
+        printf("limits case %d chunk = %d\n", (int)i, (int)chunk);
+        abort();
+      }
+    }
+  }
+
+  /* Fields held back by hl_set_headers() count once. */
+  hl_header_set_init(&set, names, 1);
+  tight = limits;
+  tight.fields = 2;
+  for (chunk = 1; chunk < 32; chunk++) {
+    assert(run_limits("GET / HTTP/1.1\r\nHost: a\r\nHost: b\r\n\r\n",
+                      &tight, &set, chunk) == HL_ERR_NONE);
+  }
+
+  /* The lexer stops before a long line ends. */
+  {
+    static char s[20000];
+    char out[1024];
+    hl_lexer lexer;
+    size_t off;
+
+    strcpy(s, "GET / HTTP/1.1\r\nX: ");
+    memset(s + strlen(s), 'x', sizeof(s) - strlen(s) - 1);
+    hl_req_init(&lexer);
+    hl_set_limits(&lexer, &limits);
+    hl_set_tokens(&lexer, 0);
+    off = run_hl_inited(s, 4096, out, &lexer);
+    assert(strcmp(out, "<error>") == 0);
+    assert(lexer.error == HL_ERR_HEADER_TOO_LARGE && off <= 12288);
+  }
+
+  /* Numbers too big for the lexer, even without limits. */
+  assert(run_limits("POST / HTTP/1.1\r\n"
+                    "Content-Length: 99999999999999999999999\r\n\r\n",
+                    NULL, NULL, 64) == HL_ERR_BODY_TOO_LARGE);
+  assert(run_limits("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                    "fffffffffffffffff\r\n",
+                    NULL, NULL, 64) == HL_ERR_BODY_TOO_LARGE);
+  assert(run_limits("GET / HTTP/1.1\r\nA\x01: b\r\n", NULL, NULL, 64) ==
+         HL_ERR_FIELD);
+}
+
+void manual_test_errors() {
+  static const struct {
+    const char* s;
+    int error;
+    const char* state; /* when lexed in one piece */
+    size_t offset;
+  } cases[] = {
+    { "\x01", HL_ERR_METHOD, "S_REQ_START", 0 },
+    { "G\x01T / HTTP/1.1\r\n", HL_ERR_METHOD, "S_METHOD_START", 1 },
+    { "GET /\x01 HTTP/1.1\r\n", HL_ERR_VERSION, "S_REQ_H", 5 },
+    { "GET / HTTP/x", HL_ERR_VERSION, "S_REQ_VMAJOR", 11 },
+    { "GET / HTTP/1.1\rX", HL_ERR_LINE_END, "S_REQ_CRLF", 15 },
+    { "GET / HTTP/1.1\r\nA\x01: b\r\n", HL_ERR_FIELD, "S_FIELD", 17 },
+    { "GET / HTTP/1.1\r\n\tb\r\n", HL_ERR_OBS_FOLD, "S_FIELD_START", 16 },
+    { "GET / HTTP/1.1\r\nA: b\rX", HL_ERR_LINE_END, "S_VALUE_CRLF", 21 },
+    { "POST / HTTP/1.1\r\nContent-Length: 1x\r\n",
+      HL_ERR_CONTENT_LENGTH, "S_VALUE", 34 },
+    { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nz",
+      HL_ERR_CHUNK, "S_CHUNK_START", 47 },
+    { "PRI * HTTP/2.0\r\n\r\nXX", HL_ERR_PREFACE, "S_PREFACE", 18 },
+    { "GET / HTTP/1.1\r\n\r\nGET /\x01 ", HL_ERR_VERSION, "S_REQ_H", 23 },
+    /* These used to read lexer->match before it was set. */
+    { "GET / HTTP/1.1\r\nC: x\r\nCon: y\r\n\r\n\x01",
+      HL_ERR_METHOD, "S_REQ_START", 32 }
+  };
+  char out[1024];
+  size_t i, chunk;
+  hl_lexer lexer;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    for (chunk = 1; chunk <= strlen(cases[i].s); chunk++) {
+      assert(run_hl(cases[i].s, chunk, out, &lexer) == cases[i].offset);
+      if (lexer.error != cases[i].error || lexer.offset != cases[i].offset) {
+        printf("errors case %d chunk = %d: %d at %d\n", (int)i, (int)chunk,
+               lexer.error, (int)lexer.offset);
+        abort();
+      }
+    }
+    assert(strcmp(hl_state_name(&lexer), cases[i].state) == 0);
+  }
+
+  hl_req_init_proxy(&lexer);
+  assert(hl_execute(&lexer, "PROXY X\x01", 8).kind == HL_ERROR);
+  assert(lexer.error == HL_ERR_PROXY && lexer.offset == 7);
+  assert(strcmp(hl_state_name(&lexer), "S_PROXY_V1") == 0);
+
+  /* No error, and the offset of everything lexed. */
+  run_hl("GET / HTTP/1.1\r\n\r\n", 5, out, &lexer);
+  assert(lexer.error == HL_ERR_NONE && lexer.offset == 18);
+}
+
+void manual_test_stats() {
+  static const char s[] =
+      "POST /a HTTP/1.1\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n"
+      "3\r\nabc\r\n0\r\n\r\n"
+      "POST /b HTTP/1.1\r\n"
+      "Content-Length: 2\r\n"
+      "\r\n"
+      "xy";
+  char out[1024];
+  hl_stats stats[2], total;
+  hl_lexer lexer;
+  int k;
+
+  memset(stats, 0, sizeof(stats));
+  memset(&total, 0, sizeof(total));
+  for (k = 0; k < 2; k++) {
+    hl_req_init(&lexer);
+    hl_set_stats(&lexer, &stats[k]);
+    run_hl_inited(s, k == 0 ? 7 : sizeof(s), out, &lexer);
+  }
+  hl_stats_add(&total, &stats[0]);
+  hl_stats_add(&total, &stats[1]);
+
+#ifdef HL_STATS
+  for (k = 0; k < 2; k++) {
+    assert(stats[k].bytes == sizeof(s) - 1);
+    assert(stats[k].messages == 2);
+    assert(stats[k].chunked == 1 && stats[k].identity == 1);
+    assert(stats[k].tokens[HL_MSG_START] == 2);
+    assert(stats[k].tokens[HL_BODY] == 2);
+    assert(stats[k].tokens[HL_MSG_END] == 2);
+  }
+  assert(stats[0].partial > 0 && stats[1].partial == 0);
+  assert(stats[0].eagain > stats[1].eagain && stats[1].eagain == 1);
+  assert(total.bytes == 2 * (sizeof(s) - 1));
+  assert(total.tokens[HL_URL] == 4 && total.messages == 4);
+#else
+  assert(total.bytes == 0 && total.messages == 0);
+#endif
+}
+
+/* Lexes [b, end) into out as run_hl_inited() does, until the lexer needs
+ * more. Returns where the next data must start.
+ */
+const char* lex_some(hl_lexer* lexer, const char* b, const char* end,
+                     char* out, int* last_partial) {
+  hl_token token;
+
+  for (;;) {
+    token = hl_execute(lexer, b, end - b);
+    switch (token.kind) {
+      case HL_EAGAIN: return token.end;
+      case HL_ERROR: strcat(out, "<error>"); return token.end;
+      case HL_EOF: strcat(out, "<eof>"); return token.end;
+      case HL_UPGRADE: strcat(out, "<upgrade>"); return token.end;
+      case HL_MSG_START: strcat(out, "<msg>"); break;
+      case HL_HEADER_END: strcat(out, "<header_end>"); break;
+      case HL_MSG_END: strcat(out, "<msg_end>"); break;
+      default:
+        if (!*last_partial) strcat(out, token.kind == HL_BODY ? "{" : "[");
+        strncat(out, token.start, token.end - token.start);
+        if (!token.partial) strcat(out, token.kind == HL_BODY ? "}" : "]");
+        break;
+    }
+    b = token.end;
+    *last_partial = token.partial;
+    if (token.partial && b == end) return b;
+  }
+}
+
+void manual_test_snapshot() {
+  static const char* const names[] = { "Host", "Content-Type" };
+  static const char s[] =
+      "POST /a HTTP/1.1\r\n"
+      "Host: example.org\r\n"
+      "User-Agent: x\r\n"
+      "Connection: keep-alive\r\n"
+      "Transfer-Encoding: gzip, chunked\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "3;ext=1\r\nabc\r\n10\r\n0123456789abcdef\r\n0\r\n"
+      "X-Trailer: 1\r\n"
+      "\r\n"
+      "GET /b HTTP/1.0\r\n"
+      "Content-Length: 4\r\n"
+      "\r\n"
+      "wxyz";
+  const char* end = s + sizeof(s) - 1;
+  unsigned char snapshot[HL_LEXER_SNAPSHOT_MAX];
+  char expected[1024], out[1024];
+  hl_header_set set;
+  hl_lexer lexer, moved;
+  hl_limits limits;
+  const char* b;
+  ssize_t n;
+  size_t split;
+  int last_partial;
+
+  hl_header_set_init(&set, names, 2);
+  hl_limits_init(&limits);
+  hl_req_init(&lexer);
+  hl_set_headers(&lexer, &set);
+  *expected = '\0';
+  last_partial = 0;
+  assert(lex_some(&lexer, s, end, expected, &last_partial) == end);
+  assert(lexer.offset == sizeof(s) - 1);
+
+  for (split = 0; split < sizeof(s) - 1; split++) {
+    hl_req_init(&lexer);
+    hl_set_headers(&lexer, &set);
+    hl_set_limits(&lexer, &limits);
+    *out = '\0';
+    last_partial = 0;
+    b = lex_some(&lexer, s, s + split, out, &last_partial);
+
+    n = hl_lexer_serialize(&lexer, snapshot, sizeof(snapshot));
+    assert(n > 0 && n < 40);
+    memset(&moved, 0xab, sizeof(moved));
+    assert(hl_lexer_restore(&moved, snapshot, n) == n);
+    assert(moved.limits == NULL && moved.stats == NULL);
+    hl_set_headers(&moved, &set);
+    hl_set_limits(&moved, &limits);
+
+    assert(lex_some(&moved, b, end, out, &last_partial) == end);
+    if (strcmp(out, expected) != 0) {
+      printf("snapshot split = %d\n%s\n%s\n", (int)split, expected, out);
+      abort();
+    }
+    assert(moved.offset == sizeof(s) - 1);
+  }
+
+  /* Too short a buf, and snapshots that aren't. */
+  hl_req_init(&lexer);
+  n = hl_lexer_serialize(&lexer, snapshot, sizeof(snapshot));
+  assert(n > 0);
+  assert(hl_lexer_serialize(&lexer, snapshot, n - 1) == -1);
+  assert(hl_lexer_restore(&moved, snapshot, n - 1) == -1);
+  assert(hl_lexer_restore(&moved, snapshot, 0) == -1);
+  snapshot[0]++;
+  assert(hl_lexer_restore(&moved, snapshot, n) == -1);
+  snapshot[0]--;
+  snapshot[3] = 0x7f; /* The state. */
+  assert(hl_lexer_restore(&moved, snapshot, n) == -1);
+}
+
+/* Lexes s in two pieces, split bytes in, and returns the key of its head. */
+unsigned long key_of(const char* s, size_t split) {
+  static const char* const names[] = { "Host", "Accept-Encoding" };
+  const char* end = s + strlen(s);
+  const char* b;
+  char out[1024];
+  int last_partial = 0;
+  hl_header_set set;
+  hl_lexer lexer;
+  hl_key key;
+
+  hl_header_set_init(&set, names, 2);
+  hl_req_init(&lexer);
+  hl_set_headers(&lexer, &set);
+  hl_key_init(&key, HL_TOKEN_BIT(HL_METHOD) | HL_TOKEN_BIT(HL_URL), 3);
+  hl_set_key(&lexer, &key);
+  *out = '\0';
+  b = lex_some(&lexer, s, s + MIN(split, strlen(s)), out, &last_partial);
+  lex_some(&lexer, b, end, out, &last_partial);
+  assert(strstr(out, "<header_end>") && !strstr(out, "<error>"));
+  return key.hash;
+}
+
+void manual_test_key() {
+  static const char* const names[] = { "Host" };
+  static const char a[] =
+      "GET /a?b=1 HTTP/1.1\r\n"
+      "Host: example.org\r\n"
+      "User-Agent: x\r\n"
+      "Accept-Encoding: gzip\r\n"
+      "\r\n";
+  const char* same[] = {
+    "GET /a?b=1 HTTP/1.1\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "X-Other: 1\r\n"
+    "host:example.org\r\n"
+    "\r\n",
+    "GET /a?b=1 HTTP/1.1\r\n"
+    "Host:  example.org\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "Content-Length: 3\r\n"
+    "\r\n"
+    "abc",
+  };
+  const char* other[] = {
+    "HEAD /a?b=1 HTTP/1.1\r\nHost: example.org\r\n"
+    "Accept-Encoding: gzip\r\n\r\n",
+    "GET /a?b=2 HTTP/1.1\r\nHost: example.org\r\n"
+    "Accept-Encoding: gzip\r\n\r\n",
+    "GET /a?b=1 HTTP/1.1\r\nHost: example.com\r\n"
+    "Accept-Encoding: gzip\r\n\r\n",
+    "GET /a?b=1 HTTP/1.1\r\nHost: example.org\r\n"
+    "Accept-Encoding: br\r\n\r\n",
+    "GET /a?b=1 HTTP/1.1\r\nHost: example.org\r\n\r\n",
+    /* The same bytes in other parts. */
+    "GET /a?b=1 HTTP/1.1\r\nHost: gzip\r\n"
+    "Accept-Encoding: example.org\r\n\r\n",
+    "GET /a?b=1 HTTP/1.1\r\nHost: example.orggzip\r\n\r\n",
+  };
+  static const char pipelined[] =
+      "POST /x HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "1\r\nz\r\n0\r\nHost: b\r\n\r\n"
+      "POST /x HTTP/1.1\r\nHost: a\r\nContent-Length: 0\r\n\r\n";
+  unsigned long hash = key_of(a, 0);
+  unsigned long keys[2];
+  size_t split, k, n = 0;
+  hl_header_set set;
+  hl_lexer lexer;
+  hl_token token;
+  hl_key key;
+  const char* b;
+
+  assert(hash != 0);
+  for (split = 1; split < sizeof(a); split++) assert(key_of(a, split) == hash);
+  for (k = 0; k < sizeof(same) / sizeof(*same); k++) {
+    for (split = 0; split <= strlen(same[k]); split++) {
+      assert(key_of(same[k], split) == hash);
+    }
+  }
+  for (k = 0; k < sizeof(other) / sizeof(*other); k++) {
+    assert(key_of(other[k], 0) != hash);
+  }
+
+  /* Each head has its own key; the trailer is not part of it. */
+  hl_header_set_init(&set, names, 1);
+  hl_req_init(&lexer);
+  hl_set_headers(&lexer, &set);
+  hl_set_tokens(&lexer, HL_TOKEN_BIT(HL_HEADER_END));
+  hl_key_init(&key, HL_TOKEN_BIT(HL_URL), 1);
+  hl_set_key(&lexer, &key);
+  for (b = pipelined; (token = hl_execute(&lexer, b, strlen(b))).kind !=
+                      HL_EAGAIN; b = token.end) {
+    assert(token.kind == HL_HEADER_END);
+    keys[n++] = key.hash;
+  }
+  assert(n == 2 && keys[0] == keys[1] && key.hash == keys[0]);
+}
+
+/* Returns whether cache has response as the response to GET url. */
+int cached(hl_cache* cache, hl_cache_reader* reader, const char* url,
+           const char* response) {
+  hl_span span;
+  int found;
+
+  hl_cache_enter(cache, reader);
+  found = hl_cache_get(cache, HL_METHOD_GET, NULL, 0, url, strlen(url),
+                       &span) == 0;
+  if (found && response) {
+    assert((size_t)(span.end - span.start) == strlen(response));
+    assert(memcmp(span.start, response, strlen(response)) == 0);
+  }
+  hl_cache_leave(reader);
+  return found;
+}
+
+void manual_test_cache() {
+  static const char ok[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+  static const char robots[] =
+      "HTTP/1.1 200 OK\r\nContent-Length: 26\r\n\r\n"
+      "User-agent: *\nDisallow: /\n";
+  static char mem[2048];
+  hl_cache_entry* buckets[8];
+  hl_cache_reader readers[2];
+  hl_cache cache;
+  hl_span span;
+  char url[32], response[64], held[64];
+  int k, put;
+
+  assert(hl_cache_init(&cache, mem + 1, sizeof(mem) - 1, buckets, 6,
+                       readers, 2) == -1);
+  assert(hl_cache_init(&cache, mem + 1, sizeof(mem) - 1, buckets, 8,
+                       readers, 2) == 0);
+
+  assert(!cached(&cache, &readers[0], "/health", NULL));
+  assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, "/health", 7, ok,
+                      sizeof(ok) - 1) == 0);
+  assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, "/robots.txt", 11, robots,
+                      sizeof(robots) - 1) == 0);
+  assert(cache.count == 2);
+  assert(cached(&cache, &readers[0], "/health", ok));
+  assert(cached(&cache, &readers[1], "/robots.txt", robots));
+  assert(!cached(&cache, &readers[0], "/health/", NULL));
+  hl_cache_enter(&cache, &readers[0]);
+  assert(hl_cache_get(&cache, HL_METHOD_HEAD, NULL, 0, "/health", 7,
+                      &span) == -1);
+  assert(hl_cache_get(&cache, HL_METHOD_OTHER, NULL, 0, "/health", 7,
+                      &span) == -1);
+  hl_cache_leave(&readers[0]);
+
+  /* With virtual hosts, each host has its own. */
+  assert(hl_cache_put(&cache, HL_METHOD_GET, "a.example", 9, "/robots.txt",
+                      11, ok, sizeof(ok) - 1) == 0);
+  hl_cache_enter(&cache, &readers[0]);
+  assert(hl_cache_get(&cache, HL_METHOD_GET, "a.example", 9, "/robots.txt",
+                      11, &span) == 0);
+  assert(span.end - span.start == sizeof(ok) - 1);
+  assert(hl_cache_get(&cache, HL_METHOD_GET, "b.example", 9, "/robots.txt",
+                      11, &span) == -1);
+  assert(hl_cache_get(&cache, HL_METHOD_GET, "a.example/", 10, "robots.txt",
+                      10, &span) == -1);
+  hl_cache_leave(&readers[0]);
+  assert(cached(&cache, &readers[0], "/robots.txt", robots));
+  assert(hl_cache_remove(&cache, HL_METHOD_GET, "b.example", 9,
+                         "/robots.txt", 11) == -1);
+  assert(hl_cache_remove(&cache, HL_METHOD_GET, "a.example", 9,
+                         "/robots.txt", 11) == 0);
+
+  /* Replacing and removing. */
+  assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, "/health", 7, robots,
+                      sizeof(robots) - 1) == 0);
+  assert(cache.count == 2);
+  assert(cached(&cache, &readers[0], "/health", robots));
+  assert(hl_cache_remove(&cache, HL_METHOD_GET, NULL, 0, "/health", 7) == 0);
+  assert(hl_cache_remove(&cache, HL_METHOD_GET, NULL, 0, "/health", 7) == -1);
+  assert(!cached(&cache, &readers[0], "/health", NULL));
+  assert(cache.count == 1);
+
+  assert(hl_cache_put(&cache, HL_METHOD_OTHER, NULL, 0, "/x", 2, ok, 2) == -1);
+  assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, "/big", 4, mem,
+                      sizeof(mem)) == -1);
+
+  /* Within the budget, the oldest go first, except those got since they
+   * were last passed over.
+   */
+  assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, "/health", 7, ok,
+                      sizeof(ok) - 1) == 0);
+  for (k = 0; k < 200; k++) {
+    sprintf(url, "/%d", k);
+    sprintf(response, "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\n%03d", k);
+    assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, url, strlen(url),
+                        response, strlen(response)) == 0);
+    assert(cached(&cache, &readers[0], "/health", ok));
+  }
+  assert(cached(&cache, &readers[1], url, response));
+  assert(!cached(&cache, &readers[0], "/robots.txt", NULL));
+  assert(!cached(&cache, &readers[0], "/0", NULL));
+  assert(cache.count > 5 && cache.count < 2048 / 64);
+
+  /* A reader that is in keeps what it got, until it leaves. */
+  hl_cache_enter(&cache, &readers[1]);
+  assert(hl_cache_get(&cache, HL_METHOD_GET, NULL, 0, "/199", 4, &span) == 0);
+  memcpy(held, span.start, span.end - span.start);
+  for (k = 200, put = 0; k < 300; k++) {
+    sprintf(url, "/%d", k);
+    if (hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, url, strlen(url), ok,
+                     sizeof(ok) - 1) < 0) {
+      break;
+    }
+    put++;
+  }
+  assert(k < 300 && put > 0);
+  assert(memcmp(span.start, held, span.end - span.start) == 0);
+  hl_cache_leave(&readers[1]);
+  assert(hl_cache_put(&cache, HL_METHOD_GET, NULL, 0, url, strlen(url), ok,
+                      sizeof(ok) - 1) == 0);
+  assert(cached(&cache, &readers[0], url, ok));
+}
+
+/* Lexes s, moving timer on with each token. */
+void lex_timed(hl_lexer* lexer, hl_wheel* wheel, hl_timer* timer,
+               const char* s) {
+  const char* end = s + strlen(s);
+  hl_token token;
+
+  do {
+    token = hl_execute(lexer, s, end - s);
+    hl_wheel_token(wheel, timer, &token);
+    s = token.end;
+  } while (token.kind != HL_EAGAIN && token.kind != HL_ERROR &&
+           !(token.partial && s == end));
+}
+
+void manual_test_wheel() {
+  static hl_timer timers[3000];
+  static unsigned long expires[3000];
+  static char body[200];
+  hl_timeouts timeouts = { 10, 5, 100, 50 };
+  hl_wheel wheel;
+  hl_timer timer;
+  hl_timer* t;
+  hl_lexer lexer;
+  unsigned long now = 1000, before, seed = 1, n = 0, cancelled = 0;
+  size_t k;
+
+  /* Timers run out exactly when due, from a tick to past the wheel. */
+  hl_wheel_init(&wheel, &timeouts, now);
+  for (k = 0; k < 3000; k++) {
+    seed = seed * 1103515245 + 12345;
+    timeouts.header = 1 + (seed >> 8) % (k % 4 == 0 ? 60 : k % 4 == 1 ? 5000
+                                        : k % 4 == 2 ? 300000 : 3000000);
+    if (k % 1000 == 999) timeouts.header = (1UL << 24) + 777;
+    hl_timer_init(&timers[k]);
+    hl_wheel_set(&wheel, &timers[k], HL_TIMER_HEADER);
+    expires[k] = now + timeouts.header;
+    if (k % 7 == 0) {
+      hl_wheel_set(&wheel, &timers[k], HL_TIMER_OFF);
+      assert(timers[k].phase == HL_TIMER_OFF);
+      cancelled++;
+    }
+  }
+  assert(wheel.count == 3000 - cancelled);
+  while (wheel.count) {
+    seed = seed * 1103515245 + 12345;
+    before = now;
+    now += 1 + (seed >> 8) % (now < 1000 + 3000000 ? 3000 : 1000000);
+    while ((t = hl_wheel_expired(&wheel, now))) {
+      k = t - timers;
+      assert(k % 7 != 0 && t->phase == HL_TIMER_HEADER);
+      assert(before < expires[k] && expires[k] <= now);
+      n++;
+    }
+  }
+  assert(n == 3000 - cancelled);
+  assert(hl_wheel_expired(&wheel, now + 100) == NULL && wheel.now == now + 100);
+
+  /* Slowloris: the head must all be in within 10 ticks of its start. */
+  timeouts.header = 10;
+  hl_wheel_init(&wheel, &timeouts, 0);
+  hl_timer_init(&timer);
+  hl_req_init(&lexer);
+  hl_wheel_set(&wheel, &timer, HL_TIMER_HEADER);
+  assert(hl_wheel_expired(&wheel, 3) == NULL);
+  lex_timed(&lexer, &wheel, &timer, "GET / HTTP/1.1\r\n");
+  assert(timer.phase == HL_TIMER_HEADER);
+  lex_timed(&lexer, &wheel, &timer, "X-a: b\r\n");
+  assert(hl_wheel_expired(&wheel, 12) == NULL);
+  lex_timed(&lexer, &wheel, &timer, "X-a: b\r\n");
+  assert(hl_wheel_expired(&wheel, 13) == &timer);
+  assert(timer.phase == HL_TIMER_HEADER && wheel.count == 0);
+
+  /* The body must come at 100 bytes every 5 ticks. */
+  hl_req_init(&lexer);
+  memset(body, 'x', sizeof(body) - 1);
+  lex_timed(&lexer, &wheel, &timer,
+            "POST / HTTP/1.1\r\nContent-Length: 1000\r\n\r\n");
+  assert(timer.phase == HL_TIMER_BODY);
+  lex_timed(&lexer, &wheel, &timer, body);
+  assert(hl_wheel_expired(&wheel, 18) == NULL);
+  lex_timed(&lexer, &wheel, &timer, body + 150);
+  assert(hl_wheel_expired(&wheel, 22) == NULL);
+  assert(hl_wheel_expired(&wheel, 23) == &timer);
+  assert(timer.phase == HL_TIMER_BODY);
+
+  /* Then a keep-alive connection may idle for 50. */
+  hl_req_init(&lexer);
+  lex_timed(&lexer, &wheel, &timer, "GET / HTTP/1.1\r\n\r\n");
+  assert(timer.phase == HL_TIMER_IDLE);
+  assert(hl_wheel_expired(&wheel, 72) == NULL);
+  assert(hl_wheel_expired(&wheel, 73) == &timer);
+  lex_timed(&lexer, &wheel, &timer, "GET / HTTP/1.1\r\n\r\nGET /x HTT");
+  assert(timer.phase == HL_TIMER_HEADER);
+  lex_timed(&lexer, &wheel, &timer, "\r\n");
+  assert(timer.phase == HL_TIMER_OFF && wheel.count == 0);
+}
+
 int main() {
   int i, j, k;
 
@@ -339,12 +2710,39 @@ int main() {
   printf("sizeof(hl_lexer) = %d\n", (int)sizeof(hl_lexer));
 
   manual_test_CURL_GET();
+  manual_test_body_split();
+  manual_test_exact_buffer();
 
   for (i = 0; requests[i].name; i++) {
     printf("test_req(%d, %s)\n", i, requests[i].name);
     test_req(&requests[i]);
+    test_url(&requests[i]);
   }
 
+  manual_test_url_forms();
+  manual_test_url_normalize();
+  manual_test_query();
+  manual_test_multipart();
+  manual_test_form();
+  manual_test_hl2();
+  manual_test_hpack();
+  manual_test_hpack_encode();
+  manual_test_h2c();
+  manual_test_ws();
+  manual_test_proxy();
+  manual_test_list();
+  manual_test_cookie();
+  manual_test_header_set();
+  manual_test_method();
+  manual_test_tokens();
+  manual_test_limits();
+  manual_test_errors();
+  manual_test_stats();
+  manual_test_snapshot();
+  manual_test_key();
+  manual_test_cache();
+  manual_test_wheel();
+
   for (i = 0; requests[i].name && requests[i].should_keep_alive; i++) {
     for (j = 0; requests[j].name && requests[j].should_keep_alive; j++) {
       for (k = 0; requests[k].name; k++) {
@@ -0,0 +1,160 @@
+#include <stddef.h>
+#include <string.h>
+#include "timer.h"
+
+#define MASK (HL_WHEEL_SLOTS - 1)
+
+/* Ticks a timer can be from now and still have a slot. Later ones are put
+ * at the last and moved on when they get there.
+ */
+#define SPAN (1UL << (HL_WHEEL_BITS * HL_WHEEL_LEVELS))
+
+void hl_wheel_init(hl_wheel* wheel, const hl_timeouts* timeouts,
+                   unsigned long now) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->timeouts = timeouts;
+  wheel->now = now;
+}
+
+void hl_timer_init(hl_timer* timer) {
+  memset(timer, 0, sizeof(*timer));
+  timer->prev = NULL;
+  timer->next = NULL;
+}
+
+static void push(hl_timer** list, hl_timer* timer) {
+  timer->next = *list;
+  if (*list) (*list)->prev = &timer->next;
+  timer->prev = list;
+  *list = timer;
+}
+
+static void take(hl_wheel* wheel, hl_timer* timer) {
+  if (timer->level < HL_WHEEL_LEVELS) wheel->levels[timer->level]--;
+  *timer->prev = timer->next;
+  if (timer->next) timer->next->prev = timer->prev;
+  timer->prev = NULL;
+}
+
+/* Puts timer in the slot for timer->expires, or on the due list. */
+static void place(hl_wheel* wheel, hl_timer* timer) {
+  unsigned long at = timer->expires;
+  unsigned long delta = at - wheel->now;
+  int level;
+
+  if ((long)delta <= 0) {
+    timer->level = HL_WHEEL_LEVELS;
+    push(&wheel->due, timer);
+    return;
+  }
+  if (delta >= SPAN) {
+    delta = SPAN - 1;
+    at = wheel->now + delta;
+  }
+  for (level = 0; delta >> (HL_WHEEL_BITS * (level + 1)); level++);
+  timer->level = level;
+  wheel->levels[level]++;
+  push(&wheel->slots[level][at >> (HL_WHEEL_BITS * level) & MASK], timer);
+}
+
+void hl_wheel_set(hl_wheel* wheel, hl_timer* timer, unsigned char phase) {
+  const hl_timeouts* t = wheel->timeouts;
+  unsigned long ticks = phase == HL_TIMER_HEADER ? t->header
+                        : phase == HL_TIMER_BODY ? t->body
+                        : phase == HL_TIMER_IDLE ? t->idle : 0;
+
+  if (timer->prev) {
+    take(wheel, timer);
+    wheel->count--;
+  }
+  timer->phase = ticks ? phase : HL_TIMER_OFF;
+  timer->bytes = 0;
+  if (ticks == 0) return;
+  timer->expires = wheel->now + ticks;
+  place(wheel, timer);
+  wheel->count++;
+}
+
+void hl_wheel_token(hl_wheel* wheel, hl_timer* timer, const hl_token* token) {
+  switch (token->kind) {
+    case HL_MSG_START: hl_wheel_set(wheel, timer, HL_TIMER_HEADER); break;
+    case HL_HEADER_END: hl_wheel_set(wheel, timer, HL_TIMER_BODY); break;
+    case HL_MSG_END: hl_wheel_set(wheel, timer, HL_TIMER_IDLE); break;
+    case HL_BODY: timer->bytes += token->end - token->start; break;
+    case HL_EOF:
+    case HL_ERROR:
+    case HL_UPGRADE:
+      hl_wheel_set(wheel, timer, HL_TIMER_OFF);
+      break;
+    default: break;
+  }
+}
+
+/* Moves the timers in a slot of a higher level to where they belong now. */
+static void cascade(hl_wheel* wheel, int level) {
+  hl_timer** slot =
+      &wheel->slots[level][wheel->now >> (HL_WHEEL_BITS * level) & MASK];
+  hl_timer* timer;
+
+  while ((timer = *slot)) {
+    take(wheel, timer);
+    place(wheel, timer);
+  }
+}
+
+/* Moves the wheel on one tick. */
+static void tick(hl_wheel* wheel) {
+  hl_timer** slot;
+  hl_timer* timer;
+  int level;
+
+  wheel->now++;
+  /* Higher levels first; a timer may fall through several. */
+  for (level = HL_WHEEL_LEVELS - 1; level > 0; level--) {
+    if ((wheel->now & ((1UL << (HL_WHEEL_BITS * level)) - 1)) == 0) {
+      cascade(wheel, level);
+    }
+  }
+  slot = &wheel->slots[0][wheel->now & MASK];
+  while ((timer = *slot)) {
+    take(wheel, timer);
+    place(wheel, timer); /* Due, unless it was too far off for a slot. */
+  }
+}
+
+hl_timer* hl_wheel_expired(hl_wheel* wheel, unsigned long now) {
+  const hl_timeouts* t = wheel->timeouts;
+  hl_timer* timer;
+  unsigned long next;
+  int level;
+
+  for (;;) {
+    while (wheel->due == NULL && (long)(now - wheel->now) > 0) {
+      for (level = 0; level < HL_WHEEL_LEVELS && !wheel->levels[level];
+           level++);
+      if (level) {
+        /* Nothing below level, so nothing happens until it cascades. */
+        next = level == HL_WHEEL_LEVELS ? now + 1
+               : (wheel->now | ((1UL << (HL_WHEEL_BITS * level)) - 1)) + 1;
+        if ((long)(next - now) > 0) {
+          wheel->now = now;
+          break;
+        }
+        wheel->now = next - 1;
+      }
+      tick(wheel);
+    }
+    timer = wheel->due;
+    if (timer == NULL) return NULL;
+    take(wheel, timer);
+    wheel->count--;
+
+    if (timer->phase == HL_TIMER_BODY && timer->bytes >= t->body_min &&
+        t->body_min) {
+      /* Enough since the last check; check again later. */
+      hl_wheel_set(wheel, timer, HL_TIMER_BODY);
+      continue;
+    }
+    return timer;
+  }
+}
@@ -0,0 +1,104 @@
+/* Timer wheel for connection deadlines, in the style of hl.h:
+ * - Hierarchical: 4 levels of 64 slots. Setting and cancelling a timer is
+ *   O(1), and so is each timer's expiry, however many there are.
+ * - Timers live in the caller's connection structs. No allocations, no
+ *   syscalls, no callbacks: expired timers are pulled with
+ *   hl_wheel_expired().
+ * - Slowloris defense, from the tokens of hl_execute(): the whole head
+ *   within a time, the body at a minimum rate, and keep-alive connections
+ *   idle for at most a time.
+ *
+ * Time is in ticks of the caller's choosing, E.G. 100 ms, passed to
+ * hl_wheel_expired(). Deadlines are counted from the last time passed.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <sys/types.h>
+#include "hl.h"
+
+#define HL_WHEEL_BITS 6
+#define HL_WHEEL_SLOTS (1 << HL_WHEEL_BITS)
+#define HL_WHEEL_LEVELS 4
+
+/* What a timer is timing; after hl_wheel_expired(), what ran out. */
+enum {
+  HL_TIMER_OFF,
+  HL_TIMER_HEADER, /* From HL_MSG_START to HL_HEADER_END. 408. */
+  HL_TIMER_BODY, /* Too little body for too long. 408. */
+  HL_TIMER_IDLE /* From HL_MSG_END to the next HL_MSG_START. Just close. */
+};
+
+/* Ticks for each phase; 0 means no deadline. */
+typedef struct {
+  unsigned long header;
+  unsigned long body; /* Between checks of the body's progress. */
+  unsigned long body_min; /* Bytes of body each check wants. */
+  unsigned long idle;
+} hl_timeouts;
+
+typedef struct hl_timer hl_timer;
+
+/* One for each connection, E.G. in its struct; find the struct from the
+ * timer with offsetof().
+ */
+struct hl_timer {
+  /* private */
+  hl_timer* next;
+  hl_timer** prev; /* The pointer to this timer. NULL if not set. */
+  unsigned long expires;
+  unsigned long bytes; /* Of body since the last check. */
+  unsigned char level; /* HL_WHEEL_LEVELS when due. */
+
+  /* read-only */
+  unsigned char phase; /* HL_TIMER_* */
+};
+
+typedef struct {
+  /* private */
+  hl_timer* slots[HL_WHEEL_LEVELS][HL_WHEEL_SLOTS];
+  hl_timer* due;
+  size_t levels[HL_WHEEL_LEVELS]; /* Timers in each level's slots. */
+  const hl_timeouts* timeouts;
+
+  /* read-only */
+  unsigned long now; /* Ticks up to which timers have expired. */
+  size_t count; /* Timers set, due ones included. */
+} hl_wheel;
+
+/* Initializes a wheel at time now for timers with timeouts, which must
+ * outlive it and can be shared.
+ */
+void hl_wheel_init(hl_wheel* wheel, const hl_timeouts* timeouts,
+                   unsigned long now);
+
+/* Initializes timer as not set. */
+void hl_timer_init(hl_timer* timer);
+
+/* Sets timer to run out after the ticks timeouts give phase, or cancels it
+ * for HL_TIMER_OFF or a timeout of 0. Replaces what it was timing. On
+ * accept, set HL_TIMER_HEADER so that a client that never sends is cut
+ * off.
+ */
+void hl_wheel_set(hl_wheel* wheel, hl_timer* timer, unsigned char phase);
+
+/* Moves timer on for a token from hl_execute() on its connection:
+ * HL_MSG_START sets HL_TIMER_HEADER, HL_HEADER_END HL_TIMER_BODY and
+ * HL_MSG_END HL_TIMER_IDLE. HL_BODY counts toward the body's progress.
+ * HL_EOF, HL_ERROR and HL_UPGRADE cancel the timer. Keep those kinds in
+ * hl_set_tokens().
+ *
+ * Between HL_MSG_END and the response being sent, the idle timer runs;
+ * set HL_TIMER_OFF while the application works on it if that's too short.
+ */
+void hl_wheel_token(hl_wheel* wheel, hl_timer* timer, const hl_token* token);
+
+/* Advances the wheel to now and returns a timer that has run out, taken off
+ * the wheel with timer->phase saying which, or NULL when there are no more.
+ * A body timer whose connection got body_min bytes since the last check is
+ * set again instead. Call until NULL, E.G. after each poll().
+ */
+hl_timer* hl_wheel_expired(hl_wheel* wheel, unsigned long now);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include "ws.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# define HL_SSE2 1
+# include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) && defined(__GNUC__)
+# define HL_AVX2 1
+# include <immintrin.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+enum state {
+  WS_HEADER,
+  WS_PAYLOAD,
+  WS_FRAME_END
+};
+
+static void init(hl_ws* ws, int masked) {
+  ws->last = HL_WS_EAGAIN;
+  ws->state = WS_HEADER;
+  ws->i = 0;
+  ws->need = 2;
+  ws->message = 0;
+  ws->frame_message = 0;
+  ws->masked = masked;
+  ws->remaining = 0;
+  ws->opcode = 0;
+  ws->fin = 0;
+  ws->length = 0;
+}
+
+void hl_ws_server_init(hl_ws* ws) {
+  init(ws, 1);
+}
+
+void hl_ws_client_init(hl_ws* ws) {
+  init(ws, 0);
+}
+
+void hl_ws_mask(char* data,
+                size_t len,
+                const unsigned char key[4],
+                unsigned long offset) {
+  unsigned char k[sizeof(unsigned long)];
+  unsigned long w, wk;
+  size_t i = 0, j;
+
+  /* Rotate the key so k[0] applies to data[0]. Every step below is a
+   * multiple of 4 bytes, so it stays lined up.
+   */
+  for (j = 0; j < sizeof(k); j++) k[j] = key[(offset + j) & 3];
+
+#if HL_AVX2
+  if (len >= 32) {
+    int m;
+    __m256i mask;
+    memcpy(&m, k, 4);
+    mask = _mm256_set1_epi32(m);
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+      _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(v, mask));
+    }
+  }
+#endif
+
+#if HL_SSE2
+  if (len - i >= 16) {
+    int m;
+    __m128i mask;
+    memcpy(&m, k, 4);
+    mask = _mm_set1_epi32(m);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+      _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, mask));
+    }
+  }
+#endif
+
+  memcpy(&wk, k, sizeof(wk));
+  for (; i + sizeof(w) <= len; i += sizeof(w)) {
+    memcpy(&w, data + i, sizeof(w));
+    w ^= wk;
+    memcpy(data + i, &w, sizeof(w));
+  }
+
+  for (; i < len; i++) data[i] ^= k[i & 3];
+}
+
+/* Returns the length of the frame header that starts with h[0], h[1]. */
+static unsigned char header_len(const unsigned char* h) {
+  unsigned char len = 2;
+
+  if ((h[1] & 0x7f) == 126) len += 2;
+  if ((h[1] & 0x7f) == 127) len += 8;
+  if (h[1] & 0x80) len += 4;
+  return len;
+}
+
+/* Loads the frame header h, checks it against RFC 6455 section 5 and picks
+ * the next state. Returns 0 or a close code.
+ */
+static unsigned int frame_start(hl_ws* ws, const unsigned char* h) {
+  unsigned long len = h[1] & 0x7f;
+  int masked = (h[1] & 0x80) != 0;
+  int i;
+
+  ws->fin = h[0] & 0x80 ? 1 : 0;
+  ws->opcode = h[0] & 0x0f;
+  if (h[0] & 0x70) return HL_WS_PROTOCOL_ERROR; /* RSV without extension */
+  h += 2;
+
+  if (len == 126) {
+    len = ((unsigned long)h[0] << 8) | h[1];
+    h += 2;
+  } else if (len == 127) {
+    if (h[0] & 0x80) return HL_WS_PROTOCOL_ERROR;
+    len = 0;
+    for (i = 0; i < 8; i++) {
+      /* Too big for unsigned long, on 32 bit systems. */
+      if (len >> (sizeof(len) * 8 - 8)) return HL_WS_MESSAGE_TOO_BIG;
+      len = (len << 8) | h[i];
+    }
+    h += 8;
+  }
+  ws->length = ws->remaining = len;
+
+  if (masked != ws->masked) return HL_WS_PROTOCOL_ERROR;
+  if (ws->masked) memcpy(ws->key, h, 4);
+
+  switch (ws->opcode) {
+    case HL_WS_CONTINUATION:
+      if (!ws->message) return HL_WS_PROTOCOL_ERROR;
+      ws->frame_message = ws->message;
+      if (ws->fin) ws->message = 0;
+      break;
+
+    case HL_WS_TEXT:
+    case HL_WS_BINARY:
+      /* The previous message must be finished first. */
+      if (ws->message) return HL_WS_PROTOCOL_ERROR;
+      ws->frame_message = ws->opcode;
+      if (!ws->fin) ws->message = ws->opcode;
+      break;
+
+    case HL_WS_CLOSE:
+    case HL_WS_PING:
+    case HL_WS_PONG:
+      /* Control frames may come between fragments but not be fragmented. */
+      if (!ws->fin || len > 125) return HL_WS_PROTOCOL_ERROR;
+      ws->frame_message = ws->opcode;
+      break;
+
+    default:
+      return HL_WS_PROTOCOL_ERROR;
+  }
+
+  ws->state = len ? WS_PAYLOAD : WS_FRAME_END;
+  return 0;
+}
+
+hl_ws_token hl_ws_execute(hl_ws* ws, char* data, size_t len) {
+  hl_ws_token token; /* returned token */
+  char* head = data; /* lexer head */
+  char* end = data + len;
+  size_t to_read;
+  unsigned int err;
+
+  token.kind = ws->last;
+  token.start = ws->last == HL_WS_EAGAIN ? NULL : data;
+  token.end = NULL;
+  token.partial = 0;
+  token.value = 0;
+
+  for (; head < end || ws->state == WS_FRAME_END; head++) {
+    switch (ws->state) {
+      default: assert(0);
+
+      case WS_HEADER: {
+        if (ws->i == 0 && end - head >= 2 &&
+            end - head >= header_len((const unsigned char*)head)) {
+          /* The whole header is here; no need to copy it. */
+          ws->need = header_len((const unsigned char*)head);
+          err = frame_start(ws, (const unsigned char*)head);
+          head += ws->need - 1;
+        } else {
+          ws->header[ws->i++] = (unsigned char)*head;
+          if (ws->i == 2) ws->need = header_len(ws->header);
+          if (ws->i < ws->need) break;
+          err = frame_start(ws, ws->header);
+        }
+        ws->i = 0;
+        ws->need = 2;
+        if (err) goto error;
+
+        token.kind = HL_WS_FRAME_START;
+        token.start = token.end = head + 1;
+        goto token_complete;
+      }
+
+      case WS_PAYLOAD: {
+        token.kind = HL_WS_PAYLOAD;
+        token.start = head;
+        to_read = MIN((size_t)(end - head), ws->remaining);
+        if (ws->masked) {
+          hl_ws_mask(head, to_read, ws->key, ws->length - ws->remaining);
+        }
+        ws->remaining -= to_read;
+        head += to_read;
+
+        if (ws->remaining == 0) {
+          token.end = head;
+          ws->state = WS_FRAME_END;
+          goto token_complete;
+        }
+        head--; /* Undo the loop's head++. */
+        break;
+      }
+
+      case WS_FRAME_END: {
+        token.kind = HL_WS_FRAME_END;
+        token.start = token.end = head;
+        ws->state = WS_HEADER;
+        goto token_complete;
+      }
+    }
+  }
+
+  token.end = head;
+  token.partial = token.kind != HL_WS_EAGAIN;
+  ws->last = token.kind;
+  goto frame;
+
+token_complete:
+  assert(token.partial == 0);
+  assert(token.end);
+  ws->last = HL_WS_EAGAIN;
+  goto frame;
+
+error:
+  token.kind = HL_WS_ERROR;
+  token.start = NULL;
+  token.end = head;
+  token.value = err;
+
+frame:
+  token.opcode = ws->opcode;
+  token.fin = ws->fin;
+  token.message = ws->frame_message;
+  token.length = ws->length;
+  return token;
+}
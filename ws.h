@@ -0,0 +1,118 @@
+/* WebSocket frame lexer (RFC 6455) in the style of hl.h:
+ * - Frame headers with 7, 16 and 64 bit lengths.
+ * - Fragmented messages, with control frames between the fragments.
+ * - Payloads unmasked in place, 16 or 32 bytes at a time with SSE2/AVX2.
+ * - No syscalls, no allocations, no callbacks.
+ * - Resumable at any byte.
+ *
+ * Use it on the data after HL_UPGRADE when lexer->upgrade is
+ * HL_UPGRADE_WEBSOCKET. Extensions (RSV bits) are not supported.
+ */
+
+#ifndef WS_H
+#define WS_H
+
+#include <sys/types.h>
+
+/* Every WebSocket connection is broken up into tokens:
+
+   (HL_WS_FRAME_START
+    HL_WS_PAYLOAD*
+    HL_WS_FRAME_END)*
+ */
+
+typedef enum {
+  HL_WS_EAGAIN, /* Needs more input; read the next packet. */
+  HL_WS_ERROR, /* Bad frame. Send a Close frame with token.value and close. */
+
+  HL_WS_FRAME_START, /* A frame header. See token.opcode, fin, length. */
+  HL_WS_PAYLOAD, /* Payload data, already unmasked. */
+  HL_WS_FRAME_END
+} hl_ws_token_kind;
+
+/* Opcodes. */
+enum {
+  HL_WS_CONTINUATION = 0x0,
+  HL_WS_TEXT = 0x1,
+  HL_WS_BINARY = 0x2,
+  HL_WS_CLOSE = 0x8,
+  HL_WS_PING = 0x9,
+  HL_WS_PONG = 0xa
+};
+
+/* Close codes, RFC 6455 7.4.1. */
+enum {
+  HL_WS_NORMAL_CLOSURE = 1000,
+  HL_WS_PROTOCOL_ERROR = 1002,
+  HL_WS_MESSAGE_TOO_BIG = 1009
+};
+
+typedef struct {
+  hl_ws_token_kind kind;
+
+  /* As in hl_token. Points for HL_WS_FRAME_START and HL_WS_FRAME_END, strings
+   * for HL_WS_PAYLOAD.
+   */
+  const char* start;
+  const char* end;
+  char partial;
+
+  /* The frame the token belongs to. */
+  unsigned char opcode;
+  unsigned char fin; /* non-zero on the last frame of a message */
+
+  /* The opcode of the message a data frame belongs to, HL_WS_TEXT or
+   * HL_WS_BINARY, also for its HL_WS_CONTINUATION frames. For control
+   * frames the same as opcode.
+   */
+  unsigned char message;
+  unsigned long length; /* of the payload */
+
+  unsigned int value; /* HL_WS_ERROR: the close code to send */
+} hl_ws_token;
+
+typedef struct {
+  /* private */
+  hl_ws_token_kind last;
+  unsigned char state;
+  unsigned char i;
+  unsigned char need; /* header bytes needed */
+  unsigned char message; /* opcode of the unfinished message, or 0 */
+  unsigned char frame_message; /* token.message */
+  char masked; /* frames must be masked: we are a server */
+  unsigned char header[14];
+  unsigned char key[4];
+  unsigned long remaining;
+
+  /* read-only. The current frame header. */
+  unsigned char opcode;
+  unsigned char fin;
+  unsigned long length;
+} hl_ws;
+
+/* Initializes a lexer for what clients send. Used in servers. Frames must be
+ * masked.
+ */
+void hl_ws_server_init(hl_ws* ws);
+
+/* Initializes a lexer for what servers send. Used in clients. Frames must not
+ * be masked.
+ */
+void hl_ws_client_init(hl_ws* ws);
+
+/* Works like hl_execute(): call it repeatedly with buf = token.end until
+ * HL_WS_EAGAIN or HL_WS_ERROR is returned. buf is not const: masked payloads
+ * are unmasked where they are.
+ */
+hl_ws_token hl_ws_execute(hl_ws* ws, char* buf, size_t buflen);
+
+/* XORs data with the masking key in place. offset is the position of data in
+ * the payload. Masking and unmasking are the same, so clients can use this
+ * to mask what they send.
+ */
+void hl_ws_mask(char* data,
+                size_t len,
+                const unsigned char key[4],
+                unsigned long offset);
+
+#endif  /* WS_H */